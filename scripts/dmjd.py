@@ -46,6 +46,23 @@ def secs_2_dmjd(secs):
     dmjd = (secs/86400) + 40587
     return dmjd + ((secs % 86400)/86400.)
 
+# Splits a (possibly fractional) Unix time into an integer MJD and a day
+# fraction string, so the start time survives the status buffer at full
+# precision (STRTDMJD is only stored with 6 decimal places)
+def secs_2_mjd_split(secs):
+    days = int(math.floor(secs / 86400.))
+    frac = (secs - days * 86400.) / 86400.
+    return (days + 40587, "%.15f" % frac)
+
+def set_split_start(secs):
+    imjd, fmjd = secs_2_mjd_split(secs)
+    cmd = "hashpipe_check_status -k STRTIMJD -i %d" % imjd
+    print cmd
+    call(shlex.split(cmd))
+    cmd = "hashpipe_check_status -k STRTFMJD -s %s" % fmjd
+    print cmd
+    call(shlex.split(cmd))
+
 def dmjd_2_secs(dmjd):
     d, mjd = math.modf(dmjd)
     return (86400 * (mjd - 40587)) + (86400 * d)
@@ -78,6 +95,7 @@ for arg in iter_argv:
         cmd = "hashpipe_check_status -k STRTDMJD -d %f" % start_time_dmjd
         print cmd
         call(shlex.split(cmd))
+        set_split_start(time_secs)
         
     elif arg == "--scanlength":
         scanlen = next(iter_argv)
@@ -103,6 +121,7 @@ for arg in iter_argv:
         print cmd
 
         call(shlex.split(cmd))
+        set_split_start(start_time_sec)
     else:
         print "Invalid arguments: %s" % (' '.join(sys.argv[1:]))
         usage()
@@ -0,0 +1,100 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ACC_X86 1
+#endif
+
+#include "accumulate.h"
+
+static int have_avx = 0;
+
+#ifdef ACC_X86
+static __attribute__((constructor)) void acc_detect()
+{
+    __builtin_cpu_init();
+    have_avx = __builtin_cpu_supports("avx");
+}
+
+__attribute__((target("avx")))
+static size_t acc_add_avx(float *sum, const float *src, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(sum + i, _mm256_add_ps(_mm256_loadu_ps(sum + i),
+                                                _mm256_loadu_ps(src + i)));
+    return i;
+}
+
+__attribute__((target("avx")))
+static size_t acc_add_kahan_avx(float *sum, float *comp, const float *src, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        __m256 s = _mm256_loadu_ps(sum + i);
+        __m256 y = _mm256_sub_ps(_mm256_loadu_ps(src + i), _mm256_loadu_ps(comp + i));
+        __m256 t = _mm256_add_ps(s, y);
+        _mm256_storeu_ps(comp + i, _mm256_sub_ps(_mm256_sub_ps(t, s), y));
+        _mm256_storeu_ps(sum + i, t);
+    }
+    return i;
+}
+#endif
+
+void acc_add(float *sum, const float *src, size_t n)
+{
+    size_t i = 0;
+
+#ifdef ACC_X86
+    if (have_avx)
+        i = acc_add_avx(sum, src, n);
+#endif
+    for (; i < n; i++)
+        sum[i] += src[i];
+}
+
+void acc_add_kahan(float *sum, float *comp, const float *src, size_t n)
+{
+    size_t i = 0;
+    float y, t;
+
+#ifdef ACC_X86
+    if (have_avx)
+        i = acc_add_kahan_avx(sum, comp, src, n);
+#endif
+    for (; i < n; i++)
+    {
+        y = src[i] - comp[i];
+        t = sum[i] + y;
+        comp[i] = (t - sum[i]) - y;
+        sum[i] = t;
+    }
+}
+
+const char *acc_isa(void)
+{
+    return have_avx ? "AVX" : "scalar";
+}
@@ -0,0 +1,42 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef ACCUMULATE_H
+#define ACCUMULATE_H
+
+#include <stddef.h>
+
+// Kernels used by accumulator_thread to sum blocks. Each uses AVX when the
+//   CPU has it (checked once at load time) and falls back to scalar code
+//   otherwise
+
+// sum[i] += src[i]
+void acc_add(float *sum, const float *src, size_t n);
+
+// sum[i] += src[i] with Kahan compensation; comp carries the running
+//   error of each element and must start out zeroed
+void acc_add_kahan(float *sum, float *comp, const float *src, size_t n);
+
+// Name of the code path in use, for logging
+const char *acc_isa(void);
+
+#endif
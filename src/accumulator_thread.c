@@ -0,0 +1,232 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+// Sums ACCLEN consecutive blocks of a scan into one. Sits between
+//   fake_gpu_thread and fits_writer_thread:
+// $ hashpipe -p fake_gpu -I 0 -c 3 fake_gpu_thread -c 4 accumulator_thread -c 5 fits_writer_thread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "hashpipe.h"
+#include "gpu_output_databuf.h"
+#include "accumulate.h"
+
+// Only the channel data is summed; the padding after it stays zero
+#define ACC_VALID_FLOATS (CHAN_DATA_OFFSET(NUM_CHANNELS))
+
+static int init(struct hashpipe_thread_args *args)
+{
+    hashpipe_status_t st = args->st;
+
+    hashpipe_status_lock_safe(&st);
+    hputi4(st.buf, "ACCLEN", 1);
+    hputi4(st.buf, "ACCKAHAN", 0);
+    hashpipe_status_unlock_safe(&st);
+
+    fprintf(stderr, "accumulator_thread using %s adds\n", acc_isa());
+
+    return 0;
+}
+
+// Waits for an input block to be filled. Returns -1 if the threads are
+//   stopping; exits the thread on databuf errors
+static int wait_filled(gpu_output_databuf_t *db, int block_idx, hashpipe_status_t *st,
+                       const char *status_key)
+{
+    int rv;
+
+    while ((rv=gpu_output_databuf_wait_filled(db, block_idx)) != HASHPIPE_OK)
+    {
+        if (rv==HASHPIPE_TIMEOUT) {
+            if (!run_threads())
+                return -1;
+            hashpipe_status_lock_safe(st);
+            hputs(st->buf, status_key, "waiting");
+            hashpipe_status_unlock_safe(st);
+            continue;
+        }
+        else
+        {
+            hashpipe_error(__FUNCTION__, "error waiting for filled databuf");
+            pthread_exit(NULL);
+        }
+    }
+    gpu_output_databuf_claim(db, block_idx);
+    return 0;
+}
+
+// As wait_filled(), for an output block to be freed
+static int wait_free(gpu_output_databuf_t *db, int block_idx, hashpipe_status_t *st,
+                     const char *status_key)
+{
+    int rv;
+
+    while ((rv=gpu_output_databuf_wait_free(db, block_idx)) != HASHPIPE_OK)
+    {
+        if (rv==HASHPIPE_TIMEOUT) {
+            if (!run_threads())
+                return -1;
+            hashpipe_status_lock_safe(st);
+            hputs(st->buf, status_key, "blocked");
+            hashpipe_status_unlock_safe(st);
+            continue;
+        }
+        else
+        {
+            hashpipe_error(__FUNCTION__, "error waiting for free databuf");
+            pthread_exit(NULL);
+        }
+    }
+    return 0;
+}
+
+// Hands a finished sum to the writer
+static void publish(gpu_output_databuf_t *db, int block_idx)
+{
+    gpu_output_databuf_block_header_t *header = &db->block[block_idx].header;
+
+    clock_gettime(CLOCK_MONOTONIC, &header->fill_stop);
+    // Consumers in chunked mode wait for this before reading the header
+    __atomic_store_n(&header->chans_ready, NUM_CHANNELS, __ATOMIC_RELEASE);
+    gpu_output_databuf_set_filled(db, block_idx);
+}
+
+static void *run(hashpipe_thread_args_t * args)
+{
+    gpu_output_databuf_t *db_in = (gpu_output_databuf_t *)args->ibuf;
+    gpu_output_databuf_t *db_out = (gpu_output_databuf_t *)args->obuf;
+    hashpipe_status_t st = args->st;
+    const char * status_key = args->thread_desc->skey;
+
+    int in_idx = 0;
+    int out_idx = 0;
+    gpu_output_databuf_block_t *in;
+    gpu_output_databuf_block_t *out = NULL;
+
+    // Blocks per sum and whether to compensate, read at each scan's first block
+    int acc_len = 1;
+    int kahan = 0;
+    // The number of input blocks in the current sum
+    int acc_count = 0;
+    // Running Kahan compensation of the current sum
+    static float comp[ACC_VALID_FLOATS];
+
+    while (run_threads())
+    {
+        if (wait_filled(db_in, in_idx, &st, status_key) != 0)
+            break;
+        in = &db_in->block[in_idx];
+
+        if (in->header.scan_block == 0)
+        {
+            // A scan that was stopped early leaves a partial sum behind
+            if (acc_count > 0)
+            {
+                publish(db_out, out_idx);
+                out_idx = (out_idx + 1) % NUM_BLOCKS;
+                acc_count = 0;
+            }
+
+            hashpipe_status_lock_safe(&st);
+            hgeti4(st.buf, "ACCLEN", &acc_len);
+            hgeti4(st.buf, "ACCKAHAN", &kahan);
+            hashpipe_status_unlock_safe(&st);
+            if (acc_len < 1)
+                acc_len = 1;
+
+            fprintf(stderr, "accumulator_thread: scan %d, summing %d blocks%s\n",
+                    in->header.scan_num, acc_len, kahan ? " (Kahan)" : "");
+        }
+
+        hashpipe_status_lock_safe(&st);
+        hputs(st.buf, status_key, "accumulating");
+        hashpipe_status_unlock_safe(&st);
+
+        if (acc_count == 0)
+        {
+            if (wait_free(db_out, out_idx, &st, status_key) != 0)
+                break;
+            out = &db_out->block[out_idx];
+
+            // The sum is labelled with its first block's mcnt and time
+            out->header = in->header;
+            out->header.acc_len = 0;
+            out->header.chans_ready = 0;
+            memcpy(out->data, in->data, sizeof (out->data));
+            if (kahan)
+                memset(comp, 0, sizeof (comp));
+        }
+        else if (kahan)
+        {
+            acc_add_kahan(out->data, comp, in->data, ACC_VALID_FLOATS);
+        }
+        else
+        {
+            acc_add(out->data, in->data, ACC_VALID_FLOATS);
+        }
+        out->header.acc_len += in->header.acc_len > 0 ? in->header.acc_len : 1;
+        // Blocks the producer dropped within the sum are left out of it
+        if (acc_count > 0)
+            out->header.dropped += in->header.dropped;
+        acc_count++;
+
+        // The scan's last block closes a sum early
+        int last_in_scan = in->header.scan_block + 1 >= in->header.scan_nblocks;
+
+        // chans_ready must be cleared first so that a stale count is
+        //   never mistaken for the next fill
+        __atomic_store_n(&in->header.chans_ready, 0, __ATOMIC_RELEASE);
+        clock_gettime(CLOCK_MONOTONIC, &in->header.freed);
+        gpu_output_databuf_set_free(db_in, in_idx);
+        in_idx = (in_idx + 1) % NUM_BLOCKS;
+
+        if (acc_count >= acc_len || last_in_scan)
+        {
+            publish(db_out, out_idx);
+            out_idx = (out_idx + 1) % NUM_BLOCKS;
+            acc_count = 0;
+        }
+
+        pthread_testcancel();
+    }
+
+    return THREAD_OK;
+}
+
+static hashpipe_thread_desc_t accumulator_thread = {
+    name: "accumulator_thread",
+    skey: "ACCSTAT",
+    init: init,
+    run:  run,
+    ibuf_desc: {gpu_output_databuf_create},
+    obuf_desc: {gpu_output_databuf_create}
+};
+
+static __attribute__((constructor)) void ctor()
+{
+  register_hashpipe_thread(&accumulator_thread);
+}
@@ -0,0 +1,240 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BL_X86 1
+#endif
+
+#include "baseline_select.h"
+#include "covariance.h"
+
+#define NUM_ELEMENTS (NUM_ANTENNAS / 2)
+// Sign of the imaginary half of a complex pair viewed as a 64-bit word
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define IMAG_SIGN (1ULL << 63)
+#else
+#define IMAG_SIGN (1ULL << 31)
+#endif
+
+static int have_avx2 = 0;
+
+#ifdef BL_X86
+static __attribute__((constructor)) void bl_detect()
+{
+    __builtin_cpu_init();
+    have_avx2 = __builtin_cpu_supports("avx2");
+}
+#endif
+
+static void add_product(bl_select_t *sel, int *cap, int row, int col)
+{
+    if (sel->nsel == *cap)
+    {
+        *cap = *cap ? *cap * 2 : 64;
+        sel->rows = realloc(sel->rows, *cap * sizeof (int16_t));
+        sel->cols = realloc(sel->cols, *cap * sizeof (int16_t));
+        sel->index = realloc(sel->index, *cap * sizeof (int32_t));
+        sel->conj = realloc(sel->conj, *cap * sizeof (uint64_t));
+    }
+
+    sel->rows[sel->nsel] = row;
+    sel->cols[sel->nsel] = col;
+    // Like cov_expand(), the upper triangle is taken as the conjugate of
+    //   the lower even within the diagonal tiles
+    if (row >= col)
+    {
+        sel->index[sel->nsel] = cov_packed_index(row, col);
+        sel->conj[sel->nsel] = 0;
+    }
+    else
+    {
+        sel->index[sel->nsel] = cov_packed_index(col, row);
+        sel->conj[sel->nsel] = IMAG_SIGN;
+    }
+    sel->nsel++;
+}
+
+// Parses "XX+YY" etc. into a mask of the products wanted, bit 2p+q for
+//   polarizations p and q (X = 0, Y = 1)
+static int parse_pols(const char *s)
+{
+    int mask = 0;
+
+    while (*s != '\0')
+    {
+        if ((s[0] != 'X' && s[0] != 'Y') || (s[1] != 'X' && s[1] != 'Y'))
+            return -1;
+        mask |= 1 << (2 * (s[0] == 'Y') + (s[1] == 'Y'));
+        s += 2;
+        if (*s == '+' && s[1] != '\0')
+            s++;
+        else if (*s != '\0')
+            return -1;
+    }
+    return mask;
+}
+
+bl_select_t *bl_select_compile(const char *spec)
+{
+    bl_select_t *sel = calloc(1, sizeof (bl_select_t));
+    char *copy = strdup(spec);
+    char *item, *save = NULL;
+    int cap = 0;
+    int a, b, p, pols, n;
+
+    for (item = strtok_r(copy, ", ", &save); item != NULL; item = strtok_r(NULL, ", ", &save))
+    {
+        if (strcmp(item, "auto") == 0)
+        {
+            for (a = 0; a < NUM_ELEMENTS; a++)
+            {
+                add_product(sel, &cap, 2 * a, 2 * a);
+                add_product(sel, &cap, 2 * a + 1, 2 * a + 1);
+            }
+            continue;
+        }
+
+        // Only ":" and the polarizations may follow the antennas
+        n = 0;
+        pols = -1;
+        if (sscanf(item, "%d-%d%n", &a, &b, &n) == 2 && n > 0)
+        {
+            if (item[n] == '\0')
+                pols = 0xf;
+            else if (item[n] == ':')
+                pols = parse_pols(item + n + 1);
+        }
+        if (pols <= 0 || a < 0 || b < 0 || a >= NUM_ELEMENTS || b >= NUM_ELEMENTS)
+        {
+            fprintf(stderr, "bl_select_compile: bad selection \"%s\"\n", item);
+            free(copy);
+            bl_select_free(sel);
+            return NULL;
+        }
+        for (p = 0; p < 4; p++)
+            if (pols & (1 << p))
+                add_product(sel, &cap, 2 * a + (p >> 1), 2 * b + (p & 1));
+    }
+    free(copy);
+
+    if (sel->nsel == 0)
+    {
+        fprintf(stderr, "bl_select_compile: empty selection\n");
+        bl_select_free(sel);
+        return NULL;
+    }
+    return sel;
+}
+
+void bl_select_free(bl_select_t *sel)
+{
+    if (sel == NULL)
+        return;
+    free(sel->rows);
+    free(sel->cols);
+    free(sel->index);
+    free(sel->conj);
+    free(sel);
+}
+
+// Gathers the selection from one channel; returns how many were done
+#ifdef BL_X86
+__attribute__((target("avx2")))
+static int extract_avx2(const bl_select_t *sel, const float *chan, float *out)
+{
+    const double *pairs = (const double *)chan;
+    int i;
+
+    // Each complex pair is gathered as one 64-bit lane
+    for (i = 0; i + 4 <= sel->nsel; i += 4)
+    {
+        __m128i idx = _mm_loadu_si128((const __m128i *)(sel->index + i));
+        __m256d v = _mm256_i32gather_pd(pairs, idx, 8);
+        v = _mm256_xor_pd(v, _mm256_loadu_pd((const double *)(sel->conj + i)));
+        _mm256_storeu_pd((double *)(out + 2 * i), v);
+    }
+    return i;
+}
+#endif
+
+void bl_select_extract(const bl_select_t *sel, const float *data, int nchan, float *out)
+{
+    int c, i;
+
+    for (c = 0; c < nchan; c++)
+    {
+        const float *chan = data + CHAN_DATA_OFFSET(c);
+        float *o = out + (size_t)c * sel->nsel * 2;
+
+        i = 0;
+#ifdef BL_X86
+        if (have_avx2)
+            i = extract_avx2(sel, chan, o);
+#endif
+        for (; i < sel->nsel; i++)
+        {
+            o[2 * i] = chan[2 * sel->index[i]];
+            o[2 * i + 1] = sel->conj[i] ? -chan[2 * sel->index[i] + 1] : chan[2 * sel->index[i] + 1];
+        }
+    }
+}
+
+FILE *bl_side_open(const bl_select_t *sel, const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    int32_t head[3] = {BL_SIDE_MAGIC, NUM_CHANNELS, sel->nsel};
+    int i;
+
+    if (f == NULL)
+    {
+        perror(filename);
+        return NULL;
+    }
+
+    fwrite(head, sizeof (head), 1, f);
+    for (i = 0; i < sel->nsel; i++)
+    {
+        fwrite(&sel->rows[i], sizeof (int16_t), 1, f);
+        fwrite(&sel->cols[i], sizeof (int16_t), 1, f);
+    }
+    return f;
+}
+
+int bl_side_write(FILE *f, const bl_select_t *sel, const gpu_output_databuf_block_t *block,
+                  float *scratch)
+{
+    int32_t rec[2] = {block->header.mcnt, 0};
+    size_t n = (size_t)sel->nsel * NUM_CHANNELS * 2;
+
+    bl_select_extract(sel, block->data, NUM_CHANNELS, scratch);
+
+    if (fwrite(rec, sizeof (rec), 1, f) != 1 ||
+        fwrite(&block->header.dmjd, sizeof (double), 1, f) != 1 ||
+        fwrite(scratch, sizeof (float), n, f) != n)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,80 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef BASELINE_SELECT_H
+#define BASELINE_SELECT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "gpu_output_databuf.h"
+
+// Extracts a few baselines from each block without touching the rest.
+//
+// A selection is a comma separated list of
+//     auto          the XX and YY autocorrelations of every antenna
+//     a-b           all four polarization products of antennas a and b
+//     a-b:PP[+PP]   only the given products (XX, XY, YX or YY)
+// where antennas are numbered 0 to NUM_ANTENNAS / 2 - 1 and input 2a is
+//   antenna a's X polarization, 2a + 1 its Y. Selected products are
+//   returned as R(row, col) = <row col*>; products above the diagonal are
+//   conjugated from the stored lower triangle.
+//
+// bl_select_compile() turns a selection into a table of packed element
+//   indices and conjugation masks once; bl_select_extract() is then a
+//   gather (with AVX2 where available) whose cost depends only on the
+//   size of the selection.
+
+typedef struct bl_select {
+    int nsel;
+    // The inputs of each selected product
+    int16_t *rows;
+    int16_t *cols;
+    // Complex element index of each product within a packed channel
+    int32_t *index;
+    // The sign bit of the imaginary part of each conjugated product, as
+    //   it sits in the complex pair loaded as a 64-bit word
+    uint64_t *conj;
+} bl_select_t;
+
+// Returns NULL (after reporting why) if spec cannot be parsed
+bl_select_t *bl_select_compile(const char *spec);
+void bl_select_free(bl_select_t *sel);
+
+// Gathers the selection from nchan packed channels (CHAN_DATA_OFFSET(1)
+//   floats apart) into out, nsel complex values per channel
+void bl_select_extract(const bl_select_t *sel, const float *data, int nchan, float *out);
+
+// Side files hold a header (the BL_SIDE_MAGIC, channel and selection
+//   counts as int32 and each selected row, col pair as int16) followed by
+//   one record per block: mcnt (int32), 4 bytes of padding, DMJD (double)
+//   and the extracted values
+#define BL_SIDE_MAGIC 0x53314253
+
+// Opens a side file and writes its header. Returns NULL on failure
+FILE *bl_side_open(const bl_select_t *sel, const char *filename);
+// Extracts a block's selection and appends it. scratch must hold
+//   2 * nsel * NUM_CHANNELS floats
+int bl_side_write(FILE *f, const bl_select_t *sel, const gpu_output_databuf_block_t *block,
+                  float *scratch);
+
+#endif
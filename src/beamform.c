@@ -0,0 +1,412 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BF_X86 1
+#endif
+
+#include "beamform.h"
+#include "covariance.h"
+
+static int have_fma = 0;
+
+#ifdef BF_X86
+static __attribute__((constructor)) void bf_detect()
+{
+    __builtin_cpu_init();
+    have_fma = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+#endif
+
+// Dot products of two channels with BF_BEAM_BLOCK coefficient rows over n
+//   floats, added to out[chan * BF_BEAM_BLOCK + beam]
+static void dot_2x4(const float *x0, const float *x1, const float *c, long n, float *out)
+{
+    long k;
+    int b;
+
+    for (b = 0; b < BF_BEAM_BLOCK; b++)
+    {
+        const float *cb = c + b * BF_K;
+        float s0 = 0.0, s1 = 0.0;
+        for (k = 0; k < n; k++)
+        {
+            s0 += x0[k] * cb[k];
+            s1 += x1[k] * cb[k];
+        }
+        out[b] += s0;
+        out[BF_BEAM_BLOCK + b] += s1;
+    }
+}
+
+#ifdef BF_X86
+__attribute__((target("avx2,fma")))
+static float hsum(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+// As dot_2x4(); n must be a multiple of 8
+__attribute__((target("avx2,fma")))
+static void dot_2x4_fma(const float *x0, const float *x1, const float *c, long n, float *out)
+{
+    __m256 a00 = _mm256_setzero_ps(), a01 = _mm256_setzero_ps();
+    __m256 a02 = _mm256_setzero_ps(), a03 = _mm256_setzero_ps();
+    __m256 a10 = _mm256_setzero_ps(), a11 = _mm256_setzero_ps();
+    __m256 a12 = _mm256_setzero_ps(), a13 = _mm256_setzero_ps();
+    long k;
+
+    for (k = 0; k < n; k += 8)
+    {
+        __m256 v0 = _mm256_loadu_ps(x0 + k);
+        __m256 v1 = _mm256_loadu_ps(x1 + k);
+        __m256 cb;
+
+        cb = _mm256_loadu_ps(c + k);
+        a00 = _mm256_fmadd_ps(v0, cb, a00);
+        a10 = _mm256_fmadd_ps(v1, cb, a10);
+        cb = _mm256_loadu_ps(c + BF_K + k);
+        a01 = _mm256_fmadd_ps(v0, cb, a01);
+        a11 = _mm256_fmadd_ps(v1, cb, a11);
+        cb = _mm256_loadu_ps(c + 2 * BF_K + k);
+        a02 = _mm256_fmadd_ps(v0, cb, a02);
+        a12 = _mm256_fmadd_ps(v1, cb, a12);
+        cb = _mm256_loadu_ps(c + 3 * BF_K + k);
+        a03 = _mm256_fmadd_ps(v0, cb, a03);
+        a13 = _mm256_fmadd_ps(v1, cb, a13);
+    }
+
+    out[0] += hsum(a00);
+    out[1] += hsum(a01);
+    out[2] += hsum(a02);
+    out[3] += hsum(a03);
+    out[4] += hsum(a10);
+    out[5] += hsum(a11);
+    out[6] += hsum(a12);
+    out[7] += hsum(a13);
+}
+#endif
+
+// Forms every beam for channels [chan_start, chan_stop)
+static void bf_channels(beamformer_t *bf, int chan_start, int chan_stop)
+{
+    const float *data = bf->data;
+    float acc[2 * BF_BEAM_BLOCK];
+    int kb, b, c, i;
+    long n;
+
+    for (c = chan_start; c < chan_stop; c++)
+        memset(bf->power + (size_t)c * bf->nbeams, 0, bf->nbeams * sizeof (float));
+
+    for (kb = 0; kb < BF_K; kb += BF_K_BLOCK)
+    {
+        n = BF_K - kb < BF_K_BLOCK ? BF_K - kb : BF_K_BLOCK;
+        for (b = 0; b < bf->nbeams_pad; b += BF_BEAM_BLOCK)
+        {
+            const float *coef = bf->coef + (size_t)b * BF_K + kb;
+            for (c = chan_start; c < chan_stop; c += 2)
+            {
+                const float *x0 = data + (size_t)c * BF_K + kb;
+                // An odd channel out is paired with itself
+                const float *x1 = c + 1 < chan_stop ? x0 + BF_K : x0;
+
+                memset(acc, 0, sizeof (acc));
+#ifdef BF_X86
+                if (have_fma && n % 8 == 0)
+                    dot_2x4_fma(x0, x1, coef, n, acc);
+                else
+#endif
+                    dot_2x4(x0, x1, coef, n, acc);
+
+                for (i = 0; i < BF_BEAM_BLOCK && b + i < bf->nbeams; i++)
+                {
+                    bf->power[(size_t)c * bf->nbeams + b + i] += acc[i];
+                    if (c + 1 < chan_stop)
+                        bf->power[(size_t)(c + 1) * bf->nbeams + b + i] += acc[BF_BEAM_BLOCK + i];
+                }
+            }
+        }
+    }
+}
+
+// Worker t (of nthreads) takes an equal share of the channels
+static void bf_share(beamformer_t *bf, int t)
+{
+    int per = (bf->nchan + bf->nthreads - 1) / bf->nthreads;
+    int start = t * per;
+    int stop = start + per < bf->nchan ? start + per : bf->nchan;
+
+    if (start < stop)
+        bf_channels(bf, start, stop);
+}
+
+typedef struct bf_worker_arg {
+    beamformer_t *bf;
+    int t;
+} bf_worker_arg_t;
+
+static void *bf_worker(void *arg)
+{
+    beamformer_t *bf = ((bf_worker_arg_t *)arg)->bf;
+    int t = ((bf_worker_arg_t *)arg)->t;
+    uint64_t seen = 0;
+
+    free(arg);
+    pthread_mutex_lock(&bf->lock);
+    while (1)
+    {
+        while (!bf->stop && bf->generation == seen)
+            pthread_cond_wait(&bf->work_cond, &bf->lock);
+        if (bf->stop)
+            break;
+        seen = bf->generation;
+        pthread_mutex_unlock(&bf->lock);
+
+        bf_share(bf, t);
+
+        pthread_mutex_lock(&bf->lock);
+        if (--bf->running == 0)
+            pthread_cond_signal(&bf->done_cond);
+    }
+    pthread_mutex_unlock(&bf->lock);
+
+    return NULL;
+}
+
+beamformer_t *beamformer_create(const float *weights, int nbeams, int nthreads)
+{
+    beamformer_t *bf = calloc(1, sizeof (beamformer_t));
+    int b, e, row, col;
+
+    if (bf == NULL || nbeams <= 0)
+    {
+        free(bf);
+        return NULL;
+    }
+
+    bf->nbeams = nbeams;
+    bf->nbeams_pad = (nbeams + BF_BEAM_BLOCK - 1) / BF_BEAM_BLOCK * BF_BEAM_BLOCK;
+    if (posix_memalign((void **)&bf->coef, 64, (size_t)bf->nbeams_pad * BF_K * sizeof (float)) != 0)
+    {
+        free(bf);
+        return NULL;
+    }
+    memset(bf->coef, 0, (size_t)bf->nbeams_pad * BF_K * sizeof (float));
+
+    for (b = 0; b < nbeams; b++)
+    {
+        const float *w = weights + (size_t)b * NUM_ANTENNAS * 2;
+        float *coef = bf->coef + (size_t)b * BF_K;
+
+        // The redundant upper elements of the diagonal tiles are left zero
+        for (row = 0; row < NUM_ANTENNAS; row++)
+        {
+            for (col = 0; col <= row; col++)
+            {
+                e = cov_packed_index(row, col);
+                // conj(w_row) * w_col
+                float qr = w[2 * row] * w[2 * col] + w[2 * row + 1] * w[2 * col + 1];
+                float qi = w[2 * row] * w[2 * col + 1] - w[2 * row + 1] * w[2 * col];
+
+                if (row > col)
+                {
+                    coef[2 * e] = 2 * qr;
+                    coef[2 * e + 1] = -2 * qi;
+                }
+                else
+                {
+                    coef[2 * e] = qr;
+                }
+            }
+        }
+    }
+
+    bf->nthreads = nthreads < 1 ? 1 : nthreads;
+    pthread_mutex_init(&bf->lock, NULL);
+    pthread_cond_init(&bf->work_cond, NULL);
+    pthread_cond_init(&bf->done_cond, NULL);
+
+    // The caller's thread does the first share
+    bf->threads = calloc(bf->nthreads, sizeof (pthread_t));
+    for (b = 1; b < bf->nthreads; b++)
+    {
+        bf_worker_arg_t *arg = malloc(sizeof (*arg));
+        arg->bf = bf;
+        arg->t = b;
+        if (pthread_create(&bf->threads[b], NULL, bf_worker, arg) != 0)
+        {
+            fprintf(stderr, "beamformer_create: could not start thread %d\n", b);
+            free(arg);
+            break;
+        }
+    }
+    bf->nthreads = b;
+
+    return bf;
+}
+
+void beamformer_destroy(beamformer_t *bf)
+{
+    int t;
+
+    pthread_mutex_lock(&bf->lock);
+    bf->stop = 1;
+    pthread_cond_broadcast(&bf->work_cond);
+    pthread_mutex_unlock(&bf->lock);
+
+    for (t = 1; t < bf->nthreads; t++)
+        pthread_join(bf->threads[t], NULL);
+
+    free(bf->threads);
+    free(bf->coef);
+    pthread_mutex_destroy(&bf->lock);
+    pthread_cond_destroy(&bf->work_cond);
+    pthread_cond_destroy(&bf->done_cond);
+    free(bf);
+}
+
+void beamformer_run(beamformer_t *bf, const float *data, int nchan, float *power)
+{
+    pthread_mutex_lock(&bf->lock);
+    bf->data = data;
+    bf->nchan = nchan;
+    bf->power = power;
+    bf->running = bf->nthreads - 1;
+    bf->generation++;
+    pthread_cond_broadcast(&bf->work_cond);
+    pthread_mutex_unlock(&bf->lock);
+
+    bf_share(bf, 0);
+
+    pthread_mutex_lock(&bf->lock);
+    while (bf->running > 0)
+        pthread_cond_wait(&bf->done_cond, &bf->lock);
+    pthread_mutex_unlock(&bf->lock);
+}
+
+int beamformer_load_weights(const char *filename, float **weights)
+{
+    FILE *f = fopen(filename, "r");
+    char line[16384];
+    int nbeams = 0, cap = 0, i, n;
+    char *p, *end;
+    float *w = NULL;
+
+    if (f == NULL)
+    {
+        fprintf(stderr, "beamformer_load_weights: %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof (line), f) != NULL)
+    {
+        p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+
+        if (nbeams == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            w = realloc(w, (size_t)cap * NUM_ANTENNAS * 2 * sizeof (float));
+        }
+
+        float *beam = w + (size_t)nbeams * NUM_ANTENNAS * 2;
+        for (i = 0, n = 0; i < NUM_ANTENNAS * 2; i++, n++)
+        {
+            beam[i] = strtof(p, &end);
+            if (end == p)
+                break;
+            p = end;
+        }
+        if (n != NUM_ANTENNAS * 2)
+        {
+            fprintf(stderr, "beamformer_load_weights: %s: beam %d has %d values, not %d\n",
+                    filename, nbeams, n, NUM_ANTENNAS * 2);
+            free(w);
+            fclose(f);
+            return -1;
+        }
+        nbeams++;
+    }
+    fclose(f);
+
+    *weights = w;
+    return nbeams;
+}
+
+void beamformer_steering_weights(float *weights, int nbeams)
+{
+    int b, i;
+    // Half-wavelength spacing; inputs 2n and 2n+1 are the two
+    //   polarizations of element n
+    for (b = 0; b < nbeams; b++)
+    {
+        double sin_theta = nbeams > 1 ? -1.0 + 2.0 * b / (nbeams - 1) : 0.0;
+        for (i = 0; i < NUM_ANTENNAS; i++)
+        {
+            double phase = M_PI * (i / 2) * sin_theta;
+            weights[(size_t)b * NUM_ANTENNAS * 2 + 2 * i] = cos(phase) / NUM_ANTENNAS;
+            weights[(size_t)b * NUM_ANTENNAS * 2 + 2 * i + 1] = sin(phase) / NUM_ANTENNAS;
+        }
+    }
+}
+
+double beamformer_ref_power(const float *w, const float *chan_data)
+{
+    float r[COV_FULL_ELEMS * 2];
+    int row, col;
+    double p = 0.0;
+
+    cov_expand_ref(chan_data, r);
+
+    // sum_ij conj(w_i) R_ij w_j; the imaginary part cancels
+    for (row = 0; row < NUM_ANTENNAS; row++)
+    {
+        double wr = w[2 * row], wi = -w[2 * row + 1];
+        for (col = 0; col < NUM_ANTENNAS; col++)
+        {
+            const float *rc = r + (row * NUM_ANTENNAS + col) * 2;
+            double xr = (double)rc[0] * w[2 * col] - (double)rc[1] * w[2 * col + 1];
+            double xi = (double)rc[0] * w[2 * col + 1] + (double)rc[1] * w[2 * col];
+            p += wr * xr - wi * xi;
+        }
+    }
+
+    return p;
+}
+
+const char *beamformer_isa(void)
+{
+    return have_fma ? "AVX2/FMA" : "scalar";
+}
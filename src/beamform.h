@@ -0,0 +1,96 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef BEAMFORM_H
+#define BEAMFORM_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "gpu_output_databuf.h"
+
+// Floats per channel in the packed covariance layout
+#define BF_K (NONZERO_BIN_SIZE * 2)
+// Beams are computed in groups of this many
+#define BF_BEAM_BLOCK 4
+// Slice of BF_K worked on at a time, sized so that a group of beams'
+//   coefficients stays in L1
+#define BF_K_BLOCK 560
+
+// Forms beam powers P = w^H R w from packed covariance channels.
+//
+// R is Hermitian, so P is linear in the unique (lower triangle) elements
+//   of R: P = sum_i |w_i|^2 R_ii + 2 Re sum_{i>j} conj(w_i) w_j R_ij.
+//   Each beam's weights are turned once into a row of coefficients that
+//   multiplies the packed channel directly (zero for the redundant upper
+//   element of the diagonal tiles), and forming every beam for every
+//   channel is then a real matrix product, P = X C^T, blocked over beams,
+//   channels and BF_K and spread over threads by channel.
+typedef struct beamformer {
+    int nbeams;
+    // nbeams rounded up to BF_BEAM_BLOCK; the extra rows are zero
+    int nbeams_pad;
+    // nbeams_pad rows of BF_K coefficients
+    float *coef;
+
+    int nthreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    // Bumped for each beamformer_run(); workers run once per generation
+    uint64_t generation;
+    int running;
+    int stop;
+
+    // The current job
+    const float *data;
+    int nchan;
+    float *power;
+} beamformer_t;
+
+// Builds a beamformer for nbeams beams of NUM_ANTENNAS complex weights
+//   each (re, im pairs, beam after beam) using nthreads threads in total
+beamformer_t *beamformer_create(const float *weights, int nbeams, int nthreads);
+void beamformer_destroy(beamformer_t *bf);
+
+// Computes power[c * nbeams + b] for nchan channels of packed covariance
+//   laid out BF_K floats apart
+void beamformer_run(beamformer_t *bf, const float *data, int nchan, float *power);
+
+// Reads weights from a text file with one beam per line of NUM_ANTENNAS
+//   re im pairs; blank lines and lines starting with # are skipped.
+//   Returns the number of beams (and a malloc'd array), or -1
+int beamformer_load_weights(const char *filename, float **weights);
+
+// Fills weights for nbeams beams steered across a uniform linear array of
+//   NUM_ANTENNAS / 2 dual-polarization elements
+void beamformer_steering_weights(float *weights, int nbeams);
+
+// Straightforward wH R w over the full Hermitian matrix, in double
+//   precision, for checking beamformer_run()
+double beamformer_ref_power(const float *beam_weights, const float *chan_data);
+
+// Name of the kernel in use, for logging
+const char *beamformer_isa(void);
+
+#endif
@@ -0,0 +1,315 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+// Forms beam powers from every block and passes the block on unchanged.
+//   Sits between fake_gpu_thread (or accumulator_thread) and the writer:
+// $ hashpipe -p fake_gpu -I 0 -c 3 fake_gpu_thread -c 4 beamformer_thread -c 5 fits_writer_thread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "hashpipe.h"
+#include "gpu_output_databuf.h"
+#include "beamform.h"
+
+#define BF_FILENAME_LENGTH 256
+
+// Precedes each block's powers in the BFOUT file
+typedef struct bf_record_header {
+    int32_t mcnt;
+    int32_t scan_num;
+    int32_t nbeams;
+    int32_t nchan;
+    double dmjd;
+} bf_record_header_t;
+
+typedef struct bf_config {
+    char weights_file[BF_FILENAME_LENGTH];
+    int nbeams;
+    int nthreads;
+} bf_config_t;
+
+static int init(struct hashpipe_thread_args *args)
+{
+    hashpipe_status_t st = args->st;
+
+    hashpipe_status_lock_safe(&st);
+    hputs(st.buf, "BFFILE", "");
+    hputi4(st.buf, "BFNBEAM", 64);
+    hputi4(st.buf, "BFTHRDS", 1);
+    hputs(st.buf, "BFOUT", "");
+    hashpipe_status_unlock_safe(&st);
+
+    fprintf(stderr, "beamformer_thread using %s kernel\n", beamformer_isa());
+
+    return 0;
+}
+
+// Waits for an input block to be filled. Returns -1 if the threads are
+//   stopping; exits the thread on databuf errors
+static int wait_filled(gpu_output_databuf_t *db, int block_idx, hashpipe_status_t *st,
+                       const char *status_key)
+{
+    int rv;
+
+    while ((rv=gpu_output_databuf_wait_filled(db, block_idx)) != HASHPIPE_OK)
+    {
+        if (rv==HASHPIPE_TIMEOUT) {
+            if (!run_threads())
+                return -1;
+            hashpipe_status_lock_safe(st);
+            hputs(st->buf, status_key, "waiting");
+            hashpipe_status_unlock_safe(st);
+            continue;
+        }
+        else
+        {
+            hashpipe_error(__FUNCTION__, "error waiting for filled databuf");
+            pthread_exit(NULL);
+        }
+    }
+    gpu_output_databuf_claim(db, block_idx);
+    return 0;
+}
+
+// As wait_filled(), for an output block to be freed
+static int wait_free(gpu_output_databuf_t *db, int block_idx, hashpipe_status_t *st,
+                     const char *status_key)
+{
+    int rv;
+
+    while ((rv=gpu_output_databuf_wait_free(db, block_idx)) != HASHPIPE_OK)
+    {
+        if (rv==HASHPIPE_TIMEOUT) {
+            if (!run_threads())
+                return -1;
+            hashpipe_status_lock_safe(st);
+            hputs(st->buf, status_key, "blocked");
+            hashpipe_status_unlock_safe(st);
+            continue;
+        }
+        else
+        {
+            hashpipe_error(__FUNCTION__, "error waiting for free databuf");
+            pthread_exit(NULL);
+        }
+    }
+    return 0;
+}
+
+// (Re)builds the beamformer if its configuration has changed. Returns NULL
+//   (with bf destroyed) if the weights cannot be loaded, and sets *failed
+//   so that the same configuration is not tried again until *failed is
+//   cleared
+static beamformer_t *configure(hashpipe_status_t *st, beamformer_t *bf, bf_config_t *cur,
+                               int *failed)
+{
+    bf_config_t cfg = *cur;
+    float *weights = NULL;
+    int nbeams;
+
+    hashpipe_status_lock_safe(st);
+    hgets(st->buf, "BFFILE", sizeof (cfg.weights_file), cfg.weights_file);
+    hgeti4(st->buf, "BFNBEAM", &cfg.nbeams);
+    hgeti4(st->buf, "BFTHRDS", &cfg.nthreads);
+    hashpipe_status_unlock_safe(st);
+
+    if ((bf != NULL || *failed) && memcmp(&cfg, cur, sizeof (cfg)) == 0)
+        return bf;
+    if (bf != NULL)
+        beamformer_destroy(bf);
+    *cur = cfg;
+    *failed = 1;
+
+    if (cfg.weights_file[0] != '\0')
+    {
+        nbeams = beamformer_load_weights(cfg.weights_file, &weights);
+        if (nbeams <= 0)
+        {
+            hashpipe_warn(__FUNCTION__, "no beams in %s", cfg.weights_file);
+            free(weights);
+            return NULL;
+        }
+    }
+    else
+    {
+        // Steer BFNBEAM beams across the array
+        nbeams = cfg.nbeams > 0 ? cfg.nbeams : 1;
+        weights = malloc((size_t)nbeams * NUM_ANTENNAS * 2 * sizeof (float));
+        beamformer_steering_weights(weights, nbeams);
+    }
+
+    bf = beamformer_create(weights, nbeams, cfg.nthreads);
+    free(weights);
+    *failed = bf == NULL;
+    if (bf != NULL)
+        fprintf(stderr, "beamformer_thread: %d beams on %d threads\n", bf->nbeams, bf->nthreads);
+    return bf;
+}
+
+// Opens this scan's BFOUT file, if one is wanted
+static FILE *open_output(hashpipe_status_t *st, int scan_num)
+{
+    char prefix[BF_FILENAME_LENGTH] = "";
+    char filename[BF_FILENAME_LENGTH + 16];
+    FILE *f;
+
+    hashpipe_status_lock_safe(st);
+    hgets(st->buf, "BFOUT", sizeof (prefix), prefix);
+    hashpipe_status_unlock_safe(st);
+
+    if (prefix[0] == '\0')
+        return NULL;
+
+    snprintf(filename, sizeof (filename), "%s.%d", prefix, scan_num);
+    f = fopen(filename, "w");
+    if (f == NULL)
+        hashpipe_warn(__FUNCTION__, "cannot open %s", filename);
+    return f;
+}
+
+static void *run(hashpipe_thread_args_t * args)
+{
+    gpu_output_databuf_t *db_in = (gpu_output_databuf_t *)args->ibuf;
+    gpu_output_databuf_t *db_out = (gpu_output_databuf_t *)args->obuf;
+    hashpipe_status_t st = args->st;
+    const char * status_key = args->thread_desc->skey;
+
+    int in_idx = 0;
+    int out_idx = 0;
+    gpu_output_databuf_block_t *in;
+    gpu_output_databuf_block_t *out;
+
+    beamformer_t *bf = NULL;
+    bf_config_t cfg;
+    int cfg_failed = 0;
+    float *power = NULL;
+    int power_beams = 0;
+    FILE *out_file = NULL;
+    bf_record_header_t rec;
+    struct timespec start, stop;
+    double usecs, block_usecs;
+
+    memset(&cfg, 0, sizeof (cfg));
+
+    while (run_threads())
+    {
+        if (wait_filled(db_in, in_idx, &st, status_key) != 0)
+            break;
+        in = &db_in->block[in_idx];
+
+        if (in->header.scan_block == 0 || bf == NULL)
+        {
+            // A configuration that failed is tried again at each new scan,
+            //   or as soon as it is changed
+            if (in->header.scan_block == 0)
+                cfg_failed = 0;
+            bf = configure(&st, bf, &cfg, &cfg_failed);
+            if (bf != NULL && bf->nbeams != power_beams)
+            {
+                free(power);
+                power = malloc((size_t)NUM_CHANNELS * bf->nbeams * sizeof (float));
+                power_beams = bf->nbeams;
+            }
+        }
+        if (in->header.scan_block == 0)
+        {
+            if (out_file != NULL)
+                fclose(out_file);
+            out_file = open_output(&st, in->header.scan_num);
+        }
+
+        hashpipe_status_lock_safe(&st);
+        hputs(st.buf, status_key, "beamforming");
+        hashpipe_status_unlock_safe(&st);
+
+        if (bf != NULL)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            beamformer_run(bf, in->data, NUM_CHANNELS, power);
+            clock_gettime(CLOCK_MONOTONIC, &stop);
+
+            usecs = ELAPSED_NS(start, stop) / 1000.0;
+            block_usecs = INT_TIME * 1e6 * (in->header.acc_len > 0 ? in->header.acc_len : 1);
+            hashpipe_status_lock_safe(&st);
+            hputr4(st.buf, "BFUSEC", usecs);
+            // How many beams would take up the whole integration
+            hputi4(st.buf, "BFMAXB", (int)(bf->nbeams * block_usecs / usecs));
+            hashpipe_status_unlock_safe(&st);
+
+            if (out_file != NULL)
+            {
+                rec.mcnt = in->header.mcnt;
+                rec.scan_num = in->header.scan_num;
+                rec.nbeams = bf->nbeams;
+                rec.nchan = NUM_CHANNELS;
+                rec.dmjd = in->header.dmjd;
+                fwrite(&rec, sizeof (rec), 1, out_file);
+                fwrite(power, sizeof (float), (size_t)NUM_CHANNELS * bf->nbeams, out_file);
+            }
+        }
+
+        // Pass the covariance on
+        if (wait_free(db_out, out_idx, &st, status_key) != 0)
+            break;
+        out = &db_out->block[out_idx];
+        memcpy(out, in, sizeof (*out));
+        out->header.chans_ready = 0;
+
+        __atomic_store_n(&in->header.chans_ready, 0, __ATOMIC_RELEASE);
+        clock_gettime(CLOCK_MONOTONIC, &in->header.freed);
+        gpu_output_databuf_set_free(db_in, in_idx);
+        in_idx = (in_idx + 1) % NUM_BLOCKS;
+
+        // Consumers in chunked mode wait for this before reading the header
+        __atomic_store_n(&out->header.chans_ready, NUM_CHANNELS, __ATOMIC_RELEASE);
+        gpu_output_databuf_set_filled(db_out, out_idx);
+        out_idx = (out_idx + 1) % NUM_BLOCKS;
+
+        pthread_testcancel();
+    }
+
+    if (out_file != NULL)
+        fclose(out_file);
+    if (bf != NULL)
+        beamformer_destroy(bf);
+    free(power);
+    return THREAD_OK;
+}
+
+static hashpipe_thread_desc_t beamformer_thread = {
+    name: "beamformer_thread",
+    skey: "BFSTAT",
+    init: init,
+    run:  run,
+    ibuf_desc: {gpu_output_databuf_create},
+    obuf_desc: {gpu_output_databuf_create}
+};
+
+static __attribute__((constructor)) void ctor()
+{
+  register_hashpipe_thread(&beamformer_thread);
+}
@@ -0,0 +1,394 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+// sim1_bench: micro-benchmarks of the processing stages, independent of
+//   hashpipe.
+//
+// usage: sim1_bench <benchmark> [options]
+//     beamform [-c nchan] [-b nbeams] [-t nthreads] [-n iterations]
+//     expand [-c nchan] [-n iterations]
+//     select [-s selection] [-c nchan] [-n iterations]
+//     kernels [-n iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "gpu_output_databuf.h"
+#include "beamform.h"
+#include "covariance.h"
+#include "baseline_select.h"
+#include "block_kernels.h"
+
+static double elapsed_secs(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Random packed covariance for nchan channels
+static float *random_channels(int nchan, int chan_floats)
+{
+    float *data = malloc((size_t)nchan * chan_floats * sizeof (float));
+    size_t i;
+
+    srand(1);
+    for (i = 0; i < (size_t)nchan * chan_floats; i++)
+        data[i] = (float)rand() / RAND_MAX - 0.5;
+    return data;
+}
+
+static int bench_beamform(int argc, char *argv[])
+{
+    int nchan = 160, nbeams = 256, nthreads = 1, iters = 50;
+    int opt, i, c, b;
+    struct timespec start;
+    double secs, err, max_err = 0.0;
+
+    while ((opt = getopt(argc, argv, "c:b:t:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c': nchan = atoi(optarg); break;
+        case 'b': nbeams = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'n': iters = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: sim1_bench beamform [-c nchan] [-b nbeams] [-t nthreads] [-n iterations]\n");
+            return 2;
+        }
+    }
+
+    float *data = random_channels(nchan, BF_K);
+    float *weights = malloc((size_t)nbeams * NUM_ANTENNAS * 2 * sizeof (float));
+    float *power = malloc((size_t)nchan * nbeams * sizeof (float));
+    beamformer_steering_weights(weights, nbeams);
+    beamformer_t *bf = beamformer_create(weights, nbeams, nthreads);
+
+    // Check against the full-matrix reference
+    beamformer_run(bf, data, nchan, power);
+    for (c = 0; c < nchan; c += (nchan + 7) / 8)
+        for (b = 0; b < nbeams; b += (nbeams + 7) / 8)
+        {
+            double ref = beamformer_ref_power(weights + (size_t)b * NUM_ANTENNAS * 2,
+                                              data + (size_t)c * BF_K);
+            err = fabs(power[(size_t)c * nbeams + b] - ref) / (fabs(ref) + 1e-6);
+            if (err > max_err)
+                max_err = err;
+        }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iters; i++)
+        beamformer_run(bf, data, nchan, power);
+    secs = elapsed_secs(&start) / iters;
+
+    printf("beamform (%s): %d channels, %d beams, %d threads\n",
+           beamformer_isa(), nchan, nbeams, bf->nthreads);
+    printf("    max relative error vs reference: %.2e\n", max_err);
+    printf("    %.3f ms per integration, %.2f GFLOP/s\n", secs * 1e3,
+           2.0 * nchan * nbeams * BF_K / secs / 1e9);
+    printf("    ~%d beams fit in one %.0f ms integration\n",
+           (int)(nbeams * INT_TIME / secs), INT_TIME * 1e3);
+
+    beamformer_destroy(bf);
+    free(data);
+    free(weights);
+    free(power);
+    return max_err < 1e-3 ? 0 : 1;
+}
+
+// Times expand(), or pack() if it is NULL, over nchan channels
+static double time_cov(void (*expand)(const float *, float *), void (*pack)(const float *, float *),
+                       const float *packed, float *full, float *repacked, int nchan, int iters)
+{
+    struct timespec start;
+    int i, c;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iters; i++)
+        for (c = 0; c < nchan; c++)
+        {
+            if (expand != NULL)
+                expand(packed + (size_t)c * BF_K, full + (size_t)c * COV_FULL_ELEMS * 2);
+            else
+                pack(full + (size_t)c * COV_FULL_ELEMS * 2, repacked + (size_t)c * BF_K);
+        }
+    return elapsed_secs(&start) / iters;
+}
+
+static int bench_expand_nchan(int nchan, int iters)
+{
+    size_t full_floats = (size_t)nchan * COV_FULL_ELEMS * 2;
+    float *packed = random_channels(nchan, BF_K);
+    float *full = malloc(full_floats * sizeof (float));
+    float *full_ref = malloc(full_floats * sizeof (float));
+    float *repacked = malloc((size_t)nchan * BF_K * sizeof (float));
+    float *repacked_ref = malloc((size_t)nchan * BF_K * sizeof (float));
+    double t_expand, t_pack, t_expand_ref, t_pack_ref;
+    int c, ok = 1;
+
+    // Both directions must match the element-by-element versions exactly
+    for (c = 0; c < nchan; c++)
+    {
+        cov_expand(packed + (size_t)c * BF_K, full + (size_t)c * COV_FULL_ELEMS * 2);
+        cov_expand_ref(packed + (size_t)c * BF_K, full_ref + (size_t)c * COV_FULL_ELEMS * 2);
+        cov_pack(full + (size_t)c * COV_FULL_ELEMS * 2, repacked + (size_t)c * BF_K);
+        cov_pack_ref(full + (size_t)c * COV_FULL_ELEMS * 2, repacked_ref + (size_t)c * BF_K);
+    }
+    if (memcmp(full, full_ref, full_floats * sizeof (float)) != 0 ||
+        memcmp(repacked, repacked_ref, (size_t)nchan * BF_K * sizeof (float)) != 0)
+        ok = 0;
+
+    t_expand = time_cov(cov_expand, NULL, packed, full, repacked, nchan, iters);
+    t_pack = time_cov(NULL, cov_pack, packed, full, repacked, nchan, iters);
+    t_expand_ref = time_cov(cov_expand_ref, NULL, packed, full, repacked, nchan, iters);
+    t_pack_ref = time_cov(NULL, cov_pack_ref, packed, full, repacked, nchan, iters);
+
+    printf("%4d channels: %s  expand %7.1f ns/chan (%5.1f GB/s, ref %7.1f)  "
+           "pack %7.1f ns/chan (ref %7.1f)\n",
+           nchan, ok ? "ok  " : "FAIL",
+           t_expand / nchan * 1e9, full_floats * sizeof (float) / t_expand / 1e9,
+           t_expand_ref / nchan * 1e9, t_pack / nchan * 1e9, t_pack_ref / nchan * 1e9);
+
+    free(packed);
+    free(full);
+    free(full_ref);
+    free(repacked);
+    free(repacked_ref);
+    return ok ? 0 : 1;
+}
+
+static int bench_expand(int argc, char *argv[])
+{
+    int nchan = 0, iters = 200;
+    int opt, rv = 0;
+
+    while ((opt = getopt(argc, argv, "c:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c': nchan = atoi(optarg); break;
+        case 'n': iters = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: sim1_bench expand [-c nchan] [-n iterations]\n");
+            return 2;
+        }
+    }
+
+    printf("expand/pack %dx%d Hermitian, %d tile blocks\n", NUM_ANTENNAS, NUM_ANTENNAS, COV_TILE_BLOCK);
+    if (nchan > 0)
+        return bench_expand_nchan(nchan, iters);
+
+    // The channel counts the correlator is built for
+    rv |= bench_expand_nchan(5, iters);
+    rv |= bench_expand_nchan(50, iters);
+    rv |= bench_expand_nchan(160, iters);
+    return rv;
+}
+
+static int bench_select(int argc, char *argv[])
+{
+    const char *spec = "auto";
+    int nchan = 160, iters = 1000;
+    int opt, i, c, ok = 1;
+    struct timespec start;
+    double t_sel, t_copy;
+    float full[COV_FULL_ELEMS * 2];
+
+    while ((opt = getopt(argc, argv, "s:c:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's': spec = optarg; break;
+        case 'c': nchan = atoi(optarg); break;
+        case 'n': iters = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: sim1_bench select [-s selection] [-c nchan] [-n iterations]\n");
+            return 2;
+        }
+    }
+
+    bl_select_t *sel = bl_select_compile(spec);
+    if (sel == NULL)
+        return 2;
+
+    float *data = random_channels(nchan, BF_K);
+    float *out = malloc((size_t)nchan * sel->nsel * 2 * sizeof (float));
+    float *copy = malloc((size_t)nchan * BF_K * sizeof (float));
+
+    // Every product must equal the element of the full Hermitian matrix
+    bl_select_extract(sel, data, nchan, out);
+    for (c = 0; c < nchan; c++)
+    {
+        cov_expand_ref(data + (size_t)c * BF_K, full);
+        for (i = 0; i < sel->nsel; i++)
+        {
+            const float *r = full + (sel->rows[i] * NUM_ANTENNAS + sel->cols[i]) * 2;
+            const float *o = out + ((size_t)c * sel->nsel + i) * 2;
+            if (o[0] != r[0] || o[1] != r[1])
+                ok = 0;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iters; i++)
+        bl_select_extract(sel, data, nchan, out);
+    t_sel = elapsed_secs(&start) / iters;
+
+    // What a reader of whole blocks pays at the least
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iters; i++)
+    {
+        memcpy(copy, data, (size_t)nchan * BF_K * sizeof (float));
+        __asm__ volatile("" : : "r"(copy) : "memory");
+    }
+    t_copy = elapsed_secs(&start) / iters;
+
+    printf("select \"%s\": %d products x %d channels: %s\n", spec, sel->nsel, nchan, ok ? "ok" : "FAIL");
+    printf("    %.2f us per block (whole-block copy %.2f us)\n", t_sel * 1e6, t_copy * 1e6);
+
+    bl_select_free(sel);
+    free(data);
+    free(out);
+    free(copy);
+    return ok ? 0 : 1;
+}
+
+// Seconds per call of one kernel, taking the best of a few runs
+#define TIME_KERNEL(secs, call)                                             \
+    do {                                                                    \
+        int run_, it_;                                                      \
+        double t_;                                                          \
+        (secs) = 1e9;                                                       \
+        for (run_ = 0; run_ < 3; run_++)                                    \
+        {                                                                   \
+            clock_gettime(CLOCK_MONOTONIC, &start);                         \
+            for (it_ = 0; it_ < iters; it_++)                               \
+            {                                                               \
+                call;                                                       \
+                __asm__ volatile("" : : : "memory");                        \
+            }                                                               \
+            t_ = elapsed_secs(&start) / iters;                              \
+            if (t_ < (secs))                                                \
+                (secs) = t_;                                                \
+        }                                                                   \
+    } while (0)
+
+static int bench_kernels_nchan(int nchan, int iters)
+{
+    const block_kernels_t *spec = block_kernels_select(nchan, NUM_ANTENNAS);
+    const block_kernels_t *gen = block_kernels_generic(nchan, NUM_ANTENNAS);
+    size_t nfloats = (size_t)nchan * spec->bin * 2;
+    size_t bytes = nfloats * sizeof (float);
+    struct timespec start;
+    double t_spec[3], t_gen[3];
+    int ok = 1;
+
+    float *src = random_channels(nchan, spec->gpu_bin * 2);
+    float *a = malloc(bytes);
+    float *b = malloc(bytes);
+
+    // The specialized kernels must do exactly what the generic ones do
+    spec->fill(spec, a, 3, 0, nchan);
+    gen->fill(gen, b, 3, 0, nchan);
+    ok &= memcmp(a, b, bytes) == 0;
+    spec->compact(spec, a, src);
+    gen->compact(gen, b, src);
+    ok &= memcmp(a, b, bytes) == 0;
+    memset(b, 0, bytes);
+    spec->copy(spec, b, a);
+    ok &= memcmp(a, b, bytes) == 0;
+
+    // A load step to fewer channels fills the first ones and zeroes the
+    //   rest, leaving nothing of the previous block behind
+    size_t half = (size_t)(nchan / 2) * spec->bin * 2;
+    size_t i;
+    spec->fill(spec, a, 3, 0, nchan);
+    spec->fill(spec, a, 4, 0, nchan / 2);
+    spec->clear(spec, a, nchan / 2, nchan);
+    gen->fill(gen, b, 4, 0, nchan / 2);
+    ok &= memcmp(a, b, half * sizeof (float)) == 0;
+    for (i = half; i < nfloats; i++)
+        ok &= a[i] == 0.0f;
+
+    TIME_KERNEL(t_spec[0], spec->fill(spec, a, it_, 0, nchan));
+    TIME_KERNEL(t_gen[0], gen->fill(gen, a, it_, 0, nchan));
+    TIME_KERNEL(t_spec[1], spec->compact(spec, a, src));
+    TIME_KERNEL(t_gen[1], gen->compact(gen, a, src));
+    TIME_KERNEL(t_spec[2], spec->copy(spec, b, a));
+    TIME_KERNEL(t_gen[2], gen->copy(gen, b, a));
+
+    printf("%s (%d channels): %s\n", spec->name, nchan, ok ? "ok" : "FAIL");
+    printf("    fill    %8.2f us, generic %8.2f us (%.2fx)\n",
+           t_spec[0] * 1e6, t_gen[0] * 1e6, t_gen[0] / t_spec[0]);
+    printf("    compact %8.2f us, generic %8.2f us (%.2fx), %.2f GB/s\n",
+           t_spec[1] * 1e6, t_gen[1] * 1e6, t_gen[1] / t_spec[1], bytes / t_spec[1] / 1e9);
+    printf("    copy    %8.2f us, generic %8.2f us (%.2fx), %.2f GB/s\n",
+           t_spec[2] * 1e6, t_gen[2] * 1e6, t_gen[2] / t_spec[2], bytes / t_spec[2] / 1e9);
+
+    free(src);
+    free(a);
+    free(b);
+    return ok ? 0 : 1;
+}
+
+static int bench_kernels(int argc, char *argv[])
+{
+    int iters = 2000;
+    int opt, rv = 0;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n': iters = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: sim1_bench kernels [-n iterations]\n");
+            return 2;
+        }
+    }
+
+    // The layouts with specialized kernels
+    rv |= bench_kernels_nchan(5, iters);
+    rv |= bench_kernels_nchan(50, iters);
+    rv |= bench_kernels_nchan(160, iters);
+    return rv;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "beamform") == 0)
+        return bench_beamform(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "expand") == 0)
+        return bench_expand(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "select") == 0)
+        return bench_select(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "kernels") == 0)
+        return bench_kernels(argc - 1, argv + 1);
+
+    fprintf(stderr, "usage: %s beamform|expand|select|kernels [options]\n", argv[0]);
+    return 2;
+}
@@ -0,0 +1,188 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "block_kernels.h"
+
+const block_kernels_t *block_kernels = NULL;
+
+// The kernel bodies. The specialized instances call these with constant
+//   layouts and the generic ones with values from the table; forcing them
+//   inline is what lets the constants through
+
+static inline __attribute__((always_inline))
+void fill_body(float *data, int ramp, int chan_start, int chan_stop, const int dim)
+{
+    const int bin = dim * (dim + 1) * 2;
+    const float base = 2.0f * dim * ramp;
+    int c, j, k;
+
+    if (chan_start >= chan_stop)
+        return;
+
+    // Every channel of a block holds the same pattern; write the first one
+    //   and copy it to the rest
+    float *first = data + (size_t)chan_start * bin * 2;
+    float *out = first;
+    // Tile (j, k) of the lower triangle holds the four pairs
+    //   (2j, 2k), (2j, 2k+1), (2j+1, 2k), (2j+1, 2k+1)
+    for (j = 0; j < dim; j++)
+    {
+        for (k = 0; k <= j; k++)
+        {
+            const float re = base + 2 * j;
+            const float im = base + 2 * k;
+            out[0] = re;
+            out[1] = im;
+            out[2] = re;
+            out[3] = im + 1;
+            out[4] = re + 1;
+            out[5] = im;
+            out[6] = re + 1;
+            out[7] = im + 1;
+            out += 8;
+        }
+    }
+    for (c = chan_start + 1; c < chan_stop; c++)
+        memcpy(data + (size_t)c * bin * 2, first, (size_t)bin * 2 * sizeof (float));
+}
+
+static inline __attribute__((always_inline))
+void compact_body(float *restrict dst, const float *restrict src, const int nchan,
+                  const int bin, const int gpu_bin)
+{
+    int c, i;
+
+    for (c = 0; c < nchan; c++)
+    {
+        float *restrict d = dst + (size_t)c * bin * 2;
+        const float *restrict s = src + (size_t)c * gpu_bin * 2;
+        for (i = 0; i < bin * 2; i++)
+            d[i] = s[i];
+    }
+}
+
+static inline __attribute__((always_inline))
+void copy_body(float *restrict dst, const float *restrict src, const size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        dst[i] = src[i];
+}
+
+// Zeroing is a memset whatever the layout, so every instance shares it
+static void clear_channels(const block_kernels_t *k, float *data, int chan_start, int chan_stop)
+{
+    if (chan_start >= chan_stop)
+        return;
+    memset(data + (size_t)chan_start * k->bin * 2, 0,
+           (size_t)(chan_stop - chan_start) * k->bin * 2 * sizeof (float));
+}
+
+// Generic instances
+
+static void fill_generic(const block_kernels_t *k, float *data, int ramp, int chan_start, int chan_stop)
+{
+    fill_body(data, ramp, chan_start, chan_stop, k->dim);
+}
+
+static void compact_generic(const block_kernels_t *k, float *dst, const float *src)
+{
+    compact_body(dst, src, k->nchan, k->bin, k->gpu_bin);
+}
+
+static void copy_generic(const block_kernels_t *k, float *dst, const float *src)
+{
+    copy_body(dst, src, (size_t)k->nchan * k->bin * 2);
+}
+
+// Specialized instances for nchan channels of dim x dim tiles
+#define BLOCK_KERNELS(nchan, dim)                                                       \
+static void fill_##nchan##x##dim(const block_kernels_t *k, float *data, int ramp,       \
+                                 int chan_start, int chan_stop)                         \
+{                                                                                       \
+    (void)k;                                                                            \
+    fill_body(data, ramp, chan_start, chan_stop, dim);                                  \
+}                                                                                       \
+static void compact_##nchan##x##dim(const block_kernels_t *k, float *dst, const float *src) \
+{                                                                                       \
+    (void)k;                                                                            \
+    compact_body(dst, src, nchan, (dim) * ((dim) + 1) * 2, GPU_BIN_SIZE);               \
+}                                                                                       \
+static void copy_##nchan##x##dim(const block_kernels_t *k, float *dst, const float *src) \
+{                                                                                       \
+    (void)k;                                                                            \
+    copy_body(dst, src, (size_t)(nchan) * (dim) * ((dim) + 1) * 4);                     \
+}
+
+#define BLOCK_KERNELS_ENTRY(nchan, dim)                                                 \
+    { #nchan "x" #dim, nchan, dim, (dim) * ((dim) + 1) * 2, GPU_BIN_SIZE,               \
+      fill_##nchan##x##dim, clear_channels, compact_##nchan##x##dim,                  \
+      copy_##nchan##x##dim }
+
+BLOCK_KERNELS(5, 20)
+BLOCK_KERNELS(50, 20)
+BLOCK_KERNELS(160, 20)
+
+static const block_kernels_t specialized[] = {
+    BLOCK_KERNELS_ENTRY(5, 20),
+    BLOCK_KERNELS_ENTRY(50, 20),
+    BLOCK_KERNELS_ENTRY(160, 20),
+};
+
+static block_kernels_t generic;
+
+const block_kernels_t *block_kernels_generic(int nchan, int nantennas)
+{
+    generic.name = "generic";
+    generic.nchan = nchan;
+    generic.dim = nantennas / 2;
+    generic.bin = generic.dim * (generic.dim + 1) * 2;
+    generic.gpu_bin = GPU_BIN_SIZE;
+    generic.fill = fill_generic;
+    generic.clear = clear_channels;
+    generic.compact = compact_generic;
+    generic.copy = copy_generic;
+    return &generic;
+}
+
+const block_kernels_t *block_kernels_select(int nchan, int nantennas)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof (specialized) / sizeof (specialized[0]); i++)
+    {
+        if (specialized[i].nchan == nchan && specialized[i].dim * 2 == nantennas)
+        {
+            block_kernels = &specialized[i];
+            return block_kernels;
+        }
+    }
+
+    block_kernels = block_kernels_generic(nchan, nantennas);
+    return block_kernels;
+}
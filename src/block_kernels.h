@@ -0,0 +1,77 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+#ifndef BLOCK_KERNELS_H
+#define BLOCK_KERNELS_H
+
+#include "gpu_output_databuf.h"
+
+// Loops over the block layout: the ramp fill used by fake_gpu_thread, the
+//   compaction of GPU output (GPU_BIN_SIZE pairs per channel) into the
+//   ring's packed layout (NONZERO_BIN_SIZE pairs per channel), and the copy
+//   of a block's valid data.
+//
+// Each supported configuration (5, 50 and 160 channels of 40 antennas) has
+//   its own instance of every kernel with the channel count and tile
+//   dimension as constants, so that the compiler can unroll and vectorize
+//   the loops with known trip counts. Any other layout gets the generic
+//   instances, which take the same values from the table at run time.
+//   block_kernels_select() picks the instances for a layout; it is called
+//   when the ring is created, and the choice is in block_kernels.
+
+typedef struct block_kernels block_kernels_t;
+
+struct block_kernels {
+    const char *name;
+    int nchan;
+    // Tiles of 2x2 elements along each side of the covariance matrix
+    //   (antennas / 2)
+    int dim;
+    // Complex pairs per channel in the ring and in the GPU's output
+    int bin;
+    int gpu_bin;
+
+    // Writes the ramp test pattern for channels [chan_start, chan_stop),
+    //   offset by ramp so that consecutive blocks join up
+    void (*fill)(const block_kernels_t *k, float *data, int ramp, int chan_start, int chan_stop);
+    // Zeroes channels [chan_start, chan_stop), for the channels a load step
+    //   does not generate
+    void (*clear)(const block_kernels_t *k, float *data, int chan_start, int chan_stop);
+    // Packs every channel of src, gpu_bin pairs apart, into dst
+    void (*compact)(const block_kernels_t *k, float *dst, const float *src);
+    // Copies the valid data (nchan * bin pairs) of a block
+    void (*copy)(const block_kernels_t *k, float *dst, const float *src);
+};
+
+// The kernels chosen for the ring's layout
+extern const block_kernels_t *block_kernels;
+
+// Chooses the kernels for nchan channels of nantennas antennas, sets
+//   block_kernels to them and returns them
+const block_kernels_t *block_kernels_select(int nchan, int nantennas);
+
+// The generic kernels for a layout, for comparison with the specialized
+//   ones. The table is overwritten by each call
+const block_kernels_t *block_kernels_generic(int nchan, int nantennas);
+
+#endif
@@ -0,0 +1,253 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "hashpipe.h"
+#include "gpu_output_databuf.h"
+#include "compress.h"
+
+// Byte-shuffles one segment of floats so that byte plane 0 holds the most
+//   significant byte of every float
+static void shuffle_segment(const unsigned char *src, size_t nfloats, unsigned char *dst)
+{
+    size_t i;
+    int b;
+
+    for (b = 0; b < 4; b++)
+    {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        const unsigned char *s = src + (3 - b);
+#else
+        const unsigned char *s = src + b;
+#endif
+        unsigned char *d = dst + b * nfloats;
+        for (i = 0; i < nfloats; i++)
+            d[i] = s[i * 4];
+    }
+}
+
+int shuffle_compress(const float *src, size_t nfloats, size_t seg_floats, int level,
+                     unsigned char *scratch, unsigned char *dst, size_t *dst_len)
+{
+    size_t off;
+
+    for (off = 0; off < nfloats; off += seg_floats)
+    {
+        size_t n = nfloats - off < seg_floats ? nfloats - off : seg_floats;
+        shuffle_segment((const unsigned char *)(src + off), n, scratch + off * 4);
+    }
+
+    uLongf len = compressBound(nfloats * 4);
+    int rv = compress2(dst, &len, scratch, nfloats * 4, level);
+    *dst_len = len;
+
+    return rv == Z_OK ? 0 : -1;
+}
+
+static void *comp_worker(void *arg)
+{
+    comp_pool_t *pool = (comp_pool_t *)arg;
+    unsigned char *scratch = malloc(pool->max_floats * 4);
+    struct timespec start, stop;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop)
+    {
+        if (pool->next_claim == pool->next_submit)
+        {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+            continue;
+        }
+
+        int slot = pool->next_claim++ % COMP_MAX_JOBS;
+        comp_job_t *job = &pool->jobs[slot];
+        pthread_mutex_unlock(&pool->lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        job->status = shuffle_compress(job->src, job->nfloats, pool->seg_floats, pool->level,
+                                       scratch, job->dst, &job->dst_len);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->done[slot] = 1;
+        pool->bytes_in += job->nfloats * 4;
+        pool->bytes_out += job->dst_len;
+        pool->busy_ns += ELAPSED_NS(start, stop);
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(scratch);
+    return NULL;
+}
+
+comp_pool_t *comp_pool_create(int nthreads, int level, size_t seg_floats, size_t max_floats)
+{
+    int i;
+    comp_pool_t *pool = calloc(1, sizeof (comp_pool_t));
+
+    pool->nthreads = nthreads;
+    pool->level = level;
+    pool->seg_floats = seg_floats;
+    pool->max_floats = max_floats;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    for (i = 0; i < COMP_MAX_JOBS; i++)
+        pool->jobs[i].dst = malloc(compressBound(max_floats * 4));
+
+    pool->threads = calloc(nthreads, sizeof (pthread_t));
+    for (i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, comp_worker, pool) != 0)
+        {
+            hashpipe_error(__FUNCTION__, "could not start compression thread %d", i);
+            pool->nthreads = i;
+            break;
+        }
+    }
+
+    if (pool->nthreads == 0)
+    {
+        comp_pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void comp_pool_destroy(comp_pool_t *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    for (i = 0; i < COMP_MAX_JOBS; i++)
+        free(pool->jobs[i].dst);
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool);
+}
+
+void comp_pool_submit(comp_pool_t *pool, const float *src, size_t nfloats,
+                      int block_idx, int row_num, void *user)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next_submit - pool->next_retire >= COMP_MAX_JOBS)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+
+    int slot = pool->next_submit % COMP_MAX_JOBS;
+    comp_job_t *job = &pool->jobs[slot];
+    job->src = src;
+    job->nfloats = nfloats;
+    job->dst_len = 0;
+    job->status = 0;
+    job->block_idx = block_idx;
+    job->row_num = row_num;
+    job->user = user;
+    pool->done[slot] = 0;
+    pool->next_submit++;
+
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int comp_pool_inflight(comp_pool_t *pool)
+{
+    int n;
+
+    pthread_mutex_lock(&pool->lock);
+    n = pool->next_submit - pool->next_retire;
+    pthread_mutex_unlock(&pool->lock);
+
+    return n;
+}
+
+comp_job_t *comp_pool_wait_oldest(comp_pool_t *pool)
+{
+    comp_job_t *job = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->next_retire != pool->next_submit)
+    {
+        int slot = pool->next_retire % COMP_MAX_JOBS;
+        while (!pool->done[slot])
+            pthread_cond_wait(&pool->done_cond, &pool->lock);
+        job = &pool->jobs[slot];
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return job;
+}
+
+void comp_pool_retire(comp_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->next_retire++;
+    pthread_cond_broadcast(&pool->done_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void comp_pool_reset_stats(comp_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->bytes_in = 0;
+    pool->bytes_out = 0;
+    pool->busy_ns = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+double comp_pool_ratio(comp_pool_t *pool)
+{
+    double ratio;
+
+    pthread_mutex_lock(&pool->lock);
+    ratio = pool->bytes_out ? (double)pool->bytes_in / pool->bytes_out : 0.0;
+    pthread_mutex_unlock(&pool->lock);
+
+    return ratio;
+}
+
+double comp_pool_mbps(comp_pool_t *pool)
+{
+    double mbps;
+
+    pthread_mutex_lock(&pool->lock);
+    mbps = pool->busy_ns ? (pool->bytes_in / (1024.0 * 1024.0)) / (pool->busy_ns / 1e9) : 0.0;
+    pthread_mutex_unlock(&pool->lock);
+
+    return mbps;
+}
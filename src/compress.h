@@ -0,0 +1,102 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// The most jobs that can be in flight at once
+#define COMP_MAX_JOBS 16
+
+// A block of floats is compressed by splitting it into segments (one per
+//   channel), byte-shuffling each segment - all of the most significant
+//   bytes first, then the next, and so on, in big-endian order to match
+//   FITS - and deflating the result with zlib
+typedef struct comp_job {
+    // Input; must stay valid until the job has been retired
+    const float *src;
+    size_t nfloats;
+    // Compressed output, owned by the pool
+    unsigned char *dst;
+    size_t dst_len;
+    int status;
+    // Opaque values carried for the submitter
+    int block_idx;
+    int row_num;
+    void *user;
+} comp_job_t;
+
+typedef struct comp_pool {
+    int nthreads;
+    int level;
+    size_t seg_floats;
+    size_t max_floats;
+    pthread_t *threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+
+    comp_job_t jobs[COMP_MAX_JOBS];
+    int done[COMP_MAX_JOBS];
+    // Jobs are submitted, claimed and retired strictly in this order
+    uint64_t next_submit;
+    uint64_t next_claim;
+    uint64_t next_retire;
+    int stop;
+
+    // Statistics since the last comp_pool_reset_stats()
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    // Total time workers spent compressing
+    uint64_t busy_ns;
+} comp_pool_t;
+
+// Starts nthreads workers compressing at zlib level (1-9). Blocks of up to
+//   max_floats floats are shuffled in segments of seg_floats
+comp_pool_t *comp_pool_create(int nthreads, int level, size_t seg_floats, size_t max_floats);
+void comp_pool_destroy(comp_pool_t *pool);
+
+// Queues a block; waits if COMP_MAX_JOBS jobs are already in flight
+void comp_pool_submit(comp_pool_t *pool, const float *src, size_t nfloats,
+                      int block_idx, int row_num, void *user);
+// The number of jobs submitted but not yet retired
+int comp_pool_inflight(comp_pool_t *pool);
+// Waits for the oldest job to finish and returns it. It stays valid until
+//   comp_pool_retire() is called
+comp_job_t *comp_pool_wait_oldest(comp_pool_t *pool);
+void comp_pool_retire(comp_pool_t *pool);
+
+void comp_pool_reset_stats(comp_pool_t *pool);
+// Compression ratio (in/out) and per-thread throughput in MB/s of input
+double comp_pool_ratio(comp_pool_t *pool);
+double comp_pool_mbps(comp_pool_t *pool);
+
+// The shuffle+deflate itself; scratch must hold nfloats floats. Returns 0
+//   on success and sets *dst_len to the compressed size
+int shuffle_compress(const float *src, size_t nfloats, size_t seg_floats, int level,
+                     unsigned char *scratch, unsigned char *dst, size_t *dst_len);
+
+#endif
@@ -0,0 +1,196 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+// Expands every block to full Hermitian matrices for tools that cannot
+//   read xGPU's packed order, publishing the newest block in POSIX shared
+//   memory (COVSHM, see cov_shm_header_t), and passes the block on
+//   unchanged:
+// $ hashpipe -p fake_gpu -I 0 -c 3 fake_gpu_thread -c 4 cov_expand_thread -c 5 fits_writer_thread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "hashpipe.h"
+#include "shm_publish.h"
+#include "gpu_output_databuf.h"
+#include "covariance.h"
+
+#define COV_SHM_NAME_LENGTH 64
+#define COV_SHM_BYTES (sizeof (cov_shm_header_t) + (size_t)NUM_CHANNELS * COV_FULL_ELEMS * 2 * sizeof (float))
+
+static int init(struct hashpipe_thread_args *args)
+{
+    hashpipe_status_t st = args->st;
+    char name[COV_SHM_NAME_LENGTH];
+
+    // Default only: keep a name given on the command line (-o COVSHM=...)
+    hashpipe_status_lock_safe(&st);
+    if (hgets(st.buf, "COVSHM", sizeof (name), name) == 0)
+        hputs(st.buf, "COVSHM", "/sim1_cov_full");
+    hashpipe_status_unlock_safe(&st);
+
+    return 0;
+}
+
+// Waits for an input block to be filled. Returns -1 if the threads are
+//   stopping; exits the thread on databuf errors
+static int wait_filled(gpu_output_databuf_t *db, int block_idx, hashpipe_status_t *st,
+                       const char *status_key)
+{
+    int rv;
+
+    while ((rv=gpu_output_databuf_wait_filled(db, block_idx)) != HASHPIPE_OK)
+    {
+        if (rv==HASHPIPE_TIMEOUT) {
+            if (!run_threads())
+                return -1;
+            hashpipe_status_lock_safe(st);
+            hputs(st->buf, status_key, "waiting");
+            hashpipe_status_unlock_safe(st);
+            continue;
+        }
+        else
+        {
+            hashpipe_error(__FUNCTION__, "error waiting for filled databuf");
+            pthread_exit(NULL);
+        }
+    }
+    gpu_output_databuf_claim(db, block_idx);
+    return 0;
+}
+
+// As wait_filled(), for an output block to be freed
+static int wait_free(gpu_output_databuf_t *db, int block_idx, hashpipe_status_t *st,
+                     const char *status_key)
+{
+    int rv;
+
+    while ((rv=gpu_output_databuf_wait_free(db, block_idx)) != HASHPIPE_OK)
+    {
+        if (rv==HASHPIPE_TIMEOUT) {
+            if (!run_threads())
+                return -1;
+            hashpipe_status_lock_safe(st);
+            hputs(st->buf, status_key, "blocked");
+            hashpipe_status_unlock_safe(st);
+            continue;
+        }
+        else
+        {
+            hashpipe_error(__FUNCTION__, "error waiting for free databuf");
+            pthread_exit(NULL);
+        }
+    }
+    return 0;
+}
+
+static void *run(hashpipe_thread_args_t * args)
+{
+    gpu_output_databuf_t *db_in = (gpu_output_databuf_t *)args->ibuf;
+    gpu_output_databuf_t *db_out = (gpu_output_databuf_t *)args->obuf;
+    hashpipe_status_t st = args->st;
+    const char * status_key = args->thread_desc->skey;
+
+    int in_idx = 0;
+    int out_idx = 0;
+    gpu_output_databuf_block_t *in;
+    gpu_output_databuf_block_t *out;
+    char shm_name[COV_SHM_NAME_LENGTH];
+    cov_shm_header_t *shm;
+
+    hashpipe_status_lock_safe(&st);
+    hgets(st.buf, "COVSHM", sizeof (shm_name), shm_name);
+    hashpipe_status_unlock_safe(&st);
+    shm = shm_publish_open(shm_name, COV_SHM_BYTES, offsetof(cov_shm_header_t, seq));
+    if (shm != NULL)
+    {
+        shm->magic = COV_SHM_MAGIC;
+        shm->nchan = NUM_CHANNELS;
+        shm->nant = NUM_ANTENNAS;
+        fprintf(stderr, "cov_expand_thread: publishing full matrices in %s\n", shm_name);
+    }
+
+    while (run_threads())
+    {
+        if (wait_filled(db_in, in_idx, &st, status_key) != 0)
+            break;
+        in = &db_in->block[in_idx];
+
+        hashpipe_status_lock_safe(&st);
+        hputs(st.buf, status_key, "expanding");
+        hashpipe_status_unlock_safe(&st);
+
+        if (shm != NULL)
+        {
+            __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            shm->mcnt = in->header.mcnt;
+            shm->scan_num = in->header.scan_num;
+            shm->dmjd = in->header.dmjd;
+            cov_expand_channels(in->data, NUM_CHANNELS, (float *)(shm + 1));
+            __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+        }
+
+        // Pass the covariance on
+        if (wait_free(db_out, out_idx, &st, status_key) != 0)
+            break;
+        out = &db_out->block[out_idx];
+        memcpy(out, in, sizeof (*out));
+        out->header.chans_ready = 0;
+
+        __atomic_store_n(&in->header.chans_ready, 0, __ATOMIC_RELEASE);
+        clock_gettime(CLOCK_MONOTONIC, &in->header.freed);
+        gpu_output_databuf_set_free(db_in, in_idx);
+        in_idx = (in_idx + 1) % NUM_BLOCKS;
+
+        // Consumers in chunked mode wait for this before reading the header
+        __atomic_store_n(&out->header.chans_ready, NUM_CHANNELS, __ATOMIC_RELEASE);
+        gpu_output_databuf_set_filled(db_out, out_idx);
+        out_idx = (out_idx + 1) % NUM_BLOCKS;
+
+        pthread_testcancel();
+    }
+
+    if (shm != NULL)
+        munmap(shm, COV_SHM_BYTES);
+    return THREAD_OK;
+}
+
+static hashpipe_thread_desc_t cov_expand_thread = {
+    name: "cov_expand_thread",
+    skey: "COVSTAT",
+    init: init,
+    run:  run,
+    ibuf_desc: {gpu_output_databuf_create},
+    obuf_desc: {gpu_output_databuf_create}
+};
+
+static __attribute__((constructor)) void ctor()
+{
+  register_hashpipe_thread(&cov_expand_thread);
+}
@@ -0,0 +1,146 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#include <string.h>
+
+#include "covariance.h"
+
+#define FULL(row, col) (((row) * NUM_ANTENNAS + (col)) * 2)
+
+// Copies tile (j, k) into place and, off the diagonal, its conjugate
+//   transpose into tile (k, j)
+static inline void expand_tile(const float *t, float *full, int j, int k)
+{
+    float *r0 = full + FULL(2 * j, 2 * k);
+    float *r1 = r0 + NUM_ANTENNAS * 2;
+
+    // Row 2j holds elements 0 and 1, row 2j+1 elements 2 and 3
+    memcpy(r0, t, 4 * sizeof (float));
+    memcpy(r1, t + 4, 4 * sizeof (float));
+
+    if (j != k)
+    {
+        float *m0 = full + FULL(2 * k, 2 * j);
+        float *m1 = m0 + NUM_ANTENNAS * 2;
+
+        m0[0] = t[0]; m0[1] = -t[1]; m0[2] = t[4]; m0[3] = -t[5];
+        m1[0] = t[2]; m1[1] = -t[3]; m1[2] = t[6]; m1[3] = -t[7];
+    }
+    else
+    {
+        // The lower triangle is authoritative
+        r0[2] = t[4];
+        r0[3] = -t[5];
+    }
+}
+
+void cov_expand(const float *packed, float *full)
+{
+    int jb, kb, j, k, j_stop, k_stop;
+
+    // Work through blocks of tiles so that the rows being written and the
+    //   mirrored rows both stay in cache
+    for (jb = 0; jb < COV_DIM; jb += COV_TILE_BLOCK)
+    {
+        j_stop = jb + COV_TILE_BLOCK < COV_DIM ? jb + COV_TILE_BLOCK : COV_DIM;
+        for (kb = 0; kb <= jb; kb += COV_TILE_BLOCK)
+        {
+            for (j = jb; j < j_stop; j++)
+            {
+                k_stop = kb + COV_TILE_BLOCK < j + 1 ? kb + COV_TILE_BLOCK : j + 1;
+                for (k = kb; k < k_stop; k++)
+                    expand_tile(packed + 8 * (j * (j + 1) / 2 + k), full, j, k);
+            }
+        }
+    }
+}
+
+void cov_pack(const float *full, float *packed)
+{
+    int j, k;
+    float *t = packed;
+
+    // The packed side is written sequentially
+    for (j = 0; j < COV_DIM; j++)
+    {
+        for (k = 0; k <= j; k++, t += 8)
+        {
+            memcpy(t, full + FULL(2 * j, 2 * k), 4 * sizeof (float));
+            memcpy(t + 4, full + FULL(2 * j + 1, 2 * k), 4 * sizeof (float));
+        }
+    }
+}
+
+void cov_expand_channels(const float *packed, int nchan, float *full)
+{
+    int c;
+
+    for (c = 0; c < nchan; c++)
+        cov_expand(packed + CHAN_DATA_OFFSET(c), full + (size_t)c * COV_FULL_ELEMS * 2);
+}
+
+void cov_pack_channels(const float *full, int nchan, float *packed)
+{
+    int c;
+
+    for (c = 0; c < nchan; c++)
+        cov_pack(full + (size_t)c * COV_FULL_ELEMS * 2, packed + CHAN_DATA_OFFSET(c));
+}
+
+void cov_expand_ref(const float *packed, float *full)
+{
+    int row, col, e;
+
+    for (row = 0; row < NUM_ANTENNAS; row++)
+    {
+        for (col = 0; col < NUM_ANTENNAS; col++)
+        {
+            if (row >= col)
+            {
+                e = cov_packed_index(row, col);
+                full[FULL(row, col)] = packed[2 * e];
+                full[FULL(row, col) + 1] = packed[2 * e + 1];
+            }
+            else
+            {
+                e = cov_packed_index(col, row);
+                full[FULL(row, col)] = packed[2 * e];
+                full[FULL(row, col) + 1] = -packed[2 * e + 1];
+            }
+        }
+    }
+}
+
+void cov_pack_ref(const float *full, float *packed)
+{
+    int row, col, e;
+
+    for (row = 0; row < NUM_ANTENNAS; row++)
+    {
+        for (col = 0; col < (row / 2 + 1) * 2; col++)
+        {
+            e = cov_packed_index(row, col);
+            packed[2 * e] = full[FULL(row, col)];
+            packed[2 * e + 1] = full[FULL(row, col) + 1];
+        }
+    }
+}
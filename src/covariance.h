@@ -0,0 +1,86 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef COVARIANCE_H
+#define COVARIANCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gpu_output_databuf.h"
+
+// xGPU packs each channel's covariance matrix as the lower triangle of
+//   COV_DIM x COV_DIM tiles of 2x2 complex elements, row of tiles after
+//   row of tiles. Tile (j, k), k <= j, holds elements (2j, 2k), (2j, 2k+1),
+//   (2j+1, 2k) and (2j+1, 2k+1) in that order (see scripts/test.py).
+//   On the diagonal tiles the (2j, 2j+1) element is redundant.
+//
+// The full matrix is NUM_ANTENNAS x NUM_ANTENNAS complex (re, im) floats,
+//   row major.
+
+#define COV_DIM (NUM_ANTENNAS / 2)
+// Complex elements per channel in each layout
+#define COV_PACKED_ELEMS (COV_DIM * (COV_DIM + 1) * 2)
+#define COV_FULL_ELEMS (NUM_ANTENNAS * NUM_ANTENNAS)
+// Tiles per side of the blocks that cov_expand() works through
+#define COV_TILE_BLOCK 4
+
+// Index of complex element (row, col) in the packed layout; the element
+//   must lie in a lower-triangle tile (row / 2 >= col / 2)
+static inline int cov_packed_index(int row, int col)
+{
+    int j = row / 2;
+    int k = col / 2;
+    return 4 * (j * (j + 1) / 2 + k) + 2 * (row & 1) + (col & 1);
+}
+
+// Expands one channel to the full Hermitian matrix, mirroring the lower
+//   triangle (which includes the diagonal) into the upper
+void cov_expand(const float *packed, float *full);
+// The reverse; only the lower-triangle tiles of full are read
+void cov_pack(const float *full, float *packed);
+
+// nchan channels at a time, packed channels CHAN_DATA_OFFSET(1) apart
+void cov_expand_channels(const float *packed, int nchan, float *full);
+void cov_pack_channels(const float *full, int nchan, float *packed);
+
+// Element-by-element versions for checking the above
+void cov_expand_ref(const float *packed, float *full);
+void cov_pack_ref(const float *full, float *packed);
+
+// Layout of the shared memory published by cov_expand_thread: this
+//   header followed by nchan full matrices (COV_FULL_ELEMS complex floats
+//   each). seq is odd while the matrices are being rewritten; a reader
+//   copies what it needs and retries if seq was odd or changed meanwhile
+#define COV_SHM_MAGIC 0x53314346
+typedef struct cov_shm_header {
+    uint32_t magic;
+    uint32_t nchan;
+    uint32_t nant;
+    uint32_t pad;
+    uint64_t seq;
+    int32_t mcnt;
+    int32_t scan_num;
+    double dmjd;
+} cov_shm_header_t;
+
+#endif
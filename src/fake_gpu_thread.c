@@ -40,6 +40,15 @@
 #include "gpu_output_databuf.h"
 #include "fitsio.h"
 #include "fifo.h"
+#include "sim_time.h"
+#include "scan_sched.h"
+#include "replay.h"
+#include "wait_policy.h"
+#include "overrun.h"
+#include "load_profile.h"
+#include "block_kernels.h"
+#include "metrics.h"
+#include "status_cache.h"
 //#include "matrix_map.h"
 
 #define SCAN_STATUS_LENGTH 10
@@ -47,14 +56,12 @@
 #define ELAPSED_NS(start,stop) \
   (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
 
-#define MJD_1970_EPOCH (40587)
+// If the scan starts within this long we sleep straight to the start time
+//   instead of going around the (up to 1 s) check_cmd poll again
+#define START_SLEEP_WINDOW_NS (1500000000LL)
 
 // #define DEBUG
 
-double timeval_2_mjd(timeval *tv);
-time_t dmjd_2_secs(double dmjd);
-double get_curr_time_dmjd();
-
 int gpu_fifo_id;
 
 // int old_to_new_map[GPU_BIN_SIZE];
@@ -96,6 +103,20 @@ static int init(struct hashpipe_thread_args *args)
     hputs(st.buf, "SCANSTAT", "off");
     // Initialize start time to impossible value
     hputr8(st.buf, "STRTDMJD", -1.0);
+    // The same start time split into integer MJD and day fraction; takes
+    //   precedence over STRTDMJD when STRTIMJD is non-negative
+    hputi4(st.buf, "STRTIMJD", -1);
+    hputs(st.buf, "STRTFMJD", "0.0");
+    // Publish whole blocks only, unless asked to stream channel groups
+    hputi4(st.buf, "CHANGRP", 0);
+    // Schedule file loaded by the SCHEDULE command
+    hputs(st.buf, "SCHEDFIL", "/tmp/tchamber/sim1_schedule");
+    // Generate ramps unless asked to replay a recording
+    hputs(st.buf, "SRCMODE", "RAMP");
+    hputs(st.buf, "OVERRUN", "BLOCK");
+    // Run in real time
+    hputr8(st.buf, "SIMSPEED", 1.0);
+    hputr8(st.buf, "REPLAYRT", 1.0);
     hashpipe_status_unlock_safe(&st);
 
     // get_mapping_C(GPU_BIN_SIZE, old_to_new_map);
@@ -113,12 +134,97 @@ static int init(struct hashpipe_thread_args *args)
     return 0;
 }
 
+// Sets up the data source for a scan from SRCMODE, REPLAYF and REPLAYRT.
+//   A recording stays mapped from one scan to the next while REPLAYF is
+//   unchanged. rate is the pacing as a multiple of real time; 0 means as
+//   fast as the ring allows. Returns 0 on success
+static int configure_source(hashpipe_status_t *st, replay_t **replay, double *rate)
+{
+    char mode[16] = "RAMP";
+    char filename[256] = "";
+
+    hashpipe_status_lock_safe(st);
+    hgets(st->buf, "SRCMODE", sizeof (mode), mode);
+    hgets(st->buf, "REPLAYF", sizeof (filename), filename);
+    *rate = 1.0;
+    hgetr8(st->buf, "REPLAYRT", rate);
+    hashpipe_status_unlock_safe(st);
+
+    if (strcmp(mode, "REPLAY") != 0)
+    {
+        if (strcmp(mode, "RAMP") != 0)
+            hashpipe_warn(__FUNCTION__, "unknown SRCMODE %s; generating ramps", mode);
+        replay_close(*replay);
+        *replay = NULL;
+        *rate = 1.0;
+        return 0;
+    }
+
+    if (*rate < 0)
+        *rate = 0;
+    if (*replay != NULL && strcmp((*replay)->filename, filename) != 0)
+    {
+        replay_close(*replay);
+        *replay = NULL;
+    }
+    if (*replay == NULL)
+    {
+        *replay = replay_open(filename);
+        if (*replay == NULL)
+        {
+            hashpipe_error(__FUNCTION__, "cannot replay REPLAYF (%s)", filename);
+            return -1;
+        }
+        fprintf(stderr, "Replaying %ld blocks from %s (%s)\n", (*replay)->nrows, filename,
+                (*replay)->big_endian ? replay_isa() : "native");
+    }
+    if (*rate > 0)
+        fprintf(stderr, "Replay at %gx real time\n", *rate);
+    else
+        fprintf(stderr, "Replay as fast as possible\n");
+    return 0;
+}
+
+// Sets the speed of the process's clock from SIMSPEED: a multiple of real
+//   time, or 0 to skip every wait. Scan start times, schedules, pacing and
+//   the scan time reports all follow it
+static void configure_clock(hashpipe_status_t *st)
+{
+    double speed = 1.0;
+    mjd_time_t now;
+
+    hashpipe_status_lock_safe(st);
+    hgetr8(st->buf, "SIMSPEED", &speed);
+    hashpipe_status_unlock_safe(st);
+
+    if (speed != sim_clock_speed())
+    {
+        sim_clock_set_speed(speed);
+        if (speed > 0)
+            fprintf(stderr, "Simulated time runs at %gx real time\n", speed);
+        else
+            fprintf(stderr, "Simulated time skips every wait\n");
+    }
+
+    get_curr_time_mjd(&now);
+    hashpipe_status_lock_safe(st);
+    hputr8(st->buf, "SIMDMJD", mjd_time_2_dmjd(&now));
+    hashpipe_status_unlock_safe(st);
+}
+
 static void *run(hashpipe_thread_args_t * args)
 {
     gpu_output_databuf_t *db = (gpu_output_databuf_t *)args->obuf;
     hashpipe_status_t st = args->st;
     const char * status_key = args->thread_desc->skey;
 
+    // The keys used on every pass through the loop
+    status_key_t k_status, k_scanstat, k_scanlen, k_strtdmjd;
+    status_key_init(&k_status, status_key);
+    status_key_init(&k_scanstat, "SCANSTAT");
+    status_key_init(&k_scanlen, "SCANLEN");
+    status_key_init(&k_strtdmjd, "STRTDMJD");
+
     // Return value; temporary value used to evaluate result of function calls
     int rv;
 
@@ -126,6 +232,8 @@ static void *run(hashpipe_thread_args_t * args)
     int block_idx = 0;
     // The current frame counter value
     int mcnt = 0;
+    // The number of the scan currently being (or about to be) written
+    int scan_num = 0;
 
     // The current status of the scan
     char scan_status[SCAN_STATUS_LENGTH];
@@ -136,6 +244,9 @@ static void *run(hashpipe_thread_args_t * args)
     int num_blocks_to_write = -1;
     int block_counter = 0;
 
+    // The number of channels filled between updates of chans_ready
+    int chan_group = NUM_CHANNELS;
+
     timespec scan_start_time, scan_stop_time;
     timespec sleep_until;
 #ifdef DEBUG
@@ -150,8 +261,35 @@ static void *run(hashpipe_thread_args_t * args)
 
     int cmd = INVALID;
 
-    double curr_time_dmjd = -1;
     double start_time_dmjd = -1;
+    // Exact scan start time; start_time_dmjd is kept for reporting
+    mjd_time_t start_time, curr_time;
+    int start_imjd = -1;
+    char start_fmjd[32];
+
+    // The schedule entry being run, or -1 outside of a schedule
+    int sched_idx = -1;
+    scan_entry_t entry;
+    char sched_file[256];
+
+    // The recording being played back with SRCMODE=REPLAY, the next row
+    //   of it to play and the pacing as a multiple of real time (0 for
+    //   none)
+    replay_t *replay = NULL;
+    long replay_row = 0;
+    double pace_rate = 1.0;
+
+    // How we wait for the consumer to free blocks, and what we do when it
+    //   falls behind
+    wait_policy_t wait_pol;
+    wait_policy_configure(&wait_pol, &st);
+    overrun_t overrun;
+    overrun_configure(&overrun, &st);
+    // The slot the current block goes in, or -1 if it is dropped
+    int slot;
+    // How the pacing varies through the scan
+    load_profile_t load;
+    load_profile_configure(&load, &st, pace_rate);
 
     while (run_threads())
     {
@@ -159,8 +297,8 @@ static void *run(hashpipe_thread_args_t * args)
         clock_gettime(CLOCK_MONOTONIC, &loop_start);
 #endif
         hashpipe_status_lock_safe(&st);
-        hputs(st.buf, status_key, "waiting");
-        hgets(st.buf, "SCANSTAT", SCAN_STATUS_LENGTH, scan_status);
+        status_key_puts(&st, &k_status, "waiting");
+        status_key_gets(&st, &k_scanstat, SCAN_STATUS_LENGTH, scan_status);
         hashpipe_status_unlock_safe(&st);
 
         // Check for a command from the user
@@ -172,7 +310,7 @@ static void *run(hashpipe_thread_args_t * args)
             fprintf(stderr, "fake_gpu_thread received START!\n");
 
             hashpipe_status_lock_safe(&st);
-            hgets(st.buf, "SCANSTAT", SCAN_STATUS_LENGTH, scan_status);
+            status_key_gets(&st, &k_scanstat, SCAN_STATUS_LENGTH, scan_status);
             hashpipe_status_unlock_safe(&st);
             // If we are either scanning or committed to a scan, continue with loop
             if (strcmp(scan_status, "scanning") == 0 || strcmp(scan_status, "committed") == 0)
@@ -186,11 +324,54 @@ static void *run(hashpipe_thread_args_t * args)
 
             hashpipe_status_lock_safe(&st);
             // ...find out how long we should scan
-            hgeti4(st.buf, "SCANLEN", &requested_scan_length);
-            hgetr8(st.buf, "STRTDMJD", &start_time_dmjd);
-            hputs(st.buf, "SCANSTAT", "committed");
+            status_key_geti4(&st, &k_scanlen, &requested_scan_length);
+            status_key_getr8(&st, &k_strtdmjd, &start_time_dmjd);
+            chan_group = 0;
+            hgeti4(st.buf, "CHANGRP", &chan_group);
+            start_imjd = -1;
+            hgeti4(st.buf, "STRTIMJD", &start_imjd);
+            strcpy(start_fmjd, "0.0");
+            hgets(st.buf, "STRTFMJD", sizeof (start_fmjd), start_fmjd);
+            // Consume the split start time so that a later scan started by
+            //   setting only STRTDMJD doesn't pick up a stale value
+            hputi4(st.buf, "STRTIMJD", -1);
+            status_key_puts(&st, &k_scanstat, "committed");
             hashpipe_status_unlock_safe(&st);
 
+            // CHANGRP <= 0 means the block is published in one piece
+            if (chan_group <= 0 || chan_group > NUM_CHANNELS)
+                chan_group = NUM_CHANNELS;
+
+            configure_clock(&st);
+            if (configure_source(&st, &replay, &pace_rate) != 0)
+            {
+                hashpipe_status_lock_safe(&st);
+                status_key_puts(&st, &k_scanstat, "off");
+                hashpipe_status_unlock_safe(&st);
+                continue;
+            }
+            replay_row = 0;
+            wait_policy_configure(&wait_pol, &st);
+            overrun_configure(&overrun, &st);
+            load_profile_configure(&load, &st, pace_rate);
+
+            if (start_imjd >= 0)
+            {
+                if (mjd_frac_2_mjd_time(start_imjd, start_fmjd, &start_time) != 0)
+                {
+                    hashpipe_error(__FUNCTION__, "STRTFMJD (%s) is not a valid day fraction", start_fmjd);
+                    hashpipe_status_lock_safe(&st);
+                    status_key_puts(&st, &k_scanstat, "off");
+                    hashpipe_status_unlock_safe(&st);
+                    continue;
+                }
+                start_time_dmjd = mjd_time_2_dmjd(&start_time);
+            }
+            else
+            {
+                dmjd_2_mjd_time(start_time_dmjd, &start_time);
+            }
+
 
             if (start_time_dmjd < 0)
             {
@@ -202,8 +383,10 @@ static void *run(hashpipe_thread_args_t * args)
             num_blocks_to_write = (PACKET_RATE * requested_scan_length) / N;
             fprintf(stderr, "Number of blocks to write: %d\n", num_blocks_to_write);
 
-            fprintf(stderr, "The scan will start at DMJD: %f\n", start_time_dmjd);
-            fprintf(stderr, "The scan will start in %lu seconds\n", dmjd_2_secs(start_time_dmjd) - dmjd_2_secs(get_curr_time_dmjd()));
+            get_curr_time_mjd(&curr_time);
+            fprintf(stderr, "The scan will start at DMJD: %.9f\n", start_time_dmjd);
+            fprintf(stderr, "The scan will start in %f seconds\n",
+                    mjd_time_diff_ns(&start_time, &curr_time) / 1000000000.0);
             fprintf(stderr, "The scan will last %d seconds\n", requested_scan_length);
 
             // Check to see if the scan length is correct...
@@ -213,7 +396,7 @@ static void *run(hashpipe_thread_args_t * args)
                 hashpipe_error(__FUNCTION__, "SCANLEN has either not been set or has been set to an invalid value");
                 // ...stop the scan...
                 hashpipe_status_lock_safe(&st);
-                hputs(st.buf, "SCANSTAT", "off");
+                status_key_puts(&st, &k_scanstat, "off");
                 hashpipe_status_unlock_safe(&st);
                 // ...and skip the rest of the block
                 // TODO: should this be happening?
@@ -236,14 +419,83 @@ static void *run(hashpipe_thread_args_t * args)
 
             // TODO: check that num blocks to write is an integer
         }
+        else if (cmd == SCHEDULE)
+        {
+            fprintf(stderr, "fake_gpu_thread received SCHEDULE!\n");
+
+            hashpipe_status_lock_safe(&st);
+            status_key_gets(&st, &k_scanstat, SCAN_STATUS_LENGTH, scan_status);
+            hashpipe_status_unlock_safe(&st);
+            if (strcmp(scan_status, "scanning") == 0 || strcmp(scan_status, "committed") == 0)
+            {
+                fprintf(stderr, "We are already in or committed to a scan\n");
+                continue;
+            }
+
+            hashpipe_status_lock_safe(&st);
+            strcpy(sched_file, "");
+            hgets(st.buf, "SCHEDFIL", sizeof (sched_file), sched_file);
+            chan_group = 0;
+            hgeti4(st.buf, "CHANGRP", &chan_group);
+            hashpipe_status_unlock_safe(&st);
+
+            if (chan_group <= 0 || chan_group > NUM_CHANNELS)
+                chan_group = NUM_CHANNELS;
+
+            configure_clock(&st);
+            if (configure_source(&st, &replay, &pace_rate) != 0)
+            {
+                hashpipe_status_lock_safe(&st);
+                status_key_puts(&st, &k_scanstat, "off");
+                hashpipe_status_unlock_safe(&st);
+                continue;
+            }
+            replay_row = 0;
+            wait_policy_configure(&wait_pol, &st);
+            overrun_configure(&overrun, &st);
+            load_profile_configure(&load, &st, pace_rate);
+
+            // The schedule is process-wide; the writer follows it through
+            //   the sched_idx in each block header
+            if (scan_sched_load(sched_file) < 0)
+                continue;
+            fprintf(stderr, "Loaded %d scans from %s\n", scan_sched_count(), sched_file);
+
+            sched_idx = 0;
+            scan_sched_get(sched_idx, &entry);
+            start_time = entry.start;
+            start_time_dmjd = mjd_time_2_dmjd(&start_time);
+            requested_scan_length = entry.length;
+            num_blocks_to_write = scan_sched_num_blocks(entry.length);
+
+            hashpipe_status_lock_safe(&st);
+            status_key_puts(&st, &k_scanstat, "committed");
+            hashpipe_status_unlock_safe(&st);
+
+            get_curr_time_mjd(&curr_time);
+            fprintf(stderr, "Scan %s will start in %f seconds and last %d seconds\n",
+                    entry.name, mjd_time_diff_ns(&start_time, &curr_time) / 1000000000.0,
+                    entry.length);
+        }
         else if (cmd == STOP || cmd == QUIT)
         {
             fprintf(stderr, "Stop observations.\n");
 
             hashpipe_status_lock_safe(&st);
-            hputs(st.buf, "SCANSTAT", "off");
+            status_key_puts(&st, &k_scanstat, "off");
             hashpipe_status_unlock_safe(&st);
 
+            // A partially written scan still used up its scan number
+            if (block_counter > 0)
+                scan_num++;
+            // STOP abandons the rest of the schedule too. The writer
+            //   clears it when it closes the stopped scan's file, which
+            //   happens at the first block of the next scan
+            if (sched_idx >= 0)
+            {
+                scan_sched_end(block_counter > 0 ? sched_idx : sched_idx - 1);
+                sched_idx = -1;
+            }
             block_counter = 0;
             mcnt = 0;
 
@@ -259,24 +511,31 @@ static void *run(hashpipe_thread_args_t * args)
 
         // Now we can check if we are in a scan or not
         hashpipe_status_lock_safe(&st);
-        hgets(st.buf, "SCANSTAT", SCAN_STATUS_LENGTH, scan_status);
+        status_key_gets(&st, &k_scanstat, SCAN_STATUS_LENGTH, scan_status);
         hashpipe_status_unlock_safe(&st);
 
         // If we are "committed" - that is, we are waiting to reach the scan start time...
         if (strcmp(scan_status, "committed") == 0)
         {
-            curr_time_dmjd = get_curr_time_dmjd();
-            if (curr_time_dmjd >= start_time_dmjd && start_time_dmjd != -1)
+            get_curr_time_mjd(&curr_time);
+            int64_t ns_until_start = mjd_time_diff_ns(&start_time, &curr_time);
+            // The window is in real time, however fast the clock runs
+            if (sim_clock_real_ns(ns_until_start) <= START_SLEEP_WINDOW_NS && start_time_dmjd != -1)
             {
+                // Sleep to the exact start time so that every instance
+                //   starts on the same nanosecond-resolution deadline
+                if (ns_until_start > 0)
+                    sleep_until_mjd(&start_time);
+
                 fprintf(stderr, "Starting scan!\n");
                 hashpipe_status_lock_safe(&st);
-                hputs(st.buf, "SCANSTAT", "scanning");
+                status_key_puts(&st, &k_scanstat, "scanning");
                 hashpipe_status_unlock_safe(&st);
 
                 // Start the scan timer
-                clock_gettime(CLOCK_MONOTONIC, &scan_start_time);
+                sim_clock_now(&scan_start_time);
                 // Mark the time that all sleep intervals will be based off of
-                clock_gettime(CLOCK_MONOTONIC, &sleep_until);
+                sleep_until = scan_start_time;
             }
         }
         // If we are "scanning"...
@@ -285,21 +544,34 @@ static void *run(hashpipe_thread_args_t * args)
 #ifdef DEBUG
             clock_gettime(CLOCK_MONOTONIC, &blocked_start);
 #endif
-            // Wait for the current block to be set to free
-            while ((rv=gpu_output_databuf_wait_free(db, block_idx)) != HASHPIPE_OK)
+            // A real correlator can't wait for the consumer; with a
+            //   dropping OVERRUN policy only the first and last blocks of
+            //   the scan, which mark its boundaries, are waited for. An
+            //   unpaced replay is only ever held back by the ring, so it
+            //   always waits
+            slot = block_idx;
+            if (overrun.mode != OVERRUN_BLOCK && pace_rate > 0 && block_counter > 0 &&
+                block_counter + 1 < num_blocks_to_write &&
+                gpu_output_databuf_block_status(db, block_idx) != 0)
+                slot = overrun_make_room(&overrun, &st, db, block_idx, mcnt);
+            else
             {
-                if (rv==HASHPIPE_TIMEOUT)
-                {
-                    hashpipe_status_lock_safe(&st);
-                    hputs(st.buf, status_key, "blocked");
-                    hashpipe_status_unlock_safe(&st);
-                    continue;
-                }
-                else
+                // Wait for the current block to be set to free
+                while ((rv=wait_policy_free(&wait_pol, db, block_idx)) != HASHPIPE_OK)
                 {
-                    hashpipe_error(__FUNCTION__, "error waiting for free databuf");
-                    pthread_exit(NULL);
-                    break;
+                    if (rv==HASHPIPE_TIMEOUT)
+                    {
+                        hashpipe_status_lock_safe(&st);
+                        status_key_puts(&st, &k_status, "blocked");
+                        hashpipe_status_unlock_safe(&st);
+                        continue;
+                    }
+                    else
+                    {
+                        hashpipe_error(__FUNCTION__, "error waiting for free databuf");
+                        pthread_exit(NULL);
+                        break;
+                    }
                 }
             }
 
@@ -308,113 +580,93 @@ static void *run(hashpipe_thread_args_t * args)
             fprintf(stderr, "Time from blocked_start to blocked_stop is: %ld\n", ELAPSED_NS(blocked_start, blocked_stop));
             scan_loop_ns += ELAPSED_NS(blocked_start, blocked_stop);
 #endif
-            hashpipe_status_lock_safe(&st);
-            // Set status to sending
-            hputs(st.buf, status_key, "writing");
-            hashpipe_status_unlock_safe(&st);
+            if (slot < 0)
+            {
+                // Dropped: nothing is written, but time moves on
+                mcnt += N;
+            }
+            else
+            {
+                hashpipe_status_lock_safe(&st);
+                // Set status to sending
+                status_key_puts(&st, &k_status, "writing");
+                hashpipe_status_unlock_safe(&st);
 
-            db->block[block_idx].header.mcnt = mcnt;
-            mcnt += N;
+                gpu_output_databuf_block_header_t *header = &db->block[slot].header;
+                clock_gettime(CLOCK_MONOTONIC, &header->fill_start);
+                header->mcnt = mcnt;
+                header->scan_num = scan_num;
+                header->sched_idx = sched_idx;
+                header->scan_block = block_counter;
+                header->scan_nblocks = num_blocks_to_write;
+                header->acc_len = 1;
+                header->valid_bytes = VALID_DATA_BYTES;
+                header->dmjd = start_time_dmjd + (block_counter * INT_TIME) / 86400.0;
+                overrun_begin_fill(&overrun, db, slot);
+                mcnt += N;
 
 #ifdef DEBUG
 //             fprintf(stderr, "\tCurrent block is: %d\n", block_counter);
-//             fprintf(stderr, "\tWriting to block %d on mcnt %d\n", block_idx, db->block[block_idx].header.mcnt);
-            // Benchmark our write to shared memory
-            clock_gettime(CLOCK_MONOTONIC, &shm_start);
-            fprintf(stderr, "Time from blocked_stop to shm_start is: %ld ns\n",
-                    ELAPSED_NS(blocked_stop, shm_start));
-            scan_loop_ns += ELAPSED_NS(blocked_stop, shm_start);
+//             fprintf(stderr, "\tWriting to block %d on mcnt %d\n", block_idx, db->block[slot].header.mcnt);
+                // Benchmark our write to shared memory
+                clock_gettime(CLOCK_MONOTONIC, &shm_start);
+                fprintf(stderr, "Time from blocked_stop to shm_start is: %ld ns\n",
+                        ELAPSED_NS(blocked_stop, shm_start));
+                scan_loop_ns += ELAPSED_NS(blocked_stop, shm_start);
 #endif
 
-            // Zero out our shm block's data
-            memset(db->block[block_idx].data, 0, NUM_CHANNELS * GPU_BIN_SIZE * 2);
+                if (replay != NULL)
+                    replay_prefetch(replay, replay_row);
 
-            #define DIM 20
-
-            // I am so sorry in advance; I really just don't have time to remove
-            //   the horrendous code duplication here
-            // This is the element index. It tracks the index of the current
-            //   complex pair
-            int elem_i = 0;
-            // This is the 'channel' loop
-            int i;
-            for (i = 0; i < NUM_CHANNELS; i++)
-            {
-                // This is the 'column' loop
-                int j;
-                for (j = 0; j < DIM; j++)
+                // Fill the block one channel group at a time. In chunked mode
+                //   (CHANGRP > 0) each finished group is published through
+                //   chans_ready so that a consumer can start on it while the
+                //   remaining channels are still being generated
+                int chan;
+                for (chan = 0; chan < NUM_CHANNELS; chan += chan_group)
                 {
-                    // This is the 'row' loop
-                    // Together the 'column' and 'row' loops track our position
-                    //   (as an ordered pair) in the matrix
-                    int k;
-                    for (k = 0; k < j+1; k++)
+                    int chan_stop = chan + chan_group < NUM_CHANNELS ? chan + chan_group : NUM_CHANNELS;
+                    // A load step may generate fewer channels; the rest are
+                    //   zeroed, since the slot still holds an earlier block
+                    int fill_stop = chan_stop < load.chans ? chan_stop : load.chans;
+                    if (fill_stop < chan)
+                        fill_stop = chan;
+                    if (chan < fill_stop)
                     {
-                        int l;
-                        for (l = 0; l < 4; l++)
-                        {
-                            // We derive a 'real index' from the element counter.
-                            // This is the index of the real half of the complex pair
-                            int real_i = elem_i * 2;
-                            // This is the index of the imaginary half of the complex pair
-                            int imag_i = real_i + 1;
-
-                            // We will derive the 'column' portion of the coordinate
-                            //   and write it to the real half of the pair
-                            // We start with an offset in order to create a smooth
-                            //   ramp between the different blocks
-                            int real_coord = DIM * 2 * block_idx;
-                            // We will derive the 'row' portion of the coordinate
-                            //   and write it to the imaginary half of the pair
-                            // This allows us to write a ramp of ordered pairs to FITS
-                            int imag_coord = real_coord;
-                            // Account for the four diffent elements within
-                            //   each block
-                            if (l == 0)
-                            {
-                                real_coord += 2 * j;
-                                imag_coord += 2 * k;
-                            }
-                            else if (l == 1)
-                            {
-                                real_coord += 2 * j;
-                                imag_coord += 2 * k + 1;
-                            }
-                            else if (l == 2)
-                            {
-                                real_coord += 2 * j + 1;
-                                imag_coord += 2 * k;
-                            }
-                            else if (l == 3)
-                            {
-                                real_coord += 2 * j + 1;
-                                imag_coord += 2 * k + 1;
-                            }
-                            
-                            // Now we simply write the data itself to the proper block
-                            db->block[block_idx].data[real_i] = real_coord;
-                            db->block[block_idx].data[imag_i] = imag_coord;
-                            elem_i++;
-                        }
+                        if (replay != NULL)
+                            replay_fill(replay, replay_row, db->block[slot].data, chan, fill_stop);
+                        else
+                            block_kernels->fill(block_kernels, db->block[slot].data, slot, chan, fill_stop);
                     }
+                    block_kernels->clear(block_kernels, db->block[slot].data, fill_stop, chan_stop);
+                    __atomic_store_n(&header->chans_ready, chan_stop, __ATOMIC_RELEASE);
                 }
-            }
 
 #ifdef DEBUG
-            clock_gettime(CLOCK_MONOTONIC, &shm_stop);
+                clock_gettime(CLOCK_MONOTONIC, &shm_stop);
 
 //             // Calculate time taken to write to shm
-            fprintf(stderr, "Time from shm_start to shm_stop is: %ld ns\n", ELAPSED_NS(shm_start, shm_stop));
+                fprintf(stderr, "Time from shm_start to shm_stop is: %ld ns\n", ELAPSED_NS(shm_start, shm_stop));
 
-            scan_loop_ns += ELAPSED_NS(shm_start, shm_stop);
+                scan_loop_ns += ELAPSED_NS(shm_start, shm_stop);
 #endif
 
-            // Mark block as full
-            gpu_output_databuf_set_filled(db, block_idx);
+                // Mark block as full
+                clock_gettime(CLOCK_MONOTONIC, &header->fill_stop);
+                overrun_end_fill(&overrun, db);
+                metrics_add(&sim1_metrics.blocks_produced, 1);
+                metrics_add(&sim1_metrics.bytes_produced, VALID_DATA_BYTES);
+                // A block put in place of a dropped one is already in the ring
+                if (slot == block_idx)
+                {
+                    gpu_output_databuf_set_filled(db, block_idx);
 
-            // Setup for next block
-            block_idx = (block_idx + 1) % NUM_BLOCKS;
+                    // Setup for next block
+                    block_idx = (block_idx + 1) % NUM_BLOCKS;
+                }
+            }
             block_counter++;
+            replay_row++;
 
 #ifdef DEBUG
             clock_gettime(CLOCK_MONOTONIC, &loop_end);
@@ -423,14 +675,7 @@ static void *run(hashpipe_thread_args_t * args)
             scan_loop_ns += ELAPSED_NS(shm_stop, loop_end);
 #endif
 
-            sleep_until.tv_nsec += INT_TIME_NS;
-            // Handle overflow of ns->s
-            if(sleep_until.tv_nsec >= 1000000000)
-            {
-                sleep_until.tv_nsec -= 1000000000;
-                sleep_until.tv_sec++;
-            }
-            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &sleep_until, NULL);
+            load_profile_pace(&load, &st, db, &sleep_until, overrun.dropped);
 
             // TODO: For debugging, print out how long we are waiting this cycle
 
@@ -452,11 +697,13 @@ static void *run(hashpipe_thread_args_t * args)
                     exit(EXIT_FAILURE);
                 }
 
-                hputs(st.buf, "SCANSTAT", "off");
-                clock_gettime(CLOCK_MONOTONIC, &scan_stop_time);
+                sim_clock_now(&scan_stop_time);
                 fprintf(stderr, "\nScan complete!\n\tRequested scan time: %d\n\tActual scan time: %f\n",
                         requested_scan_length, (double)ELAPSED_NS(scan_start_time, scan_stop_time) / 1000000000.0);
                 fprintf(stderr, "\nWe wrote %d blocks to shared memory\n", block_counter);
+                wait_policy_report(&wait_pol, &st, "Producer", "FWAKP50", "FWAKP99");
+                load_profile_report(&load, &st, scan_num);
+                overrun_report(&overrun, &st, num_blocks_to_write);
 
                 fprintf(stderr, "\nPACKET_RATE: %d\nINT_TIME: %f\nN: %d\n",
                     PACKET_RATE, INT_TIME, N);
@@ -483,6 +730,49 @@ static void *run(hashpipe_thread_args_t * args)
 
                 block_counter = 0;
                 mcnt = 0;
+                scan_num++;
+
+                if (sched_idx >= 0 && scan_sched_get(sched_idx + 1, &entry) == 0)
+                {
+                    // The scan that just ended was due to finish here
+                    mjd_time_t scan_end_time = start_time;
+                    mjd_time_add_ns(&scan_end_time, (int64_t)requested_scan_length * NS_PER_SEC);
+
+                    sched_idx++;
+                    start_time = entry.start;
+                    start_time_dmjd = mjd_time_2_dmjd(&start_time);
+                    requested_scan_length = entry.length;
+                    num_blocks_to_write = scan_sched_num_blocks(entry.length);
+
+                    // A scan that starts within half a block of the end of
+                    //   this one is run back to back: we stay in "scanning"
+                    //   and keep the same pacing deadlines, so there is no
+                    //   gap at all between the two
+                    if (mjd_time_diff_ns(&start_time, &scan_end_time) < INT_TIME_NS / 2)
+                    {
+                        fprintf(stderr, "Continuing straight into scan %s\n", entry.name);
+                        scan_start_time = sleep_until;
+                    }
+                    else
+                    {
+                        fprintf(stderr, "Waiting for scan %s\n", entry.name);
+                        hashpipe_status_lock_safe(&st);
+                        status_key_puts(&st, &k_scanstat, "committed");
+                        hashpipe_status_unlock_safe(&st);
+                    }
+                }
+                else
+                {
+                    if (sched_idx >= 0)
+                    {
+                        fprintf(stderr, "Schedule complete\n");
+                        scan_sched_end(sched_idx);
+                        sched_idx = -1;
+                    }
+                    hashpipe_status_lock_safe(&st);
+                    status_key_puts(&st, &k_scanstat, "off");
+                    hashpipe_status_unlock_safe(&st);
+                }
             }
 
 
@@ -504,34 +794,6 @@ static void *run(hashpipe_thread_args_t * args)
     return THREAD_OK;
 }
 
-double timeval_2_mjd(timeval *tv)
-{
-    double dmjd = tv->tv_sec / 86400 + MJD_1970_EPOCH;
-
-    dmjd += (tv->tv_sec % 86400) / 86400.0;
-
-    return dmjd;
-}
-
-// Converts a DMJD to a time_t (seconds since epoch)
-time_t dmjd_2_secs(double dmjd)
-{
-    double d;
-    double mjd;
-
-    d = modf(dmjd, &mjd);
-
-    return (86400 * (mjd - MJD_1970_EPOCH)) + (86400 * d);
-}
-
-// Gets the current time as a DMJD
-double get_curr_time_dmjd()
-{
-   timeval time;
-   gettimeofday(&time, 0);
-   return timeval_2_mjd(&time);
-}
-
 static hashpipe_thread_desc_t fake_gpu_thread = {
     name: "fake_gpu_thread",
     skey: "FGPUSTAT",
@@ -142,6 +142,10 @@ cmd_t check_cmd(int fifo_fd)
 		{
 			return QUIT;
 		}
+		else if (strncasecmp(cmd,"SCHEDULE",MAX_CMD_LEN)==0)
+		{
+			return SCHEDULE;
+		}
         else
         {
             // Unknown command
@@ -27,7 +27,8 @@ typedef enum cmd {
 	INVALID = -1,
 	START,
 	STOP,
-	QUIT
+	QUIT,
+	SCHEDULE
 } cmd_t;
 
 int open_fifo(char *fifo_loc);
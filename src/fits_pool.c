@@ -0,0 +1,291 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hashpipe.h"
+#include "fits_pool.h"
+#include "scan_sched.h"
+
+typedef enum pool_state {
+    POOL_EMPTY,
+    POOL_PENDING,
+    POOL_BUSY,
+    POOL_READY
+} pool_state_t;
+
+typedef struct pool_slot {
+    pool_state_t state;
+    // Set if the file was superseded while the worker was creating it
+    int discard;
+    char filename[256];
+    int scan_duration;
+    int scan_num;
+    char scan_name[SCHED_NAME_LEN];
+    fits_data_format_t format;
+    fitsfile *fptr;
+    int status;
+} pool_slot_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pool_slot_t pool[FITS_POOL_SIZE];
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+// Cleared if the worker could not be started or CFITSIO is not thread-safe,
+//   in which case every file is created by fits_pool_take()
+static int pool_async = 0;
+
+static void *pool_worker(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&pool_lock);
+    while (1)
+    {
+        int i;
+        pool_slot_t *slot = NULL;
+        for (i = 0; i < FITS_POOL_SIZE; i++)
+        {
+            if (pool[i].state == POOL_PENDING)
+            {
+                slot = &pool[i];
+                break;
+            }
+        }
+
+        if (slot == NULL)
+        {
+            pthread_cond_wait(&pool_cond, &pool_lock);
+            continue;
+        }
+
+        slot->state = POOL_BUSY;
+        pthread_mutex_unlock(&pool_lock);
+
+        int status = 0;
+        fitsfile *fptr = create_fits_file(slot->filename, slot->scan_duration, slot->scan_num,
+                                          slot->scan_name[0] ? slot->scan_name : NULL,
+                                          slot->format, scan_sched_num_blocks(slot->scan_duration),
+                                          &status);
+
+        pthread_mutex_lock(&pool_lock);
+        if (slot->discard)
+        {
+            // A failed create may still have left an open (partial) file
+            int st = 0;
+            if (fptr != NULL)
+                fits_delete_file(fptr, &st);
+            slot->state = POOL_EMPTY;
+        }
+        else
+        {
+            if (status && fptr != NULL)
+            {
+                int st = 0;
+                fits_close_file(fptr, &st);
+            }
+            slot->fptr = status ? NULL : fptr;
+            slot->status = status;
+            slot->state = POOL_READY;
+        }
+        pthread_cond_broadcast(&pool_cond);
+    }
+
+    return NULL;
+}
+
+static void pool_start(void)
+{
+    pthread_t tid;
+
+    // The worker makes CFITSIO calls while the writer makes its own
+    if (!fits_is_reentrant())
+    {
+        hashpipe_warn(__FUNCTION__, "CFITSIO was not built with --enable-reentrant; "
+                      "FITS files will be created when their scans start");
+        return;
+    }
+
+    if (pthread_create(&tid, NULL, pool_worker, NULL) != 0)
+        hashpipe_error(__FUNCTION__, "could not start the FITS pool thread");
+    else
+    {
+        pthread_detach(tid);
+        pool_async = 1;
+    }
+}
+
+void fits_pool_prepare(const char *filename, int scan_duration, int scan_num,
+                       const char *scan_name, fits_data_format_t format)
+{
+    int i;
+    pool_slot_t *slot = NULL;
+
+    pthread_once(&pool_once, pool_start);
+    if (!pool_async)
+        return;
+
+    pthread_mutex_lock(&pool_lock);
+    for (i = 0; i < FITS_POOL_SIZE; i++)
+    {
+        if (pool[i].state != POOL_EMPTY && !pool[i].discard
+            && strcmp(pool[i].filename, filename) == 0)
+        {
+            pthread_mutex_unlock(&pool_lock);
+            return;
+        }
+        if (slot == NULL && pool[i].state == POOL_EMPTY)
+            slot = &pool[i];
+    }
+
+    if (slot == NULL)
+    {
+        pthread_mutex_unlock(&pool_lock);
+        hashpipe_warn(__FUNCTION__, "FITS pool is full; %s will be created on demand", filename);
+        return;
+    }
+
+    memset(slot, 0, sizeof (pool_slot_t));
+    snprintf(slot->filename, sizeof (slot->filename), "%s", filename);
+    slot->scan_duration = scan_duration;
+    slot->scan_num = scan_num;
+    slot->format = format;
+    if (scan_name != NULL)
+        snprintf(slot->scan_name, sizeof (slot->scan_name), "%s", scan_name);
+    slot->state = POOL_PENDING;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+fitsfile *fits_pool_take(const char *filename, int scan_duration, int scan_num,
+                         const char *scan_name, fits_data_format_t format, int *status)
+{
+    int i;
+    fitsfile *fptr = NULL;
+    int prepared_duration = -1;
+
+    pthread_mutex_lock(&pool_lock);
+    for (i = 0; i < FITS_POOL_SIZE; i++)
+    {
+        pool_slot_t *slot = &pool[i];
+        if (slot->state == POOL_EMPTY || slot->discard)
+            continue;
+
+        if (strcmp(slot->filename, filename) == 0)
+        {
+            while (slot->state == POOL_PENDING || slot->state == POOL_BUSY)
+                pthread_cond_wait(&pool_cond, &pool_lock);
+
+            if (slot->state == POOL_READY && slot->status == 0)
+            {
+                if (slot->format == format)
+                {
+                    fptr = slot->fptr;
+                    prepared_duration = slot->scan_duration;
+                }
+                else
+                {
+                    int st = 0;
+                    fits_delete_file(slot->fptr, &st);
+                }
+            }
+            slot->state = POOL_EMPTY;
+        }
+        else if (slot->scan_num == scan_num)
+        {
+            // Prepared for a scan that turned out differently (e.g. a
+            //   speculative file for a START scan when a schedule ran)
+            if (slot->state == POOL_READY)
+            {
+                int st = 0;
+                if (slot->fptr != NULL)
+                    fits_delete_file(slot->fptr, &st);
+                slot->state = POOL_EMPTY;
+            }
+            else
+            {
+                slot->discard = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (fptr == NULL)
+    {
+        fprintf(stderr, "FITS pool: %s was not prepared; creating it now\n", filename);
+        return create_fits_file(filename, scan_duration, scan_num, scan_name, format,
+                                scan_sched_num_blocks(scan_duration), status);
+    }
+
+    if (prepared_duration != scan_duration)
+    {
+        // Rows beyond the reservation are added by CFITSIO as they are
+        //   written and unused ones are trimmed at close, so only the
+        //   header needs fixing
+        fits_movabs_hdu(fptr, 1, NULL, status);
+        fits_update_key_lng(fptr, "SCANDUR", scan_duration, "Duration of scan (seconds)", status);
+        fits_movnam_hdu(fptr, BINARY_TBL, "DATA", 0, status);
+        if (*status)
+          fits_report_error(stderr, *status);
+    }
+
+    return fptr;
+}
+
+void fits_pool_shutdown(void)
+{
+    int i;
+    int busy;
+
+    pthread_mutex_lock(&pool_lock);
+    do
+    {
+        busy = 0;
+        for (i = 0; i < FITS_POOL_SIZE; i++)
+        {
+            pool_slot_t *slot = &pool[i];
+            if (slot->state == POOL_PENDING)
+            {
+                slot->state = POOL_EMPTY;
+            }
+            else if (slot->state == POOL_BUSY)
+            {
+                // The worker deletes it when it is done
+                slot->discard = 1;
+                busy = 1;
+            }
+            else if (slot->state == POOL_READY)
+            {
+                int st = 0;
+                if (slot->fptr != NULL)
+                    fits_delete_file(slot->fptr, &st);
+                slot->state = POOL_EMPTY;
+            }
+        }
+        if (busy)
+            pthread_cond_wait(&pool_cond, &pool_lock);
+    } while (busy);
+    pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,80 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef FITS_POOL_H
+#define FITS_POOL_H
+
+#include "fitsio.h"
+#include "gpu_output_databuf.h"
+
+// The number of files that can be prepared ahead of time
+#define FITS_POOL_SIZE 4
+
+// How the DATA column of a scan's file is stored
+typedef enum fits_data_format {
+    // GPU_BIN_SIZE * NUM_CHANNELS complex floats per row (TFORM C)
+    FITS_DATA_COMPLEX,
+    // A variable length byte array per row (TFORM 1PB) holding the row's
+    //   floats shuffled and deflated by shuffle_compress()
+    FITS_DATA_SHUFFLE_ZLIB,
+    // GPU_BIN_SIZE * NUM_CHANNELS * 2 IEEE half-precision bit patterns per
+    //   row, real and imaginary parts interleaved (TFORM I)
+    FITS_DATA_FLOAT16,
+    // As FITS_DATA_FLOAT16 but holding integers; multiplying by the row's
+    //   SCALE entry for the channel gives the original value
+    FITS_DATA_SCALED_INT16
+} fits_data_format_t;
+
+// Creating a FITS file (and especially allocating its data) at the start
+//   of a scan holds up the first blocks behind filesystem metadata work.
+//   The pool does that work on a background thread: fits_pool_prepare()
+//   queues a file, which is created with all of its headers written and
+//   its DATA table extended to the expected number of rows, and
+//   fits_pool_take() later hands the open file over. If the linked CFITSIO
+//   is not reentrant there is no background thread and every file is
+//   created synchronously by fits_pool_take().
+
+// Queues a file for preparation. Does nothing if the file is already
+//   queued or ready, or if the pool is full
+void fits_pool_prepare(const char *filename, int scan_duration, int scan_num,
+                       const char *scan_name, fits_data_format_t format);
+
+// Returns the open file for filename, waiting for it if it is still being
+//   prepared and creating it synchronously if it was never queued. Any
+//   other file prepared for the same scan_num, or one prepared in another
+//   format, is deleted. The SCANDUR key is updated if scan_duration
+//   differs from what was prepared
+fitsfile *fits_pool_take(const char *filename, int scan_duration, int scan_num,
+                         const char *scan_name, fits_data_format_t format, int *status);
+
+// Deletes every file that was prepared but never taken, waiting for any
+//   that is still being created. Called when the writer exits, so that
+//   speculative files for scans that never ran are not left behind
+void fits_pool_shutdown(void);
+
+// Creates a scan's FITS file with nrows rows reserved in the DATA table
+//   (implemented in fits_writer_thread.c)
+fitsfile *create_fits_file(const char *filename, int scan_duration, int scan_num,
+                           const char *scan_name, fits_data_format_t format, long nrows,
+                           int *st);
+
+#endif
@@ -0,0 +1,39 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+#ifndef FITS_WRITER_H
+#define FITS_WRITER_H
+
+#include "fitsio.h"
+#include "gpu_output_databuf.h"
+#include "fits_pool.h"
+
+// The parts of fits_writer_thread.c used by the other writers
+
+// Writes a block as row row_num (from 0) of a file's DATA table in the
+//   given format. Returns 0, or the CFITSIO status of the first write
+//   that failed
+int fits_write_row(fitsfile *fptr, gpu_output_databuf_block_t *block, int row_num,
+                   fits_data_format_t format);
+
+#endif
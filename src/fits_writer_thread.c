@@ -31,6 +31,7 @@
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <fcntl.h>
 // For printing uint64_t
 #include <inttypes.h>
 
@@ -38,12 +39,28 @@
 #include "fifo.h"
 #include "hashpipe.h"
 #include "gpu_output_databuf.h"
+#include "histogram.h"
+#include "scan_sched.h"
+#include "fits_pool.h"
+#include "fits_writer.h"
+#include "compress.h"
+#include "pack16.h"
+#include "baseline_select.h"
+#include "wait_policy.h"
+#include "status_cache.h"
+#include "io_policy.h"
+#include "metrics.h"
 
 #define SCAN_STATUS_LENGTH 10
+// How long to sleep between checks of chans_ready in chunked mode
+#define CHUNK_POLL_NS 10000
 
 // Forward declarations for the sake of prettiness
-int fits_write_row(fitsfile *fptr, gpu_output_databuf_block_t *block, int row_num);
-fitsfile *create_fits_file(char *filename, int scan_duration, int scan_num, int *st);
+int fits_write_row_header(fitsfile *fptr, gpu_output_databuf_block_t *block, int row_num);
+int fits_write_row_data(fitsfile *fptr, gpu_output_databuf_block_t *block, int row_num,
+                        fits_data_format_t format, long first_elem, long num_elems);
+int fits_write_row_chunked(fitsfile *fptr, gpu_output_databuf_block_t *block, int row_num,
+                           fits_data_format_t format);
 
 int fits_fifo_id;
 
@@ -60,18 +77,334 @@ static int init(struct hashpipe_thread_args *args)
     return 0;
 }
 
+// Waits for a block to be filled. Exits the thread on databuf errors
+static void wait_filled(gpu_output_databuf_t *db, int block_idx, hashpipe_status_t *st,
+                        const char *status_key, wait_policy_t *wp)
+{
+    int rv;
+
+    while ((rv=wait_policy_filled(wp, db, block_idx)) != HASHPIPE_OK)
+    {
+        if (rv==HASHPIPE_TIMEOUT) {
+            hashpipe_status_lock_safe(st);
+            hputs(st->buf, status_key, "blocked");
+            hashpipe_status_unlock_safe(st);
+            continue;
+        }
+        else
+        {
+            hashpipe_error(__FUNCTION__, "error waiting for free databuf");
+            pthread_exit(NULL);
+            break;
+        }
+    }
+    gpu_output_databuf_claim(db, block_idx);
+}
+
+// Waits for the producer to publish the first channel group of a block,
+//   after which its header is valid, and claims it. Returns -1 if the
+//   threads are stopping
+static int wait_block_started(gpu_output_databuf_t *db, int block_idx)
+{
+    gpu_output_databuf_block_t *block = &db->block[block_idx];
+    struct timespec poll_sleep = {0, CHUNK_POLL_NS};
+
+    while (__atomic_load_n(&block->header.chans_ready, __ATOMIC_ACQUIRE) == 0)
+    {
+        if (!run_threads())
+            return -1;
+        nanosleep(&poll_sleep, NULL);
+    }
+    gpu_output_databuf_claim(db, block_idx);
+
+    return 0;
+}
+
+// Builds the file name for a scheduled scan. Returns -1 if there is no
+//   such schedule entry
+static int sched_filename(int sched_idx, int scan_num, char *filename, size_t len,
+                          scan_entry_t *entry)
+{
+    if (scan_sched_get(sched_idx, entry) != 0)
+        return -1;
+
+    // TODO: Portable filenames
+    snprintf(filename, len, "/tmp/tchamber/sim1fits/scan%d_%s.fits", scan_num, entry->name);
+    return 0;
+}
+
+// Reads CHANGRP, OUTFMT, COMPRESS (zlib level, 0 for none) and CMPTHRDS
+//   and (re)starts the compression pool to match. Must only be called with
+//   no compressed rows in flight
+static void configure_output(hashpipe_status_t *st, int *chan_group, comp_pool_t **comp,
+                             fits_data_format_t *format)
+{
+    int level = 0;
+    int threads = 2;
+    char out_fmt[16] = "COMPLEX";
+
+    hashpipe_status_lock_safe(st);
+    *chan_group = 0;
+    hgeti4(st->buf, "CHANGRP", chan_group);
+    hgets(st->buf, "OUTFMT", sizeof (out_fmt), out_fmt);
+    hgeti4(st->buf, "COMPRESS", &level);
+    hgeti4(st->buf, "CMPTHRDS", &threads);
+    hashpipe_status_unlock_safe(st);
+
+    if (strcmp(out_fmt, "FLOAT16") == 0 || strcmp(out_fmt, "INT16") == 0)
+    {
+        if (level > 0)
+            hashpipe_warn(__FUNCTION__, "COMPRESS is ignored for OUTFMT %s", out_fmt);
+        level = 0;
+    }
+    else if (strcmp(out_fmt, "COMPLEX") != 0)
+    {
+        hashpipe_warn(__FUNCTION__, "unknown OUTFMT %s; writing COMPLEX", out_fmt);
+        strcpy(out_fmt, "COMPLEX");
+    }
+
+    if (level > 9)
+        level = 9;
+    if (threads < 1)
+        threads = 1;
+
+    if (*comp != NULL && (level <= 0 || (*comp)->level != level || (*comp)->nthreads != threads))
+    {
+        comp_pool_destroy(*comp);
+        *comp = NULL;
+    }
+    if (level > 0 && *comp == NULL)
+    {
+        // Each channel is shuffled separately
+        *comp = comp_pool_create(threads, level, NONZERO_BIN_SIZE * 2, TOTAL_DATA_SIZE);
+        if (*comp == NULL)
+            hashpipe_warn(__FUNCTION__, "could not start compression; writing uncompressed");
+    }
+
+    if (*comp != NULL)
+    {
+        // Whole blocks are handed to the compressors, so there is nothing
+        //   to gain from following the producer channel by channel
+        *chan_group = 0;
+        *format = FITS_DATA_SHUFFLE_ZLIB;
+        comp_pool_reset_stats(*comp);
+    }
+    else if (strcmp(out_fmt, "FLOAT16") == 0)
+    {
+        *format = FITS_DATA_FLOAT16;
+    }
+    else if (strcmp(out_fmt, "INT16") == 0)
+    {
+        *format = FITS_DATA_SCALED_INT16;
+    }
+    else
+    {
+        *format = FITS_DATA_COMPLEX;
+    }
+
+    if (*format == FITS_DATA_FLOAT16 || *format == FITS_DATA_SCALED_INT16)
+        fprintf(stderr, "Writing %s data (%s conversion)\n", out_fmt, pack16_isa());
+}
+
+// Selected baselines written next to each scan's FITS file, if BLSELECT
+//   is set
+typedef struct side_output {
+    char spec[256];
+    bl_select_t *sel;
+    FILE *f;
+    float *scratch;
+} side_output_t;
+
+// Opens the side file for fits_name, recompiling the selection if
+//   BLSELECT has changed since the last scan
+static void side_open(hashpipe_status_t *st, side_output_t *side, const char *fits_name)
+{
+    char spec[256] = "";
+    char side_name[256];
+    char *dot;
+
+    hashpipe_status_lock_safe(st);
+    hgets(st->buf, "BLSELECT", sizeof (spec), spec);
+    hashpipe_status_unlock_safe(st);
+
+    if (side->sel != NULL && strcmp(spec, side->spec) != 0)
+    {
+        bl_select_free(side->sel);
+        free(side->scratch);
+        side->sel = NULL;
+        side->scratch = NULL;
+    }
+    strcpy(side->spec, spec);
+    if (spec[0] == '\0')
+        return;
+
+    if (side->sel == NULL)
+    {
+        side->sel = bl_select_compile(spec);
+        if (side->sel == NULL)
+        {
+            hashpipe_warn(__FUNCTION__, "ignoring BLSELECT \"%s\"", spec);
+            return;
+        }
+        side->scratch = malloc((size_t)side->sel->nsel * NUM_CHANNELS * 2 * sizeof (float));
+    }
+
+    snprintf(side_name, sizeof (side_name), "%s", fits_name);
+    dot = strrchr(side_name, '.');
+    if (dot != NULL && strcmp(dot, ".fits") == 0)
+        *dot = '\0';
+    strncat(side_name, ".sel", sizeof (side_name) - strlen(side_name) - 1);
+    side->f = bl_side_open(side->sel, side_name);
+}
+
+static void side_write(side_output_t *side, const gpu_output_databuf_block_t *block)
+{
+    if (side->f == NULL)
+        return;
+    if (bl_side_write(side->f, side->sel, block, side->scratch) != 0)
+    {
+        hashpipe_warn(__FUNCTION__, "could not write selected baselines; closing side file");
+        fclose(side->f);
+        side->f = NULL;
+    }
+}
+
+// Marks a block as consumed. chans_ready must be cleared first so that a
+//   stale count is never mistaken for the next fill
+static void release_block(gpu_output_databuf_t *db, int block_idx, histogram_t *latency)
+{
+    struct timespec now;
+    gpu_output_databuf_block_t *block = &(db->block[block_idx]);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // Time from the producer finishing the block to it being handed to CFITSIO
+    histogram_add(latency, ELAPSED_NS(block->header.fill_stop, now));
+    metrics_observe(&sim1_metrics.latency, ELAPSED_NS(block->header.fill_stop, now));
+
+    __atomic_store_n(&block->header.chans_ready, 0, __ATOMIC_RELEASE);
+    clock_gettime(CLOCK_MONOTONIC, &block->header.freed);
+    gpu_output_databuf_set_free(db, block_idx);
+}
+
+// Accounts for a row of the given size that was handed to CFITSIO at start
+static void count_row(const struct timespec *start, uint64_t bytes)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    metrics_observe(&sim1_metrics.row_write, ELAPSED_NS((*start), now));
+    metrics_add(&sim1_metrics.rows_written, 1);
+    metrics_add(&sim1_metrics.bytes_written, bytes);
+}
+
+// Writes the oldest compressed row to its file and frees its ring block.
+//   Rows are retired strictly in the order they were submitted
+static void retire_compressed(comp_pool_t *comp, gpu_output_databuf_t *db, histogram_t *latency)
+{
+    int status = 0;
+    struct timespec start;
+    comp_job_t *job = comp_pool_wait_oldest(comp);
+    gpu_output_databuf_block_t *block = &(db->block[job->block_idx]);
+    fitsfile *fptr = (fitsfile *)job->user;
+
+    if (job->status != 0)
+        hashpipe_error(__FUNCTION__, "compression of row %d failed", job->row_num);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fits_write_row_header(fptr, block, job->row_num);
+    fits_write_col_byt(fptr, 2, job->row_num + 1, 1, job->dst_len, job->dst, &status);
+    if (status)
+      fits_report_error(stderr, status);
+    count_row(&start, job->dst_len);
+
+    release_block(db, job->block_idx, latency);
+    comp_pool_retire(comp);
+}
+
+// Closes a scan's file and reports its latency statistics
+static void close_scan_file(fitsfile **fptr, int rows_written, histogram_t *latency,
+                            hashpipe_status_t *st, side_output_t *side, wait_policy_t *wp,
+                            io_policy_t *io)
+{
+    int status = 0;
+    long num_rows = 0;
+
+    // Drop the rows that were reserved but never written
+    fits_get_num_rows(*fptr, &num_rows, &status);
+    if (status == 0 && num_rows > rows_written)
+        fits_delete_rows(*fptr, rows_written + 1, num_rows - rows_written, &status);
+    if (status)
+      fits_report_error(stderr, status);
+    status = 0;
+
+    fits_close_file(*fptr, &status);
+    if (status)          /* print any error messages */
+      fits_report_error(stderr, status);
+    *fptr = NULL;
+    io_policy_close(io, st, rows_written);
+
+    if (side->f != NULL)
+    {
+        fclose(side->f);
+        side->f = NULL;
+    }
+
+    histogram_print(stderr, "Producer to writer latency", latency);
+    hashpipe_status_lock_safe(st);
+    hputi4(st->buf, "WLATP50", histogram_percentile(latency, 50.0) / 1000);
+    hputi4(st->buf, "WLATP99", histogram_percentile(latency, 99.0) / 1000);
+    hputi4(st->buf, "WLATMAX", latency->max_ns / 1000);
+    hashpipe_status_unlock_safe(st);
+
+    wait_policy_report(wp, st, "Writer", "WWAKP50", "WWAKP99");
+}
+
+// What the writer must tidy up if it exits part way through a scan
+typedef struct writer_exit {
+    gpu_output_databuf_t *db;
+    hashpipe_status_t *st;
+    fitsfile **fptr;
+    int *row_num;
+    comp_pool_t **comp;
+    histogram_t *latency;
+    side_output_t *side;
+    wait_policy_t *wp;
+    io_policy_t *io;
+} writer_exit_t;
+
+// Closes (and trims) the open file and deletes the files prepared for
+//   scans that will not run. Also run if the thread is cancelled
+static void writer_exit(void *arg)
+{
+    writer_exit_t *w = (writer_exit_t *)arg;
+
+    if (*w->fptr != NULL)
+    {
+        fprintf(stderr, "Closing the FITS file of an unfinished scan after %d rows\n", *w->row_num);
+        while (*w->comp != NULL && comp_pool_inflight(*w->comp) > 0)
+            retire_compressed(*w->comp, w->db, w->latency);
+        close_scan_file(w->fptr, *w->row_num, w->latency, w->st, w->side, w->wp, w->io);
+    }
+    fits_pool_shutdown();
+}
+
 static void *run(hashpipe_thread_args_t * args)
 {
 	gpu_output_databuf_t *db = (gpu_output_databuf_t *)args->ibuf;
 	hashpipe_status_t st = args->st;
 	const char * status_key = args->thread_desc->skey;
 
-	int rv;
+    // The keys used on every pass through the loop
+    status_key_t k_status, k_scanstat, k_scanlen;
+    status_key_init(&k_status, status_key);
+    status_key_init(&k_scanstat, "SCANSTAT");
+    status_key_init(&k_scanlen, "SCANLEN");
+
 	int block_idx = 0;
 
     int cmd = INVALID;
 
-    struct timespec start, stop;
+    struct timespec start, stop, row_start;
     // Elapsed time in ns
     uint64_t scan_elapsed_time = 0;
     // Requested scan length in seconds
@@ -80,9 +413,6 @@ static void *run(hashpipe_thread_args_t * args)
 	int num_blocks_to_write = 0;
     int block_counter = 0;
 
-    // The current scanning status
-    char scan_status[SCAN_STATUS_LENGTH];
-
     // FITS file shit
     int status = 0;
     int row_num = 0;
@@ -90,6 +420,56 @@ static void *run(hashpipe_thread_args_t * args)
     fitsfile *fptr = NULL;
     char filename[256];
 
+    // Whether to write channel groups as the producer publishes them
+    int chan_group = 0;
+
+    // Compression workers, if COMPRESS is set
+    comp_pool_t *comp = NULL;
+    fits_data_format_t data_format = FITS_DATA_COMPLEX;
+    // Compressed rows keep their ring block until they are written, but
+    //   the producer must always have at least one block to fill
+    int comp_max_inflight = 1;
+
+    side_output_t side = {"", NULL, NULL, NULL};
+
+    // How we wait for the producer to fill blocks
+    wait_policy_t wait_pol;
+
+    // Writeback pacing of the open file
+    io_policy_t io;
+    io.fd = -1;
+
+    // The number of producer blocks in the current block, and the number
+    //   dropped just before it
+    int acc_len = 1;
+    int dropped = 0;
+
+    // The schedule entry the open file belongs to
+    int sched_cur = -1;
+    // The producer's scan_num for the blocks in the open file
+    int file_scan = -1;
+    // A START that arrived while the previous scan's file was still open
+    int start_pending = 0;
+    scan_entry_t entry;
+    gpu_output_databuf_block_t *block;
+
+    // Producer->writer latency of every block in the current scan
+    //   Percentiles are published in microseconds as WLATP50/WLATP99/WLATMAX
+    histogram_t latency;
+    histogram_reset(&latency);
+
+    // Have the first scan's file ready before anyone asks for it
+    configure_output(&st, &chan_group, &comp, &data_format);
+    wait_policy_configure(&wait_pol, &st);
+    hashpipe_status_lock_safe(&st);
+    status_key_geti4(&st, &k_scanlen, &requested_scan_length);
+    hashpipe_status_unlock_safe(&st);
+    if (requested_scan_length > 0)
+    {
+        sprintf(filename, "/tmp/tchamber/sim1fits/scan%d.fits", scan_num);
+        fits_pool_prepare(filename, requested_scan_length, scan_num, NULL, data_format);
+    }
+
     // hashpipe_status_lock_safe(&st);
     // // Force SCANINIT to 0 to make sure we wait for user input
     // hputi4(st.buf, "SCANINIT", 0);
@@ -99,6 +479,9 @@ static void *run(hashpipe_thread_args_t * args)
     // hputs(st.buf, "SCANSTAT", "off");
     // hashpipe_status_unlock_safe(&st);
 
+    writer_exit_t exit_state = {db, &st, &fptr, &row_num, &comp, &latency, &side, &wait_pol, &io};
+    pthread_cleanup_push(writer_exit, &exit_state);
+
 	while (run_threads())
 	{
 
@@ -112,33 +495,43 @@ static void *run(hashpipe_thread_args_t * args)
 
         // TODO: Is this the right status to be setting?
 		hashpipe_status_lock_safe(&st);
-        hputs(st.buf, status_key, "receiving");
+        status_key_puts(&st, &k_status, "receiving");
         hashpipe_status_unlock_safe(&st);
 
         cmd = check_cmd(fits_fifo_id);
         // sleep(1);
         // fprintf(stderr, "fits_writer_thread fd: %d, cmd: %d\n", fits_fifo_id, cmd);
-        if (cmd == START)
-        {
-            fprintf(stderr, "fits_writer_thread received START!\n");
 
-            hashpipe_status_lock_safe(&st);
-            hgets(st.buf, "SCANSTAT", SCAN_STATUS_LENGTH, scan_status);
-            hashpipe_status_unlock_safe(&st);
+        // The previous scan's blocks may still be in the ring (or it was
+        //   stopped and we have not seen its end yet), so a START is only
+        //   acted on once its file has been closed
+        if (cmd == START && fptr != NULL)
+        {
+            fprintf(stderr, "fits_writer_thread received START; it takes effect when the current file is closed\n");
+            start_pending = 1;
+            cmd = INVALID;
+        }
+        else if (cmd != QUIT && start_pending && fptr == NULL)
+        {
+            cmd = START;
+        }
 
-            if (strcmp(scan_status, "scanning") == 0 || strcmp(scan_status, "committed") == 0)
-            {
-                if (strcmp(scan_status, "scanning") == 0)
-                    fprintf(stderr, "We are already in a scan\n");
-                if (strcmp(scan_status, "committed") == 0)
-                    fprintf(stderr, "We are already committed to a scan\n");
-                continue;
-            }
+        if (cmd == QUIT)
+        {
+            fprintf(stderr, "fits_writer_thread received QUIT\n");
+            break;
+        }
+        else if (cmd == START)
+        {
+            fprintf(stderr, "fits_writer_thread received START!\n");
+            start_pending = 0;
 
             hashpipe_status_lock_safe(&st);
             // ...find out how long we should scan
-            hgeti4(st.buf, "SCANLEN", &requested_scan_length);
+            status_key_geti4(&st, &k_scanlen, &requested_scan_length);
             hashpipe_status_unlock_safe(&st);
+            configure_output(&st, &chan_group, &comp, &data_format);
+            wait_policy_configure(&wait_pol, &st);
 
             // TODO: calculate number of blocks to write based on SCANLEN
             num_blocks_to_write = (PACKET_RATE * requested_scan_length) / N;
@@ -149,7 +542,9 @@ static void *run(hashpipe_thread_args_t * args)
                 // ...if not, error...
                 hashpipe_error(__FUNCTION__, "SCANLEN has either not been set or has been set to an invalid value");
                 // ...stop the scan...
-                hputs(st.buf, "SCANSTAT", "off");
+                hashpipe_status_lock_safe(&st);
+                status_key_puts(&st, &k_scanstat, "off");
+                hashpipe_status_unlock_safe(&st);
                 // ...and skip the rest of the block
                 // TODO: should this be happening?
                 continue;
@@ -158,82 +553,217 @@ static void *run(hashpipe_thread_args_t * args)
             // Create/open FITS file
             // TODO: Portable filenames
             sprintf(filename, "/tmp/tchamber/sim1fits/scan%d.fits", scan_num);
-            fptr = create_fits_file(filename, requested_scan_length, scan_num, &status);
+            fptr = fits_pool_take(filename, requested_scan_length, scan_num, NULL, data_format, &status);
             if (status)
             {
                 hashpipe_error(__FUNCTION__, "Error creating fits file");
                 pthread_exit(NULL);
             }
+            side_open(&st, &side, filename);
+            io_policy_open(&io, &st, fptr, filename);
             // Row number will return to 0 on each new scan
             row_num = 0;
+            block_counter = 0;
             scan_num++;
+            histogram_reset(&latency);
+
+            // Assume the next scan will look like this one and get its
+            //   file ready while this one is written
+            sprintf(filename, "/tmp/tchamber/sim1fits/scan%d.fits", scan_num);
+            fits_pool_prepare(filename, requested_scan_length, scan_num, NULL, data_format);
 
             // Get the current time
-            clock_gettime(CLOCK_MONOTONIC, &start);
+            sim_clock_now(&start);
             // fprintf(stderr, "Starting scan at time: %ld\n", start.tv_sec);
             fprintf(stderr, "FITS writer is ready to write\n");
         }
 
-        if (strcmp(scan_status, "scanning") == 0)
+        // Blocks are only consumed while we have a file to put them in,
+        //   or a schedule that tells us which file to open.
+        //   SCANSTAT is not consulted here: the producer sets it to "off"
+        //   as soon as it has filled its last block, which may still be
+        //   sitting in the ring
+        if (fptr != NULL || scan_sched_count() > 0)
         {
-            // Wait for the current block to be filled
-            while ((rv=gpu_output_databuf_wait_filled(db, block_idx)) != HASHPIPE_OK)
+            block = &(db->block[block_idx]);
+
+            // Wait until the header is valid
+            if (chan_group > 0)
             {
-                if (rv==HASHPIPE_TIMEOUT) {
-                    hashpipe_status_lock_safe(&st);
-                    hputs(st.buf, status_key, "blocked");
-                    hashpipe_status_unlock_safe(&st);
+                if (wait_block_started(db, block_idx) != 0)
+                    continue;
+            }
+            else
+            {
+                wait_filled(db, block_idx, &st, status_key, &wait_pol);
+            }
+
+            acc_len = block->header.acc_len > 0 ? block->header.acc_len : 1;
+            // Blocks the producer dropped (OVERRUN) still count towards the scan
+            dropped = block->header.dropped;
+
+            // A scan that was stopped part way never fills its file, so it
+            //   ends at the first block of the next scan
+            if (fptr != NULL && block_counter > 0 &&
+                (block->header.scan_block == 0 || block->header.scan_num != file_scan))
+            {
+                fprintf(stderr, "Scan stopped after %d of %d blocks\n",
+                        block_counter, num_blocks_to_write);
+                while (comp != NULL && comp_pool_inflight(comp) > 0)
+                    retire_compressed(comp, db, &latency);
+                close_scan_file(&fptr, row_num, &latency, &st, &side, &wait_pol, &io);
+                // The producer ended the schedule at this entry when it
+                //   was stopped
+                if (sched_cur >= 0)
+                    scan_sched_retire(sched_cur);
+                sched_cur = -1;
+
+                // An unscheduled scan's file is opened by its START; the
+                //   block stays claimed until then
+                if (block->header.sched_idx < 0)
                     continue;
+            }
+
+            // Roll over to the next scheduled scan at the first block that
+            //   belongs to it
+            if (block->header.sched_idx >= 0 && block->header.sched_idx != sched_cur)
+            {
+                if (fptr != NULL)
+                {
+                    fprintf(stderr, "Scan cut short after %d of %d blocks\n",
+                            block_counter, num_blocks_to_write);
+                    while (comp != NULL && comp_pool_inflight(comp) > 0)
+                        retire_compressed(comp, db, &latency);
+                    close_scan_file(&fptr, row_num, &latency, &st, &side, &wait_pol, &io);
                 }
-                else
+                if (sched_cur >= 0)
+                    scan_sched_retire(sched_cur);
+
+                sched_cur = block->header.sched_idx;
+                if (sched_filename(sched_cur, scan_num, filename, sizeof (filename), &entry) != 0)
+                {
+                    hashpipe_error(__FUNCTION__, "block refers to unknown schedule entry %d", sched_cur);
+                    pthread_exit(NULL);
+                }
+                configure_output(&st, &chan_group, &comp, &data_format);
+                wait_policy_configure(&wait_pol, &st);
+                // Normally prepared during the previous scan, so this is
+                //   just a pointer swap
+                fptr = fits_pool_take(filename, entry.length, scan_num, entry.name, data_format, &status);
+                if (status || fptr == NULL)
                 {
-                    hashpipe_error(__FUNCTION__, "error waiting for free databuf");
+                    hashpipe_error(__FUNCTION__, "Error creating fits file");
                     pthread_exit(NULL);
-                    break;
                 }
+                side_open(&st, &side, filename);
+                io_policy_open(&io, &st, fptr, filename);
+
+                num_blocks_to_write = scan_sched_num_blocks(entry.length);
+                row_num = 0;
+                block_counter = 0;
+                scan_num++;
+                histogram_reset(&latency);
+                sim_clock_now(&start);
+
+                // Prepare the following scan's file while this one is written
+                if (sched_filename(sched_cur + 1, scan_num, filename, sizeof (filename), &entry) == 0)
+                    fits_pool_prepare(filename, entry.length, scan_num, entry.name, data_format);
             }
 
-            fprintf(stderr, "Writing a row to FITS. Elapsed time: %ld\n", scan_elapsed_time);
+            if (block_counter == 0)
+                file_scan = block->header.scan_num;
 
+            if (fptr == NULL)
+            {
+                hashpipe_warn(__FUNCTION__, "dropping block with mcnt %d: no file open",
+                              block->header.mcnt);
+                if (chan_group > 0)
+                    wait_filled(db, block_idx, &st, status_key, &wait_pol);
+            }
             // write FITS data!
-//             fprintf(stderr, "writing row of data\n");
+            else if (chan_group > 0)
+            {
+                // In chunked mode, write each channel group as soon as the
+                //   producer publishes it; the wait below then returns at once
+                fits_write_row_chunked(fptr, block, row_num, data_format);
+                wait_filled(db, block_idx, &st, status_key, &wait_pol);
+                side_write(&side, block);
+                // Only the padding after the last channel is left. The
+                //   chunks overlap the fill, so only this last write is timed
+                clock_gettime(CLOCK_MONOTONIC, &row_start);
+                fits_write_row_data(fptr, block, row_num, data_format,
+                                    NUM_CHANNELS * NONZERO_BIN_SIZE,
+                                    (GPU_BIN_SIZE - NONZERO_BIN_SIZE) * NUM_CHANNELS);
+                count_row(&row_start, block->header.valid_bytes);
+                row_num++;
+            }
+            else if (comp != NULL)
+            {
+                side_write(&side, block);
+                // The block stays in the ring until its row is written
+                comp_pool_submit(comp, block->data, TOTAL_DATA_SIZE, block_idx, row_num++, fptr);
+                comp_max_inflight = comp->nthreads + 1 < NUM_BLOCKS - 1 ? comp->nthreads + 1 : NUM_BLOCKS - 1;
+                if (comp_max_inflight < 1)
+                    comp_max_inflight = 1;
+                while (comp_pool_inflight(comp) >= comp_max_inflight)
+                    retire_compressed(comp, db, &latency);
+            }
+            else
+            {
+                clock_gettime(CLOCK_MONOTONIC, &row_start);
+                fits_write_row(fptr, block, row_num++, data_format);
+                count_row(&row_start, block->header.valid_bytes);
+                side_write(&side, block);
+            }
 
-            // mcnt = db->block[block_idx].header.mcnt;
-            fits_write_row(fptr, &(db->block[block_idx]), row_num++);
+            if (fptr != NULL)
+                io_policy_rows(&io, fptr, row_num);
 
-            clock_gettime(CLOCK_MONOTONIC, &stop);
+            sim_clock_now(&stop);
             scan_elapsed_time = ELAPSED_NS(start, stop);
 
-            // If we have scanned for the designated amount of time...
-            // This is converting ns to sec since the scan duration is specified in seconds
-            // TODO: surely there is a better place to do this
-            if (block_counter >= num_blocks_to_write)
+            // Compressed blocks are freed when they are retired
+            if (comp == NULL || fptr == NULL)
+                release_block(db, block_idx, &latency);
+
+            // Setup for next block. Blocks from accumulator_thread stand
+            //   for several of the producer's
+            block_idx = (block_idx + 1) % NUM_BLOCKS;
+            block_counter += acc_len + dropped;
+
+            // If we have written every block of the scan...
+            if (fptr != NULL && block_counter >= num_blocks_to_write)
             {
                 // ...write to disk
-                fprintf(stderr, "Closing FITS file\n");
-                // write last data row, close FITS file
-                fits_close_file(fptr, &status);
-                if (status)          /* print any error messages */
-                  fits_report_error(stderr, status);
+                fprintf(stderr, "Closing FITS file after %f seconds\n", scan_elapsed_time / 1000000000.0);
+                if (comp != NULL)
+                {
+                    while (comp_pool_inflight(comp) > 0)
+                        retire_compressed(comp, db, &latency);
 
+                    fprintf(stderr, "Compression: ratio %.2f, %.1f MB/s per thread (%d threads, level %d)\n",
+                            comp_pool_ratio(comp), comp_pool_mbps(comp), comp->nthreads, comp->level);
+                    hashpipe_status_lock_safe(&st);
+                    hputr4(st.buf, "CMPRATIO", comp_pool_ratio(comp));
+                    hputr4(st.buf, "CMPMBPS", comp_pool_mbps(comp));
+                    hashpipe_status_unlock_safe(&st);
+                }
+                close_scan_file(&fptr, row_num, &latency, &st, &side, &wait_pol, &io);
+                // The producer may have ended the schedule long ago; it is
+                //   only cleared once its last scan is written
+                if (sched_cur >= 0)
+                    scan_sched_retire(sched_cur);
+                sched_cur = -1;
                 scan_elapsed_time = 0;
-                // hputs(st.buf, "SCANSTAT", "off");
             }
-
-            block_counter++;
         }
 
-		// Mark block as free
-        gpu_output_databuf_set_free(db, block_idx);
-
-        // Setup for next block
-		block_idx = (block_idx + 1) % NUM_BLOCKS;
-// 		fprintf(stderr, "catcher's block_idx is now: %d\n", block_idx);
-
 //      Will exit if thread has been cancelled
         pthread_testcancel();
 	}
 
+    pthread_cleanup_pop(1);
+
 	return THREAD_OK;
 }
 
@@ -251,7 +781,9 @@ static __attribute__((constructor)) void ctor()
   register_hashpipe_thread(&fits_writer_thread);
 }
 
-fitsfile *create_fits_file(char *filename, int scan_duration, int scan_num, int *st) {
+fitsfile *create_fits_file(const char *filename, int scan_duration, int scan_num,
+                           const char *scan_name, fits_data_format_t format, long nrows,
+                           int *st) {
     fprintf(stderr, "create_fits_file\n");
     fitsfile *fptr;
     int status = 0;
@@ -266,10 +798,6 @@ fitsfile *create_fits_file(char *filename, int scan_duration, int scan_num, int
       return(fptr);
     }
 
-    fits_open_file(&fptr, filename, READWRITE, &status);
-    if (status)          /* print any error messages */
-      fits_report_error(stderr, status);
-
     // Initialize primary header
     fits_create_img(fptr, 8, 0, 0, &status);
     if (status)          /* print any error messages */
@@ -298,27 +826,43 @@ fitsfile *create_fits_file(char *filename, int scan_duration, int scan_num, int
     if (status)          /* print any error messages */
       fits_report_error(stderr, status);
 
+    if (scan_name != NULL)
+    {
+        fits_update_key_str(fptr, "SCANNAME", scan_name, "scheduled scan name", &status);
+        if (status)          /* print any error messages */
+          fits_report_error(stderr, status);
+    }
+
 
     // Use this to allow variable bin sizes
     // TODO: Should this only be 3 chars long?
     char data_form[10];
-    sprintf(data_form, "%dC", GPU_BIN_SIZE * NUM_CHANNELS);
+    if (format == FITS_DATA_SHUFFLE_ZLIB)
+        sprintf(data_form, "1PB");
+    else if (format == FITS_DATA_FLOAT16 || format == FITS_DATA_SCALED_INT16)
+        sprintf(data_form, "%dI", GPU_BIN_SIZE * NUM_CHANNELS * 2);
+    else
+        sprintf(data_form, "%dC", GPU_BIN_SIZE * NUM_CHANNELS);
     //debug
     fprintf(stderr, "data_form: %s\n", data_form);
+    char scale_form[10];
+    sprintf(scale_form, "%dE", NUM_CHANNELS);
 
     // write data table
     char ext_name[] = "DATA";
-    int number_columns = 2;
+    // The SCALE column is only present for FITS_DATA_SCALED_INT16
+    int number_columns = format == FITS_DATA_SCALED_INT16 ? 4 : 3;
     char *ttype_state[] =
-        {"MCNT", "DATA"};
+        {"MCNT", "DATA", "DMJD", "SCALE"};
     char *tform_state[] =
-        {"1J", data_form};
+        {"1J", data_form, "1D", scale_form};
     char *tunit_state[] =
-        {" ", " "};
+        {" ", " ", "d", " "};
 
+    // NAXIS2 is set to the expected number of rows up front
     fits_create_tbl(fptr,
                     BINARY_TBL,
-                    0,
+                    nrows,
                     number_columns,
                     ttype_state,
                     tform_state,
@@ -328,31 +872,177 @@ fitsfile *create_fits_file(char *filename, int scan_duration, int scan_num, int
     if (status)          /* print any error messages */
       fits_report_error(stderr, status);
 
+    if (format == FITS_DATA_SHUFFLE_ZLIB)
+    {
+        // Enough for a reader to undo shuffle_compress()
+        fits_update_key_str(fptr, "ZDATAFMT", "SHUFFLE4_ZLIB",
+                            "DATA: big-endian float bytes shuffled, then deflated", &status);
+        fits_update_key_lng(fptr, "ZNFLOAT", TOTAL_DATA_SIZE, "floats per uncompressed row", &status);
+        fits_update_key_lng(fptr, "ZSEGLEN", NONZERO_BIN_SIZE * 2, "floats per shuffled segment", &status);
+        if (status)          /* print any error messages */
+          fits_report_error(stderr, status);
+    }
+
+    if (format == FITS_DATA_FLOAT16)
+    {
+        fits_update_key_str(fptr, "ZDATAFMT", "FLOAT16",
+                            "DATA: IEEE half-precision bit patterns", &status);
+        if (status)          /* print any error messages */
+          fits_report_error(stderr, status);
+    }
+    else if (format == FITS_DATA_SCALED_INT16)
+    {
+        fits_update_key_str(fptr, "ZDATAFMT", "SCALED_INT16",
+                            "DATA * SCALE[channel] is the value", &status);
+        fits_update_key_lng(fptr, "ZSEGLEN", NONZERO_BIN_SIZE * 2, "DATA values per channel", &status);
+        if (status)          /* print any error messages */
+          fits_report_error(stderr, status);
+    }
+
+    // Get the headers onto disk, then allocate the whole data unit so that
+    //   row writes never have to allocate blocks (or leave holes)
+    fits_flush_file(fptr, &status);
+    if (status == 0 && nrows > 0)
+    {
+        LONGLONG head_start, data_start, data_end;
+        fits_get_hduaddrll(fptr, &head_start, &data_start, &data_end, &status);
+
+        int fd = open(filename, O_WRONLY);
+        if (status == 0 && fd >= 0)
+        {
+            // Round up to the 2880 byte FITS block
+            off_t size = ((data_end + 2879) / 2880) * 2880;
+            int rv = posix_fallocate(fd, 0, size);
+            if (rv != 0)
+                fprintf(stderr, "create_fits_file: posix_fallocate(%s): %s\n", filename, strerror(rv));
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+    if (status)          /* print any error messages */
+      fits_report_error(stderr, status);
+
     fprintf(stderr, "Created FITS file\n");
     *st = status;
     return(fptr);
 }
 
 // int mcnt, float *data
-int fits_write_row(fitsfile *fptr, gpu_output_databuf_block_t *block, int row_num) {
+int fits_write_row(fitsfile *fptr, gpu_output_databuf_block_t *block, int row_num,
+                   fits_data_format_t format) {
+    int status = fits_write_row_header(fptr, block, row_num);
+    int data_status = fits_write_row_data(fptr, block, row_num, format, 0, GPU_BIN_SIZE * NUM_CHANNELS);
+
+    // The first error is the one worth reporting
+    return(status ? status : data_status);
+}
+
+// Writes the per-row scalar columns (MCNT, DMJD)
+int fits_write_row_header(fitsfile *fptr, gpu_output_databuf_block_t *block, int row_num) {
     int status = 0;
-	int *mcnt = &(block->header.mcnt);
-	float *data = block->data;
-    long data_elements = GPU_BIN_SIZE * NUM_CHANNELS;
-	fprintf(stderr, "num data els: %ld\n", data_elements);
+    int *mcnt = &(block->header.mcnt);
 
-	fits_write_col_int(fptr, 1,row_num + 1, 1, 1, mcnt, &status);
+    fits_write_col_int(fptr, 1, row_num + 1, 1, 1, mcnt, &status);
 
-	if (status)
+    if (status)
       fits_report_error(stderr, status);
 
-    fits_write_col_cmp(fptr, 2, row_num + 1, 1, data_elements, data, &status);
+    fits_write_col_dbl(fptr, 3, row_num + 1, 1, 1, &(block->header.dmjd), &status);
 
     if (status)
       fits_report_error(stderr, status);
 
-    fprintf(stderr, "what\n");
+    return(status);
+}
+
+// Converts the given values of a row to 16 bits on the way out of the ring
+//   and writes them. Ranges are expected to start on a channel boundary;
+//   the scale of each channel touched is computed over the whole channel
+static int fits_write_row_data16(fitsfile *fptr, gpu_output_databuf_block_t *block, int row_num,
+                                 fits_data_format_t format, long first, long num) {
+    static int16_t packed[TOTAL_DATA_SIZE];
+    int status = 0;
+    long end = first + num;
+    long valid_end = CHAN_DATA_OFFSET(NUM_CHANNELS);
+    long i, stop;
+    int chan;
+    float scale;
+
+    for (i = first; i < end && i < valid_end; i = stop)
+    {
+        chan = i / CHAN_DATA_OFFSET(1);
+        stop = CHAN_DATA_OFFSET(chan + 1) < end ? CHAN_DATA_OFFSET(chan + 1) : end;
+
+        if (format == FITS_DATA_FLOAT16)
+        {
+            pack_float16(block->data + i, (uint16_t *)(packed + i), stop - i);
+        }
+        else
+        {
+            scale = pack_int16_scale(block->data + CHAN_DATA_OFFSET(chan), CHAN_DATA_OFFSET(1));
+            pack_int16(block->data + i, packed + i, stop - i, scale);
+            fits_write_col_flt(fptr, 4, row_num + 1, chan + 1, 1, &scale, &status);
+        }
+    }
+    // The padding is zero in both formats
+    if (end > valid_end)
+    {
+        i = first > valid_end ? first : valid_end;
+        memset(packed + i, 0, (end - i) * sizeof (packed[0]));
+    }
+
+    // Half-precision values are written as their bit patterns
+    fits_write_col_sht(fptr, 2, row_num + 1, first + 1, num, packed + first, &status);
+
+    return(status);
+}
+
+// Writes num_elems complex elements of the DATA column, starting at
+//   (zero-based) complex element first_elem
+int fits_write_row_data(fitsfile *fptr, gpu_output_databuf_block_t *block, int row_num,
+                        fits_data_format_t format, long first_elem, long num_elems) {
+    int status = 0;
+
+    if (format == FITS_DATA_FLOAT16 || format == FITS_DATA_SCALED_INT16)
+        status = fits_write_row_data16(fptr, block, row_num, format,
+                                       first_elem * 2, num_elems * 2);
+    else
+        fits_write_col_cmp(fptr, 2, row_num + 1, first_elem + 1, num_elems,
+                           block->data + first_elem * 2, &status);
+
+    if (status)
+      fits_report_error(stderr, status);
 
     return(status);
+}
+
+// Writes the header columns and every channel of a block that is still
+//   being filled, following the producer's chans_ready counter
+int fits_write_row_chunked(fitsfile *fptr, gpu_output_databuf_block_t *block, int row_num,
+                           fits_data_format_t format) {
+    int status = 0;
+    uint32_t written = 0;
+    uint32_t ready;
+    struct timespec poll_sleep = {0, CHUNK_POLL_NS};
+
+    while (written < NUM_CHANNELS && run_threads())
+    {
+        ready = __atomic_load_n(&block->header.chans_ready, __ATOMIC_ACQUIRE);
+        if (ready <= written)
+        {
+            nanosleep(&poll_sleep, NULL);
+            continue;
+        }
 
-}
\ No newline at end of file
+        // The header fields are set before the first group is published
+        if (written == 0)
+            status |= fits_write_row_header(fptr, block, row_num);
+
+        status |= fits_write_row_data(fptr, block, row_num, format,
+                                      written * NONZERO_BIN_SIZE,
+                                      (ready - written) * NONZERO_BIN_SIZE);
+        written = ready;
+    }
+
+    return(status);
+}
@@ -32,10 +32,109 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/sem.h>
+#include <stddef.h>
+#include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/mman.h>
 
+#include "hashpipe.h"
 #include "gpu_output_databuf.h"
+#include "block_kernels.h"
+
+static void set_layout(gpu_output_databuf_layout_t *l)
+{
+    l->magic = GPU_OUTPUT_DATABUF_MAGIC;
+    l->version = GPU_OUTPUT_DATABUF_VERSION;
+    l->nblocks = NUM_BLOCKS;
+    l->nchan = NUM_CHANNELS;
+    l->nant = NUM_ANTENNAS;
+    l->gpu_bin = GPU_BIN_SIZE;
+    l->nonzero_bin = NONZERO_BIN_SIZE;
+    l->block_header_size = sizeof (gpu_output_databuf_block_header_t);
+    l->block_size = sizeof (gpu_output_databuf_block_t);
+}
+
+static int layout_matches(const gpu_output_databuf_layout_t *l)
+{
+    gpu_output_databuf_layout_t ours;
+
+    memset(&ours, 0, sizeof (ours));
+    set_layout(&ours);
+    return memcmp(l, &ours, sizeof (ours)) == 0;
+}
+
+// Looks for a ring left by an earlier run. Returns 1 if there is one that
+//   nothing is attached to and whose layout is ours, so that it can be
+//   reused, and 0 otherwise. An unattached ring of another layout is
+//   removed, along with its semaphores, so that hashpipe can create a new
+//   one instead of failing on the size
+static int find_warm_ring(int instance_id, int databuf_id, size_t databuf_size)
+{
+    key_t key = hashpipe_databuf_key(instance_id) + databuf_id - 1;
+    struct shmid_ds ds;
+    int shmid, semid, ok = 0;
+    void *p;
+
+    shmid = shmget(key, 0, 0666);
+    if (shmid == -1)
+        return 0;
+    // Something still has it (such as the other end of the ring in this
+    //   process); leave it to hashpipe
+    if (shmctl(shmid, IPC_STAT, &ds) == -1 || ds.shm_nattch > 0)
+        return 0;
+
+    p = shmat(shmid, NULL, SHM_RDONLY);
+    if (p != (void *)-1)
+    {
+        const gpu_output_databuf_t *d = (const gpu_output_databuf_t *)p;
+        ok = ds.shm_segsz == databuf_size
+            && d->header.header_size == offsetof(gpu_output_databuf_t, block)
+            && d->header.block_size == sizeof (gpu_output_databuf_block_t)
+            && d->header.n_block == NUM_BLOCKS
+            && layout_matches(&d->layout);
+        shmdt(p);
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "gpu_output_databuf: replacing databuf %d left with another layout\n", databuf_id);
+        shmctl(shmid, IPC_RMID, NULL);
+        semid = semget(key, 0, 0666);
+        if (semid != -1)
+            semctl(semid, 0, IPC_RMID);
+    }
+    return ok;
+}
+
+// Returns every block of a reused ring to the state of a new one. Nothing
+//   is attached yet, so the headers can simply be cleared; the blocks are
+//   then all marked free in one semctl(SETALL)
+static void reset_blocks(gpu_output_databuf_t *d)
+{
+    int i;
+
+    for (i = 0; i < NUM_BLOCKS; i++)
+        memset(&d->block[i].header, 0, sizeof (d->block[i].header));
+    hashpipe_databuf_clear((hashpipe_databuf_t *)d);
+}
+
+// Locks the ring into memory, which also faults in every page, so that the
+//   first block of the first scan costs the same as any other. Without the
+//   lock (see ulimit -l) the pages are at least faulted in
+static void lock_ring(gpu_output_databuf_t *d, size_t size)
+{
+    volatile const char *p = (volatile const char *)d;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t off;
+
+    if (mlock(d, size) == 0)
+        return;
+    hashpipe_warn(__FUNCTION__, "cannot lock the ring in memory (%s); faulting it in instead",
+                  strerror(errno));
+    for (off = 0; off < size; off += page)
+        (void)p[off];
+}
 
 hashpipe_databuf_t *gpu_output_databuf_create(int instance_id, int databuf_id)
 {
@@ -43,11 +142,41 @@ hashpipe_databuf_t *gpu_output_databuf_create(int instance_id, int databuf_id)
 // 			instance_id, databuf_id);
 	
     /* Calc databuf sizes */
-    size_t header_size = sizeof (hashpipe_databuf_t);
+    size_t header_size = offsetof(gpu_output_databuf_t, block);
     size_t block_size  = sizeof (gpu_output_databuf_block_t);
     fprintf(stderr, "buffer size is: %lu\n", NUM_BLOCKS * sizeof (gpu_output_databuf_block_t));
     int    n_block = NUM_BLOCKS;
+    gpu_output_databuf_t *d;
+    int warm;
+
+    // Pick the block loops for this layout
+    const block_kernels_t *k = block_kernels_select(NUM_CHANNELS, NUM_ANTENNAS);
+    fprintf(stderr, "block kernels: %s\n", k->name);
 
-    return hashpipe_databuf_create(
+    warm = find_warm_ring(instance_id, databuf_id, sizeof (gpu_output_databuf_t));
+
+    d = (gpu_output_databuf_t *)hashpipe_databuf_create(
         instance_id, databuf_id, header_size, block_size, n_block);
+    if (d == NULL)
+        return NULL;
+
+    if (d->layout.magic == 0)
+    {
+        // A new ring, zeroed by hashpipe
+        set_layout(&d->layout);
+    }
+    else if (!layout_matches(&d->layout))
+    {
+        hashpipe_error(__FUNCTION__, "databuf %d is in use with another layout", databuf_id);
+        hashpipe_databuf_detach((hashpipe_databuf_t *)d);
+        return NULL;
+    }
+    else if (warm)
+    {
+        reset_blocks(d);
+        fprintf(stderr, "gpu_output_databuf: reusing databuf %d from an earlier run\n", databuf_id);
+    }
+
+    lock_ring(d, sizeof (gpu_output_databuf_t));
+    return (hashpipe_databuf_t *)d;
 }
@@ -24,6 +24,9 @@
 #define _gpu_output_databuf_h
 
 #include <stdint.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/time.h>
 #include "hashpipe_databuf.h"
 // #include "config.h"
 // #define CACHE_ALIGNMENT 128
@@ -56,6 +59,11 @@
 #define INT_TIME_NS (INT_TIME * 1000000000)
 
 #define TOTAL_DATA_SIZE (GPU_BIN_SIZE * NUM_CHANNELS * 2) //907711.000000 //862736.000000
+// The number of bytes per block that actually carry covariance data
+#define VALID_DATA_BYTES (NONZERO_BIN_SIZE * NUM_CHANNELS * 2 * sizeof (float))
+// Channels are packed back to back with NONZERO_BIN_SIZE complex pairs each;
+//   this is the float offset of the start of a channel within a block
+#define CHAN_DATA_OFFSET(chan) ((chan) * NONZERO_BIN_SIZE * 2)
 
 #define ELAPSED_NS(start,stop) \
   (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
@@ -63,9 +71,43 @@
 
 // TODO: Cache alignment???
 
+typedef struct timeval timeval;
+typedef struct timespec timespec;
+
 typedef struct gpu_output_databuf_block_header {
 	int mcnt;
-	// time
+	// The scan that this block belongs to
+	int scan_num;
+	// The scan_sched entry of that scan, or -1 if it was started with START
+	int sched_idx;
+	// The position of the block within its scan and the number of
+	//   producer blocks in the scan
+	int scan_block;
+	int scan_nblocks;
+	// The number of producer integrations summed into the block: 1 from
+	//   fake_gpu_thread, up to ACCLEN from accumulator_thread
+	int acc_len;
+	// The number of bytes of data that are valid
+	uint64_t valid_bytes;
+	// Wall-clock time at the start of the integration
+	double dmjd;
+	// CLOCK_MONOTONIC times at which the producer started and finished filling the block
+	timespec fill_start;
+	timespec fill_stop;
+	// CLOCK_MONOTONIC time at which the consumer last freed the block
+	timespec freed;
+	// The number of leading channels whose data is complete. The producer
+	//   stores this with release semantics after each channel group (see
+	//   CHANGRP) and the consumer resets it to 0 before freeing the block,
+	//   so any non-zero value belongs to the current fill
+	uint32_t chans_ready;
+	// The number of producer blocks dropped since the previous block of
+	//   the scan (see OVERRUN); consumers that count blocks add this
+	int dropped;
+	// Who has the block: 0 when fake_gpu_thread has filled it and no
+	//   consumer has started on it, 1 once a consumer has claimed it, and
+	//   -1 while the producer is rearranging unread blocks (OVERRUN=DROPOLD)
+	int claim;
 } gpu_output_databuf_block_header_t;
 
 typedef struct gpu_output_databuf_block {
@@ -74,17 +116,38 @@ typedef struct gpu_output_databuf_block {
 	float data[TOTAL_DATA_SIZE];
 } gpu_output_databuf_block_t;
 
+// Describes the ring, so that a restarted pipeline can tell whether a
+//   segment left by an earlier run is one it can reuse as it is (see
+//   gpu_output_databuf_create). Bump the version whenever the block header
+//   changes in a way the sizes below would not show
+#define GPU_OUTPUT_DATABUF_MAGIC 0x53315247
+#define GPU_OUTPUT_DATABUF_VERSION 1
+
+typedef struct gpu_output_databuf_layout {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nblocks;
+	uint32_t nchan;
+	uint32_t nant;
+	uint32_t gpu_bin;
+	uint32_t nonzero_bin;
+	uint32_t block_header_size;
+	uint64_t block_size;
+} gpu_output_databuf_layout_t;
+
 typedef struct gpu_output_databuf {
 	hashpipe_databuf_t header;
+	gpu_output_databuf_layout_t layout;
 	gpu_output_databuf_block_t block[NUM_BLOCKS];
 } gpu_output_databuf_t;
 
-typedef struct timeval timeval;
-typedef struct timespec timespec;
 /*
  * OUTPUT BUFFER FUNCTIONS
  */
 
+// Creates the ring, or reuses the one left by an earlier run if nothing is
+//   attached to it and its layout matches, marking all of its blocks free.
+//   Either way the ring is locked into memory and faulted in
 hashpipe_databuf_t *gpu_output_databuf_create(int instance_id, int databuf_id);
 
 static inline void gpu_output_databuf_clear(gpu_output_databuf_t *d)
@@ -132,6 +195,23 @@ static inline int gpu_output_databuf_busywait_filled(gpu_output_databuf_t *d, in
     return hashpipe_databuf_busywait_filled((hashpipe_databuf_t *)d, block_id);
 }
 
+// Claims a filled block before reading it. Blocks with a claim of 1 were
+//   produced by a thread that never takes them back, so they need no claim
+static inline void gpu_output_databuf_claim(gpu_output_databuf_t *d, int block_id)
+{
+    int *claim = &d->block[block_id].header.claim;
+    int expected = 0;
+
+    while (!__atomic_compare_exchange_n(claim, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        if (expected == 1)
+            return;
+        // The producer is moving the block; it is done within one fill
+        expected = 0;
+        sched_yield();
+    }
+}
+
 static inline int gpu_output_databuf_set_free(gpu_output_databuf_t *d, int block_id)
 {
     return hashpipe_databuf_set_free((hashpipe_databuf_t *)d, block_id);
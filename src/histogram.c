@@ -0,0 +1,111 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "histogram.h"
+
+void histogram_reset(histogram_t *h)
+{
+    memset(h, 0, sizeof (histogram_t));
+    h->min_ns = UINT64_MAX;
+}
+
+static inline int histogram_bin(uint64_t ns)
+{
+    if (ns < (1 << HIST_SUB_BITS))
+        return (int)ns;
+
+    int msb = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    int bin = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+
+    return bin < HIST_NUM_BINS ? bin : HIST_NUM_BINS - 1;
+}
+
+uint64_t histogram_bin_lower(int bin)
+{
+    if (bin < (1 << HIST_SUB_BITS))
+        return bin;
+
+    int msb = (bin >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = bin & ((1 << HIST_SUB_BITS) - 1);
+
+    return ((1ULL << HIST_SUB_BITS) + sub) << (msb - HIST_SUB_BITS);
+}
+
+void histogram_add(histogram_t *h, int64_t ns)
+{
+    // Clock steps can make a latency appear negative; count it as zero
+    uint64_t v = ns < 0 ? 0 : (uint64_t)ns;
+
+    h->bins[histogram_bin(v)]++;
+    h->count++;
+    h->sum_ns += v;
+    if (v < h->min_ns)
+        h->min_ns = v;
+    if (v > h->max_ns)
+        h->max_ns = v;
+}
+
+uint64_t histogram_percentile(const histogram_t *h, double pct)
+{
+    if (h->count == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)(pct / 100.0 * h->count);
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < HIST_NUM_BINS; i++)
+    {
+        seen += h->bins[i];
+        if (seen > target)
+            return histogram_bin_lower(i);
+    }
+
+    return h->max_ns;
+}
+
+void histogram_print(FILE *f, const char *name, const histogram_t *h)
+{
+    if (h->count == 0)
+    {
+        fprintf(f, "%s: no samples\n", name);
+        return;
+    }
+
+    fprintf(f, "%s: %" PRIu64 " samples\n", name, h->count);
+    fprintf(f, "\tmin:  %12" PRIu64 " ns\n", h->min_ns);
+    fprintf(f, "\tmean: %12" PRIu64 " ns\n", h->sum_ns / h->count);
+    fprintf(f, "\tp50:  %12" PRIu64 " ns\n", histogram_percentile(h, 50.0));
+    fprintf(f, "\tp99:  %12" PRIu64 " ns\n", histogram_percentile(h, 99.0));
+    fprintf(f, "\tmax:  %12" PRIu64 " ns\n", h->max_ns);
+
+    int i;
+    for (i = 0; i < HIST_NUM_BINS; i++)
+    {
+        if (h->bins[i])
+            fprintf(f, "\t[%12" PRIu64 " ns, ...): %" PRIu64 "\n",
+                    histogram_bin_lower(i), h->bins[i]);
+    }
+}
@@ -0,0 +1,51 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Latency histogram with four sub-bins per power of two, so each bin is
+//   at most 25% wide. Bins 0-3 hold 0-3 ns exactly; above that bin
+//   4 * (msb - 1) + sub holds values whose top bits are 1.sub
+#define HIST_SUB_BITS 2
+#define HIST_NUM_BINS 160
+
+typedef struct histogram {
+    uint64_t bins[HIST_NUM_BINS];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+} histogram_t;
+
+void histogram_reset(histogram_t *h);
+void histogram_add(histogram_t *h, int64_t ns);
+// Returns the lower bound (ns) of the bin containing the given percentile
+uint64_t histogram_percentile(const histogram_t *h, double pct);
+uint64_t histogram_bin_lower(int bin);
+// Prints a summary plus every non-empty bin
+void histogram_print(FILE *f, const char *name, const histogram_t *h);
+
+#endif
@@ -0,0 +1,220 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "io_policy.h"
+#include "gpu_output_databuf.h"
+
+// Waits shorter than this found the range already on disk
+#define IO_WAIT_MIN_NS 100000
+
+// Counts a failed call, warning about the first of each file. err is an
+//   errno value
+static void io_error(io_policy_t *io, const char *call, int err)
+{
+    if (io->errors++ == 0)
+        hashpipe_warn("io_policy", "%s: %s; the file may not be fully on disk",
+                      call, strerror(err));
+}
+
+void io_policy_open(io_policy_t *io, hashpipe_status_t *st, fitsfile *fptr, const char *filename)
+{
+    int sync_mb = 0;
+    int status = 0;
+    long naxis1 = 0;
+    char tform[FLEN_VALUE] = "";
+    LONGLONG head_start, data_start, data_end;
+
+    io->drop = 1;
+    io->fsync_close = 0;
+    hashpipe_status_lock_safe(st);
+    hgeti4(st->buf, "IOSYNCMB", &sync_mb);
+    hgeti4(st->buf, "IODROP", &io->drop);
+    hgeti4(st->buf, "IOFSYNC", &io->fsync_close);
+    hashpipe_status_unlock_safe(st);
+
+    io->sync_bytes = sync_mb > 0 ? (int64_t)sync_mb << 20 : 0;
+    io->fd = -1;
+    io->data_start = 0;
+    io->row_bytes = 0;
+    io->rows_started = 0;
+    io->rows_done = 0;
+    io->min_mbps = 0;
+    io->max_mbps = 0;
+    io->ranges = 0;
+    io->ranges_waited = 0;
+    io->errors = 0;
+    histogram_reset(&io->stall);
+    clock_gettime(CLOCK_MONOTONIC, &io->open_time);
+
+    if (io->sync_bytes == 0 && !io->fsync_close)
+        return;
+
+    // sync_file_range() and posix_fadvise() act on the file, not the
+    //   descriptor, so one of our own does as well as CFITSIO's
+    io->fd = open(filename, O_RDONLY);
+    if (io->fd < 0)
+    {
+        hashpipe_warn(__FUNCTION__, "open(%s): %s; leaving writeback to the kernel",
+                      filename, strerror(errno));
+        return;
+    }
+
+    fits_get_hduaddrll(fptr, &head_start, &data_start, &data_end, &status);
+    fits_read_key_lng(fptr, "NAXIS1", &naxis1, NULL, &status);
+    fits_read_key(fptr, TSTRING, "TFORM2", tform, NULL, &status);
+    // Variable length arrays (TFORM 1PB) live in the heap
+    if (status == 0 && strpbrk(tform, "PQ") == NULL)
+    {
+        io->data_start = data_start;
+        io->row_bytes = naxis1;
+    }
+
+    // Compressed rows are at most as long as uncompressed ones
+    io->rows_per_sync = io->sync_bytes / (io->row_bytes > 0 ? io->row_bytes
+                                          : (off_t)(TOTAL_DATA_SIZE * sizeof (float)));
+    if (io->rows_per_sync < 1)
+        io->rows_per_sync = 1;
+}
+
+// The byte range holding rows [first, last)
+static void row_range(const io_policy_t *io, int first, int last, off_t *offset, off_t *len)
+{
+    *offset = io->data_start + (off_t)first * io->row_bytes;
+    *len = (off_t)(last - first) * io->row_bytes;
+}
+
+void io_policy_rows(io_policy_t *io, fitsfile *fptr, int rows)
+{
+    struct timespec start, stop, wait_start;
+    off_t offset, len;
+    double mbps;
+    int64_t wait_ns;
+    int status = 0;
+    int rv;
+
+    if (io->fd < 0 || io->sync_bytes == 0 || rows - io->rows_started < io->rows_per_sync)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Get the rows out of CFITSIO's buffers and into the page cache
+    fits_flush_buffer(fptr, 0, &status);
+    if (status)
+    {
+        fits_report_error(stderr, status);
+        io_error(io, "fits_flush_buffer", EIO);
+    }
+
+    if (io->row_bytes > 0)
+    {
+        // The previous range has had a whole step to reach the disk
+        if (io->rows_done < io->rows_started)
+        {
+            row_range(io, io->rows_done, io->rows_started, &offset, &len);
+            clock_gettime(CLOCK_MONOTONIC, &wait_start);
+            if (sync_file_range(io->fd, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE |
+                                SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+            {
+                io_error(io, "sync_file_range", errno);
+            }
+            else
+            {
+                clock_gettime(CLOCK_MONOTONIC, &stop);
+                wait_ns = ELAPSED_NS(wait_start, stop);
+                io->ranges++;
+                if (wait_ns >= IO_WAIT_MIN_NS)
+                {
+                    mbps = len / (wait_ns / 1e9) / 1e6;
+                    if (io->ranges_waited++ == 0 || mbps < io->min_mbps)
+                        io->min_mbps = mbps;
+                    if (mbps > io->max_mbps)
+                        io->max_mbps = mbps;
+                }
+            }
+            // Returns an error number rather than setting errno
+            if (io->drop && (rv = posix_fadvise(io->fd, offset, len, POSIX_FADV_DONTNEED)) != 0)
+                io_error(io, "posix_fadvise", rv);
+        }
+        row_range(io, io->rows_started, rows, &offset, &len);
+        if (sync_file_range(io->fd, offset, len, SYNC_FILE_RANGE_WRITE) != 0)
+            io_error(io, "sync_file_range", errno);
+    }
+    else
+    {
+        if (sync_file_range(io->fd, 0, 0, SYNC_FILE_RANGE_WRITE) != 0)
+            io_error(io, "sync_file_range", errno);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    histogram_add(&io->stall, ELAPSED_NS(start, stop));
+
+    io->rows_done = io->rows_started;
+    io->rows_started = rows;
+}
+
+void io_policy_close(io_policy_t *io, hashpipe_status_t *st, int rows)
+{
+    struct timespec start, stop;
+    double secs, mbps;
+    int rv;
+
+    if (io->fd < 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (io->fsync_close && fsync(io->fd) != 0)
+        io_error(io, "fsync", errno);
+    if (io->drop && io->sync_bytes > 0 && (rv = posix_fadvise(io->fd, 0, 0, POSIX_FADV_DONTNEED)) != 0)
+        io_error(io, "posix_fadvise", rv);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    histogram_add(&io->stall, ELAPSED_NS(start, stop));
+    close(io->fd);
+    io->fd = -1;
+
+    secs = ELAPSED_NS(io->open_time, stop) / 1e9;
+    mbps = io->row_bytes > 0 && secs > 0 ? rows * (double)io->row_bytes / secs / 1e6 : 0;
+    histogram_print(stderr, "Writeback stalls", &io->stall);
+    if (io->row_bytes > 0)
+        fprintf(stderr, "Wrote %.1f MB/s; %d of %d %lld MB ranges were still being written "
+                "back when waited for, at %.1f to %.1f MB/s\n",
+                mbps, io->ranges_waited, io->ranges, (long long)(io->sync_bytes >> 20),
+                io->min_mbps, io->max_mbps);
+    if (io->errors > 0)
+        fprintf(stderr, "%d writeback calls failed\n", io->errors);
+
+    hashpipe_status_lock_safe(st);
+    hputi4(st->buf, "IOSTLP99", histogram_percentile(&io->stall, 99.0) / 1000);
+    hputi4(st->buf, "IOSTLMAX", io->stall.max_ns / 1000);
+    hputr4(st->buf, "IOMBPS", mbps);
+    hputr4(st->buf, "IOWBMBPS", io->min_mbps);
+    hputi4(st->buf, "IOERRS", io->errors);
+    hashpipe_status_unlock_safe(st);
+}
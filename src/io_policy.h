@@ -0,0 +1,92 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef IO_POLICY_H
+#define IO_POLICY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fitsio.h"
+#include "hashpipe.h"
+#include "histogram.h"
+
+// Paces writeback of a scan's file instead of leaving it all to the page
+//   cache. Left alone, a long scan piles up dirty pages until the kernel
+//   flushes them all at once and the writer stalls behind the flush.
+//
+// Every IOSYNCMB megabytes of rows the policy flushes CFITSIO's buffers
+//   and starts writeback of the new range with sync_file_range(). It then
+//   waits for the previous range, which should long since be on disk, and
+//   (with IODROP) drops it from the page cache with posix_fadvise(), so
+//   only about two ranges are ever dirty or cached. With IOFSYNC the file
+//   is fsync()ed after it is closed.
+//
+// Row positions are only known for fixed width rows; for compressed rows
+//   the policy starts writeback of the whole file at each step and drops
+//   nothing until the file is closed.
+//
+// A failed flush, sync_file_range(), posix_fadvise() or fsync() (EIO from
+//   writeback, say) is warned about once per file and counted in IOERRS.
+
+typedef struct io_policy {
+    // Settings, read by io_policy_open()
+    int64_t sync_bytes;
+    int drop;
+    int fsync_close;
+
+    // A descriptor of our own on the open file, or -1
+    int fd;
+    // Where row 1 starts and how long rows are, 0 if rows vary in length
+    off_t data_start;
+    off_t row_bytes;
+    int rows_per_sync;
+    // Rows at the end of the ranges handed to writeback and known written
+    int rows_started;
+    int rows_done;
+
+    // Time spent in each sync_file_range()/fsync() step
+    histogram_t stall;
+    // Disk throughput while waiting for a range still being written back
+    //   (its bytes over the wait), for spotting uneven writeback. A range
+    //   that was already on disk says nothing about the disk's speed and
+    //   is only counted
+    double min_mbps;
+    double max_mbps;
+    int ranges;
+    int ranges_waited;
+    // Failed writeback calls
+    int errors;
+    struct timespec open_time;
+} io_policy_t;
+
+// Reads IOSYNCMB, IODROP and IOFSYNC and attaches to the file just opened
+//   as fptr (positioned at its DATA table)
+void io_policy_open(io_policy_t *io, hashpipe_status_t *st, fitsfile *fptr, const char *filename);
+
+// Called with the number of rows written so far
+void io_policy_rows(io_policy_t *io, fitsfile *fptr, int rows);
+
+// Called after fits_close_file(); prints and publishes the statistics
+void io_policy_close(io_policy_t *io, hashpipe_status_t *st, int rows);
+
+#endif
@@ -0,0 +1,332 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "load_profile.h"
+#include "sim_time.h"
+#include "metrics.h"
+
+// Appends a step to the table. Returns -1 if it is full
+static int add_step(load_profile_t *lp, double rate, int chans)
+{
+    load_step_t *s;
+
+    if (lp->nsteps >= LOAD_MAX_STEPS)
+        return -1;
+    s = &lp->steps[lp->nsteps++];
+    memset(s, 0, sizeof (*s));
+    s->rate = rate;
+    s->chans = chans;
+    return 0;
+}
+
+// Parses "rate[@channels],..." into the step table
+static void parse_steps(load_profile_t *lp, char *list)
+{
+    char *tok, *save = NULL, *at;
+    double rate;
+    int chans;
+
+    for (tok = strtok_r(list, ", ", &save); tok != NULL; tok = strtok_r(NULL, ", ", &save))
+    {
+        rate = strtod(tok, NULL);
+        chans = NUM_CHANNELS;
+        at = strchr(tok, '@');
+        if (at != NULL)
+            chans = atoi(at + 1);
+        if (rate < 0 || chans < 1 || chans > NUM_CHANNELS)
+        {
+            hashpipe_warn(__FUNCTION__, "ignoring LPSTEPS entry %s", tok);
+            continue;
+        }
+        if (add_step(lp, rate, chans) != 0)
+        {
+            hashpipe_warn(__FUNCTION__, "only the first %d LPSTEPS entries are used", LOAD_MAX_STEPS);
+            break;
+        }
+    }
+}
+
+void load_profile_configure(load_profile_t *lp, hashpipe_status_t *st, double base_rate)
+{
+    char mode[16] = "CONST";
+    char steps[512] = "";
+
+    lp->step = LOAD_STEP_DEFAULT;
+    lp->hold = LOAD_HOLD_DEFAULT;
+    lp->every = LOAD_EVERY_DEFAULT;
+    lp->burst = LOAD_BURST_DEFAULT;
+    lp->report_file[0] = '\0';
+    hashpipe_status_lock_safe(st);
+    hgets(st->buf, "LOADPROF", sizeof (mode), mode);
+    hgetr8(st->buf, "LPSTEP", &lp->step);
+    hgeti4(st->buf, "LPHOLD", &lp->hold);
+    hgeti4(st->buf, "LPEVERY", &lp->every);
+    hgeti4(st->buf, "LPBURST", &lp->burst);
+    hgets(st->buf, "LPSTEPS", sizeof (steps), steps);
+    hgets(st->buf, "LPREPORT", sizeof (lp->report_file), lp->report_file);
+    hashpipe_status_unlock_safe(st);
+
+    if (lp->step <= 0)
+        lp->step = LOAD_STEP_DEFAULT;
+    if (lp->hold < 1)
+        lp->hold = 1;
+    if (lp->every < 1)
+        lp->every = LOAD_EVERY_DEFAULT;
+    if (lp->burst < 0)
+        lp->burst = 0;
+
+    lp->nsteps = 0;
+    lp->cur = 0;
+    lp->block = 0;
+    lp->dropped_at_start = 0;
+    lp->max_rate = 0;
+    lp->saturated = 0;
+    lp->rate = base_rate;
+    lp->chans = NUM_CHANNELS;
+
+    if (strcasecmp(mode, "RAMP") == 0)
+    {
+        lp->mode = LOAD_RAMP;
+        if (lp->rate <= 0)
+            lp->rate = 1.0;
+        add_step(lp, lp->rate, lp->chans);
+    }
+    else if (strcasecmp(mode, "BURST") == 0)
+    {
+        lp->mode = LOAD_BURST;
+    }
+    else if (strcasecmp(mode, "STEP") == 0)
+    {
+        lp->mode = LOAD_STEP;
+        parse_steps(lp, steps);
+        if (lp->nsteps == 0)
+        {
+            hashpipe_warn(__FUNCTION__, "LPSTEPS (%s) has no steps; running at a constant rate", steps);
+            lp->mode = LOAD_CONST;
+        }
+        else
+        {
+            lp->rate = lp->steps[0].rate;
+            lp->chans = lp->steps[0].chans;
+        }
+    }
+    else
+    {
+        if (strcasecmp(mode, "CONST") != 0)
+            hashpipe_warn(__FUNCTION__, "unknown LOADPROF %s; running at a constant rate", mode);
+        lp->mode = LOAD_CONST;
+    }
+
+    if (lp->mode != LOAD_CONST)
+        fprintf(stderr, "Load profile %s starting at %gx real time\n", load_profile_name(lp), lp->rate);
+    hashpipe_status_lock_safe(st);
+    hputr4(st->buf, "LPRATE", lp->rate);
+    hashpipe_status_unlock_safe(st);
+}
+
+const char *load_profile_name(const load_profile_t *lp)
+{
+    switch (lp->mode)
+    {
+    case LOAD_RAMP:  return "RAMP";
+    case LOAD_BURST: return "BURST";
+    case LOAD_STEP:  return "STEP";
+    default:         return "CONST";
+    }
+}
+
+// Decides whether a step kept up. A consumer that is slower than the
+//   producer first lets the ring fill, then holds the producer back
+static void finish_step(load_profile_t *lp, load_step_t *s)
+{
+    int64_t slack = s->rate > 0 ? (int64_t)(INT_TIME_NS / s->rate) : 0;
+
+    s->passed = s->dropped == 0 && s->fill_end - s->fill_start <= 1 &&
+                (s->rate == 0 || s->lag_end - s->lag_start <= slack);
+    if (s->passed && s->rate > lp->max_rate)
+        lp->max_rate = s->rate;
+}
+
+// Moves on to the next step at the end of one
+static void next_step(load_profile_t *lp, hashpipe_status_t *st, uint64_t dropped)
+{
+    load_step_t *s = &lp->steps[lp->cur];
+
+    finish_step(lp, s);
+    if (lp->mode == LOAD_RAMP)
+    {
+        if (s->passed && add_step(lp, s->rate + lp->step, s->chans) == 0)
+        {
+            lp->cur++;
+        }
+        else
+        {
+            // Settle at the highest rate that kept up for the rest of the scan
+            lp->saturated = !s->passed;
+            lp->cur = -1;
+            if (lp->max_rate > 0)
+                lp->rate = lp->max_rate;
+            else
+                lp->rate = lp->steps[0].rate;
+            fprintf(stderr, "Load ramp %s at %gx real time; holding %gx\n",
+                    lp->saturated ? "saturated" : "stopped", s->rate, lp->rate);
+        }
+    }
+    else
+    {
+        lp->cur++;
+    }
+
+    if (lp->cur >= 0)
+    {
+        lp->rate = lp->steps[lp->cur].rate;
+        lp->chans = lp->steps[lp->cur].chans;
+    }
+    lp->dropped_at_start = dropped;
+    hashpipe_status_lock_safe(st);
+    hputr4(st->buf, "LPRATE", lp->rate);
+    hashpipe_status_unlock_safe(st);
+}
+
+// The number of ring blocks waiting for the consumer
+static int ring_fill(gpu_output_databuf_t *db)
+{
+    return __builtin_popcount(gpu_output_databuf_total_status(db) & ((1 << NUM_BLOCKS) - 1));
+}
+
+void load_profile_pace(load_profile_t *lp, hashpipe_status_t *st, gpu_output_databuf_t *db,
+                       struct timespec *deadline, uint64_t dropped)
+{
+    struct timespec now;
+    int64_t interval = lp->rate > 0 ? (int64_t)(INT_TIME_NS / lp->rate) : 0;
+    int64_t lag;
+    double rate = lp->rate;
+    load_step_t *s;
+
+    sim_clock_now(&now);
+    // How late the next block will start at this rate
+    lag = ELAPSED_NS((*deadline), now) - interval;
+    lp->block++;
+    if (interval > 0)
+        metrics_observe(&sim1_metrics.pace_late, lag);
+    metrics_set(&sim1_metrics.ring_fill, ring_fill(db));
+
+    if (lp->cur >= 0 && (lp->mode == LOAD_RAMP || lp->mode == LOAD_STEP))
+    {
+        s = &lp->steps[lp->cur];
+        if (s->blocks++ == 0)
+        {
+            s->fill_start = ring_fill(db);
+            s->lag_start = lag;
+        }
+        s->fill_end = ring_fill(db);
+        s->lag_end = lag;
+        s->dropped = dropped - lp->dropped_at_start;
+        // The last of LPSTEPS holds to the end of the scan
+        if (s->blocks >= lp->hold && (lp->mode == LOAD_RAMP || lp->cur + 1 < lp->nsteps))
+            next_step(lp, st, dropped);
+    }
+
+    if (lp->mode == LOAD_BURST && lp->block % lp->every < lp->burst)
+        rate = 0;
+    else if (lp->rate != rate)
+    {
+        // A new rate starts from now rather than from the old deadlines
+        *deadline = now;
+        rate = lp->rate;
+    }
+
+    if (rate <= 0)
+    {
+        // Unpaced: the ring alone holds us back
+        *deadline = now;
+        return;
+    }
+
+    deadline->tv_nsec += INT_TIME_NS / rate;
+    // Handle overflow of ns->s
+    while (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_nsec -= 1000000000;
+        deadline->tv_sec++;
+    }
+    sim_clock_sleep_until(deadline);
+}
+
+static void print_report(load_profile_t *lp, FILE *f, int scan_num)
+{
+    double bps = lp->max_rate / INT_TIME;
+    int i;
+
+    fprintf(f, "Load profile %s, scan %d (%d channels, %d ring blocks of %lu bytes)\n",
+            load_profile_name(lp), scan_num, NUM_CHANNELS, NUM_BLOCKS,
+            (unsigned long)VALID_DATA_BYTES);
+    if (lp->nsteps > 0)
+        fprintf(f, "\t%6s %8s %6s %8s %8s %10s %8s\n", "step", "rate", "chans", "blocks",
+                "filled", "lag (ms)", "dropped");
+    for (i = 0; i < lp->nsteps; i++)
+    {
+        load_step_t *s = &lp->steps[i];
+        if (s->blocks == 0)
+            continue;
+        fprintf(f, "\t%6d %8.3g %6d %8d %3d->%-3d %10.2f %8llu %s\n", i, s->rate, s->chans,
+                s->blocks, s->fill_start, s->fill_end, s->lag_end / 1e6,
+                (unsigned long long)s->dropped, s->passed ? "ok" : "FAIL");
+    }
+    fprintf(f, "\tHighest sustained rate: %gx real time (%.2f blocks/s, %.2f MB/s)%s\n",
+            lp->max_rate, bps, bps * VALID_DATA_BYTES / 1e6,
+            lp->mode == LOAD_RAMP && !lp->saturated ? "; never saturated" : "");
+}
+
+void load_profile_report(load_profile_t *lp, hashpipe_status_t *st, int scan_num)
+{
+    FILE *f;
+
+    if (lp->mode == LOAD_CONST || lp->mode == LOAD_BURST)
+        return;
+
+    // The step the scan ended in
+    if (lp->cur >= 0 && lp->steps[lp->cur].blocks > 0)
+        finish_step(lp, &lp->steps[lp->cur]);
+
+    print_report(lp, stderr, scan_num);
+    if (lp->report_file[0] != '\0')
+    {
+        f = fopen(lp->report_file, "a");
+        if (f == NULL)
+            hashpipe_warn(__FUNCTION__, "cannot append to LPREPORT (%s)", lp->report_file);
+        else
+        {
+            print_report(lp, f, scan_num);
+            fclose(f);
+        }
+    }
+
+    hashpipe_status_lock_safe(st);
+    hputr4(st->buf, "LPMAXRT", lp->max_rate);
+    hputr4(st->buf, "LPMAXBPS", lp->max_rate / INT_TIME);
+    hashpipe_status_unlock_safe(st);
+}
@@ -0,0 +1,119 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+#ifndef LOAD_PROFILE_H
+#define LOAD_PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "hashpipe.h"
+#include "gpu_output_databuf.h"
+
+// How fake_gpu_thread paces its blocks during a scan (LOADPROF). Rates are
+//   multiples of real time, one block every INT_TIME seconds:
+//   LOAD_CONST  a fixed rate (REPLAYRT for replays, otherwise 1), as before
+//   LOAD_RAMP   start at that rate and raise it by LPSTEP every LPHOLD
+//               blocks until the consumers can't keep up, then settle at
+//               the last rate they could sustain
+//   LOAD_BURST  the fixed rate, but every LPEVERY blocks send LPBURST of
+//               them back to back without sleeping
+//   LOAD_STEP   hold each entry of LPSTEPS, "rate[@channels],...", for
+//               LPHOLD blocks; the last one holds to the end of the scan
+// A step fails if the consumers fell behind during it: if the ring holds
+//   more than one block more at its end than at its start, if the producer
+//   ends it more than a block further behind its deadlines than it started,
+//   or if any block was dropped (OVERRUN). The report lists each step and
+//   the highest rate that passed.
+typedef enum load_mode {
+    LOAD_CONST,
+    LOAD_RAMP,
+    LOAD_BURST,
+    LOAD_STEP
+} load_mode_t;
+
+#define LOAD_MAX_STEPS 64
+#define LOAD_STEP_DEFAULT 0.25
+#define LOAD_HOLD_DEFAULT 50
+#define LOAD_EVERY_DEFAULT 100
+#define LOAD_BURST_DEFAULT (2 * NUM_BLOCKS)
+
+typedef struct load_step {
+    double rate;
+    // Channels generated per block; the rest are left zero
+    int chans;
+    // Filled in as the step runs: ring blocks filled and lateness of the
+    //   producer at its start and end
+    int blocks;
+    int fill_start;
+    int fill_end;
+    int64_t lag_start;
+    int64_t lag_end;
+    uint64_t dropped;
+    int passed;
+} load_step_t;
+
+typedef struct load_profile {
+    load_mode_t mode;
+    double step;
+    int hold;
+    int every;
+    int burst;
+    char report_file[256];
+
+    // The steps run so far (LOAD_RAMP) or to be run (LOAD_STEP)
+    load_step_t steps[LOAD_MAX_STEPS];
+    int nsteps;
+    int cur;
+
+    // The pacing of the next block and the channels to generate in it
+    double rate;
+    int chans;
+    // Blocks since the scan (LOAD_BURST) or step started
+    int block;
+    uint64_t dropped_at_start;
+
+    // The highest rate that passed, and whether a higher one failed
+    double max_rate;
+    int saturated;
+} load_profile_t;
+
+// Reads LOADPROF and its parameters at the start of a scan. base_rate is
+//   the rate of LOAD_CONST; 0 means as fast as the ring allows
+void load_profile_configure(load_profile_t *lp, hashpipe_status_t *st, double base_rate);
+
+const char *load_profile_name(const load_profile_t *lp);
+
+// Waits for the deadline of the next block after one has been produced
+//   (or dropped). deadline is the deadline of the block just produced and
+//   becomes that of the next one; dropped is the number of blocks dropped
+//   so far in the scan
+void load_profile_pace(load_profile_t *lp, hashpipe_status_t *st, gpu_output_databuf_t *db,
+                       struct timespec *deadline, uint64_t dropped);
+
+// Prints the steps and the highest sustained rate, appends them to
+//   LPREPORT if it is set and publishes LPMAXRT and LPMAXBPS
+void load_profile_report(load_profile_t *lp, hashpipe_status_t *st, int scan_num);
+
+#endif
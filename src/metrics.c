@@ -0,0 +1,150 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "metrics.h"
+
+// Reads of a busy histogram before one is served as it is
+#define METRICS_READ_TRIES 16
+
+metrics_t sim1_metrics;
+
+void metrics_observe(metrics_histogram_t *h, int64_t ns)
+{
+    uint64_t us;
+    int b;
+
+    if (ns < 0)
+        ns = 0;
+    // The first bucket whose bound of 2^b us holds ns
+    us = ((uint64_t)ns + 999) / 1000;
+    b = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (b >= METRICS_NUM_BUCKETS)
+        b = METRICS_NUM_BUCKETS - 1;
+
+    __atomic_fetch_add(&h->started, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_fetch_add(&h->buckets[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, (uint64_t)ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->finished, 1, __ATOMIC_RELEASE);
+}
+
+typedef struct out {
+    char *buf;
+    size_t size;
+    size_t len;
+    int full;
+} out_t;
+
+static void put(out_t *o, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (o->full)
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(o->buf + o->len, o->size - o->len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= o->size - o->len)
+        o->full = 1;
+    else
+        o->len += n;
+}
+
+static void put_counter(out_t *o, const char *name, const char *help, uint64_t *counter)
+{
+    put(o, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+        (unsigned long long)__atomic_load_n(counter, __ATOMIC_RELAXED));
+}
+
+static void put_gauge(out_t *o, const char *name, const char *help, int64_t *gauge)
+{
+    put(o, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", name, help, name, name,
+        (long long)__atomic_load_n(gauge, __ATOMIC_RELAXED));
+}
+
+static void put_histogram(out_t *o, const char *name, const char *help, metrics_histogram_t *h)
+{
+    uint64_t buckets[METRICS_NUM_BUCKETS];
+    uint64_t sum_ns, finished, cum = 0;
+    int b, tries;
+
+    // No observation may start between reading finished and started, or
+    //   the buckets and sum could cover different ones
+    for (tries = 0; tries < METRICS_READ_TRIES; tries++)
+    {
+        finished = __atomic_load_n(&h->finished, __ATOMIC_ACQUIRE);
+        for (b = 0; b < METRICS_NUM_BUCKETS; b++)
+            buckets[b] = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        sum_ns = __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&h->started, __ATOMIC_RELAXED) == finished)
+            break;
+    }
+
+    put(o, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (b = 0; b < METRICS_NUM_BUCKETS - 1; b++)
+    {
+        cum += buckets[b];
+        put(o, "%s_bucket{le=\"%.7g\"} %llu\n", name, (double)(1ULL << b) * 1e-6,
+            (unsigned long long)cum);
+    }
+    cum += buckets[b];
+    put(o, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cum);
+    put(o, "%s_sum %.9f\n%s_count %llu\n", name, sum_ns * 1e-9, name, (unsigned long long)cum);
+}
+
+int metrics_format(char *buf, size_t size)
+{
+    metrics_t *m = &sim1_metrics;
+    out_t o = { buf, size, 0, 0 };
+
+    put_counter(&o, "sim1_blocks_produced_total", "Blocks filled by fake_gpu_thread.",
+                &m->blocks_produced);
+    put_counter(&o, "sim1_bytes_produced_total", "Bytes of covariance data filled by fake_gpu_thread.",
+                &m->bytes_produced);
+    put_counter(&o, "sim1_blocks_dropped_total", "Blocks dropped by the OVERRUN policy.",
+                &m->blocks_dropped);
+    put_gauge(&o, "sim1_ring_fill_blocks", "Filled blocks in fake_gpu_thread's ring after its last block.",
+              &m->ring_fill);
+    put_histogram(&o, "sim1_pace_lateness_seconds",
+                  "How far behind its schedule fake_gpu_thread was after each paced block.",
+                  &m->pace_late);
+    put_histogram(&o, "sim1_wait_free_seconds", "Time spent waiting for free blocks.",
+                  &m->wait_free);
+    put_histogram(&o, "sim1_wait_filled_seconds", "Time spent waiting for filled blocks.",
+                  &m->wait_filled);
+    put_counter(&o, "sim1_rows_written_total", "FITS rows written.", &m->rows_written);
+    put_counter(&o, "sim1_bytes_written_total", "Bytes of row data handed to CFITSIO.",
+                &m->bytes_written);
+    put_histogram(&o, "sim1_row_write_seconds", "Time to write each FITS row.", &m->row_write);
+    put_histogram(&o, "sim1_block_latency_seconds",
+                  "Time from the producer finishing a block to the writer freeing it.",
+                  &m->latency);
+
+    return o.full ? -1 : (int)o.len;
+}
@@ -0,0 +1,90 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Process-wide counters, gauges and histograms, served by metrics_thread
+//   in the Prometheus text format.
+//
+// Each is updated by the thread that owns it with a relaxed atomic add or
+//   store and nothing else, and the exporter reads them the same way, so
+//   a scrape never takes a lock or makes the pipeline wait. A histogram
+//   also counts the observations started and finished; the exporter
+//   rereads it until none started while it was reading, so its buckets,
+//   sum and count all cover the same observations. If the histogram is
+//   too busy to get such a read within a few tries, the last read is
+//   served as it is.
+
+// Histogram buckets hold values up to 1 us, 2 us, 4 us, ... 2^23 us (8.4 s),
+//   with a last one for anything longer
+#define METRICS_NUM_BUCKETS 25
+
+typedef struct metrics_histogram {
+    uint64_t buckets[METRICS_NUM_BUCKETS];
+    uint64_t sum_ns;
+    // Observations begun and completed
+    uint64_t started;
+    uint64_t finished;
+} metrics_histogram_t;
+
+typedef struct metrics {
+    // fake_gpu_thread
+    uint64_t blocks_produced;
+    uint64_t bytes_produced;
+    uint64_t blocks_dropped;
+    int64_t ring_fill;
+    metrics_histogram_t pace_late;
+    // Waits for blocks by the threads that use wait_policy: free blocks
+    //   for the producer, filled ones for the writer
+    metrics_histogram_t wait_free;
+    metrics_histogram_t wait_filled;
+    // fits_writer_thread and striped_writer_thread
+    uint64_t rows_written;
+    uint64_t bytes_written;
+    metrics_histogram_t row_write;
+    metrics_histogram_t latency;
+} metrics_t;
+
+extern metrics_t sim1_metrics;
+
+static inline void metrics_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_set(int64_t *gauge, int64_t value)
+{
+    __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(metrics_histogram_t *h, int64_t ns);
+
+// Writes every metric into buf in the Prometheus text format. Returns the
+//   length, or -1 if buf is too small
+int metrics_format(char *buf, size_t size);
+
+#endif
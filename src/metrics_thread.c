@@ -0,0 +1,231 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+// Serves the counters and histograms of metrics.h to Prometheus (or curl)
+//   over HTTP, on METPORT of the loopback interface or, if METSOCK is set,
+//   on that Unix socket. It is not part of the chain of threads and only
+//   reads the metrics, so a scrape costs the pipeline nothing:
+// $ hashpipe -p fake_gpu -I 0 -c 3 fake_gpu_thread -c 5 fits_writer_thread -c 6 metrics_thread
+// $ curl -s localhost:9109/metrics
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "hashpipe.h"
+#include "metrics.h"
+
+#define MET_DEFAULT_PORT 9109
+#define MET_SOCK_LENGTH 108
+#define MET_BUF_BYTES (64 * 1024)
+
+static int init(struct hashpipe_thread_args *args)
+{
+    hashpipe_status_t st = args->st;
+    int port;
+    char path[MET_SOCK_LENGTH];
+
+    // Defaults only: keep anything given on the command line (-o METPORT=...)
+    hashpipe_status_lock_safe(&st);
+    if (hgeti4(st.buf, "METPORT", &port) == 0)
+        hputi4(st.buf, "METPORT", MET_DEFAULT_PORT);
+    if (hgets(st.buf, "METSOCK", sizeof (path), path) == 0)
+        hputs(st.buf, "METSOCK", "");
+    hashpipe_status_unlock_safe(&st);
+
+    return 0;
+}
+
+// Listens on the Unix socket path if it is set, otherwise on the loopback
+//   port. Returns the socket, or -1 after reporting why
+static int open_listener(const char *path, int port)
+{
+    int sock, one = 1;
+
+    if (path[0] != '\0')
+    {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof (addr));
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof (addr.sun_path), "%s", path);
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        // A socket left by an earlier run would make bind fail
+        unlink(path);
+        if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof (addr)) != 0 || listen(sock, 4) != 0)
+        {
+            hashpipe_error(__FUNCTION__, "cannot listen on %s", path);
+            if (sock >= 0)
+                close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock >= 0)
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof (addr)) != 0 || listen(sock, 4) != 0)
+    {
+        hashpipe_error(__FUNCTION__, "cannot listen on port %d", port);
+        if (sock >= 0)
+            close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int send_all(int sock, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Answers one request. Any path gets the metrics; a client that says
+//   nothing for a second is dropped
+static void serve(int conn, char *buf, size_t size)
+{
+    struct timeval timeout = { 1, 0 };
+    char req[1024];
+    size_t got = 0;
+    ssize_t n;
+    int len;
+    char head[128];
+
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+    // Read the request up to the blank line that ends its headers
+    while (got < sizeof (req) - 1)
+    {
+        n = recv(conn, req + got, sizeof (req) - 1 - got, 0);
+        if (n <= 0)
+            return;
+        got += n;
+        req[got] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+            break;
+    }
+
+    len = metrics_format(buf, size);
+    if (len < 0)
+    {
+        hashpipe_warn(__FUNCTION__, "metrics do not fit in %lu bytes", (unsigned long)size);
+        return;
+    }
+    snprintf(head, sizeof (head),
+             "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n",
+             len);
+    if (send_all(conn, head, strlen(head)) == 0)
+        send_all(conn, buf, len);
+}
+
+static void *run(hashpipe_thread_args_t * args)
+{
+    hashpipe_status_t st = args->st;
+    const char * status_key = args->thread_desc->skey;
+
+    char path[MET_SOCK_LENGTH] = "";
+    int port = MET_DEFAULT_PORT;
+    struct pollfd pfd;
+    char *buf;
+    int sock, conn;
+
+    hashpipe_status_lock_safe(&st);
+    hgeti4(st.buf, "METPORT", &port);
+    hgets(st.buf, "METSOCK", sizeof (path), path);
+    hashpipe_status_unlock_safe(&st);
+
+    sock = open_listener(path, port);
+    if (sock < 0)
+        return NULL;
+    if (path[0] != '\0')
+        fprintf(stderr, "metrics_thread: serving metrics on %s\n", path);
+    else
+        fprintf(stderr, "metrics_thread: serving metrics on 127.0.0.1:%d\n", port);
+
+    buf = malloc(MET_BUF_BYTES);
+    hashpipe_status_lock_safe(&st);
+    hputs(st.buf, status_key, "serving");
+    hashpipe_status_unlock_safe(&st);
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    while (run_threads())
+    {
+        // Wake up every second to see whether we are stopping
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+        conn = accept(sock, NULL, NULL);
+        if (conn < 0)
+            continue;
+        serve(conn, buf, MET_BUF_BYTES);
+        close(conn);
+
+        pthread_testcancel();
+    }
+
+    close(sock);
+    if (path[0] != '\0')
+        unlink(path);
+    free(buf);
+    return THREAD_OK;
+}
+
+static hashpipe_thread_desc_t metrics_thread = {
+    name: "metrics_thread",
+    skey: "METSTAT",
+    init: init,
+    run:  run
+};
+
+static __attribute__((constructor)) void ctor()
+{
+  register_hashpipe_thread(&metrics_thread);
+}
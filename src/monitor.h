@@ -0,0 +1,48 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <stdint.h>
+
+// Layout of the shared memory published by monitor_thread: this header
+//   followed by nchan spectra of ninputs autocorrelation powers (float),
+//   channel by channel, inputs in order (2a is antenna a's X
+//   polarization, 2a + 1 its Y). Each spectrum is the mean of navg sampled
+//   blocks, the last of which had mcnt, scan_num and dmjd. seq is odd
+//   while the spectra are being rewritten; a reader copies what it needs
+//   and retries if seq was odd or changed meanwhile
+#define MON_SHM_MAGIC 0x5331414d
+typedef struct mon_shm_header {
+    uint32_t magic;
+    uint32_t nchan;
+    uint32_t ninputs;
+    uint32_t navg;
+    uint64_t seq;
+    int32_t mcnt;
+    int32_t scan_num;
+    double dmjd;
+} mon_shm_header_t;
+
+#endif
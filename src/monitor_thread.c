@@ -0,0 +1,281 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+// Quick-look monitor: samples every MONEVERY'th block of a ring, averages
+//   the autocorrelations of MONAVG samples and publishes the spectra in
+//   POSIX shared memory (MONSHM, see mon_shm_header_t) for plotting while
+//   the scan is still being written.
+//
+// The thread is not part of the chain of threads and never waits on,
+//   claims or frees a block: it attaches to the ring MONBUF on its own,
+//   peeks at the newest complete block and copies its NUM_ANTENNAS
+//   autocorrelations per channel through a precomputed index
+//   (bl_select "auto"). A block that is freed or rearranged while it is
+//   being copied is simply skipped (MONTORN), so monitoring can never
+//   delay the writer's set_free and costs one small gather per sample:
+// $ hashpipe -p fake_gpu -I 0 -c 3 fake_gpu_thread -c 5 fits_writer_thread -c 6 monitor_thread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "hashpipe.h"
+#include "shm_publish.h"
+#include "gpu_output_databuf.h"
+#include "baseline_select.h"
+#include "monitor.h"
+
+#define MON_SHM_NAME_LENGTH 64
+#define MON_NINPUTS NUM_ANTENNAS
+#define MON_SHM_BYTES (sizeof (mon_shm_header_t) + (size_t)NUM_CHANNELS * MON_NINPUTS * sizeof (float))
+// How often the ring is looked at, in microseconds
+#define MON_POLL_US ((useconds_t)(INT_TIME * 1000000 / 2))
+
+static int init(struct hashpipe_thread_args *args)
+{
+    hashpipe_status_t st = args->st;
+    int v;
+    char name[MON_SHM_NAME_LENGTH];
+
+    // Defaults only: keep anything given on the command line (-o MONBUF=...)
+    hashpipe_status_lock_safe(&st);
+    if (hgeti4(st.buf, "MONBUF", &v) == 0)
+        hputi4(st.buf, "MONBUF", 1);
+    if (hgeti4(st.buf, "MONEVERY", &v) == 0)
+        hputi4(st.buf, "MONEVERY", 10);
+    if (hgeti4(st.buf, "MONAVG", &v) == 0)
+        hputi4(st.buf, "MONAVG", 4);
+    if (hgets(st.buf, "MONSHM", sizeof (name), name) == 0)
+        hputs(st.buf, "MONSHM", "/sim1_autospec");
+    hashpipe_status_unlock_safe(&st);
+
+    return 0;
+}
+
+// Whether a block holds a complete fill that no one is rearranging
+static int block_complete(const gpu_output_databuf_block_header_t *h)
+{
+    return __atomic_load_n(&h->chans_ready, __ATOMIC_ACQUIRE) >= NUM_CHANNELS
+        && __atomic_load_n(&h->claim, __ATOMIC_ACQUIRE) >= 0;
+}
+
+// Finds the complete block with the newest scan and mcnt. Returns -1 if
+//   there is none
+static int newest_block(const gpu_output_databuf_t *db)
+{
+    int i, best = -1;
+    int scan, mcnt, best_scan = 0, best_mcnt = 0;
+
+    for (i = 0; i < NUM_BLOCKS; i++)
+    {
+        const gpu_output_databuf_block_header_t *h = &db->block[i].header;
+        if (!block_complete(h))
+            continue;
+        scan = __atomic_load_n(&h->scan_num, __ATOMIC_RELAXED);
+        mcnt = __atomic_load_n(&h->mcnt, __ATOMIC_RELAXED);
+        if (best < 0 || scan > best_scan || (scan == best_scan && mcnt > best_mcnt))
+        {
+            best = i;
+            best_scan = scan;
+            best_mcnt = mcnt;
+        }
+    }
+    return best;
+}
+
+// Copies a block's autocorrelations into scratch and its header into hdr.
+//   Returns 0 on success and -1 if the block was freed, refilled or moved
+//   while it was being read, in which case the copy is torn
+static int sample_block(const gpu_output_databuf_block_t *block, const bl_select_t *sel,
+                        float *scratch, gpu_output_databuf_block_header_t *hdr)
+{
+    const gpu_output_databuf_block_header_t *h = &block->header;
+
+    if (!block_complete(h))
+        return -1;
+    hdr->mcnt = __atomic_load_n(&h->mcnt, __ATOMIC_RELAXED);
+    hdr->scan_num = __atomic_load_n(&h->scan_num, __ATOMIC_RELAXED);
+    hdr->acc_len = h->acc_len;
+    hdr->dmjd = h->dmjd;
+
+    bl_select_extract(sel, block->data, NUM_CHANNELS, scratch);
+
+    // A consumer clears chans_ready before freeing the block and the
+    //   producer sets a new mcnt before writing into it again
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!block_complete(h)
+        || __atomic_load_n(&h->mcnt, __ATOMIC_RELAXED) != hdr->mcnt
+        || __atomic_load_n(&h->scan_num, __ATOMIC_RELAXED) != hdr->scan_num)
+        return -1;
+    return 0;
+}
+
+static void publish(mon_shm_header_t *shm, const double *sum, int navg,
+                    const gpu_output_databuf_block_header_t *last)
+{
+    float *spec = (float *)(shm + 1);
+    int i;
+
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    shm->navg = navg;
+    shm->mcnt = last->mcnt;
+    shm->scan_num = last->scan_num;
+    shm->dmjd = last->dmjd;
+    for (i = 0; i < NUM_CHANNELS * MON_NINPUTS; i++)
+        spec[i] = sum[i] / navg;
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void *run(hashpipe_thread_args_t * args)
+{
+    hashpipe_status_t st = args->st;
+    const char * status_key = args->thread_desc->skey;
+
+    gpu_output_databuf_t *db = NULL;
+    gpu_output_databuf_block_header_t hdr;
+    char shm_name[MON_SHM_NAME_LENGTH];
+    mon_shm_header_t *shm;
+    bl_select_t *sel;
+    float *scratch;
+    double sum[NUM_CHANNELS * MON_NINPUTS];
+    int buf = 1, every = 10, avg = 4;
+    int navg = 0, last_scan = -1, next_mcnt = 0;
+    long npub = 0, ntorn = 0;
+    int idx, c, i;
+
+    hashpipe_status_lock_safe(&st);
+    hgeti4(st.buf, "MONBUF", &buf);
+    hgets(st.buf, "MONSHM", sizeof (shm_name), shm_name);
+    hputs(st.buf, status_key, "attaching");
+    hashpipe_status_unlock_safe(&st);
+
+    // The ring is made by the threads that use it; wait for it
+    while (run_threads() && (db = gpu_output_databuf_attach(args->instance_id, buf)) == NULL)
+        sleep(1);
+    if (db == NULL)
+        return THREAD_OK;
+
+    sel = bl_select_compile("auto");
+    scratch = sel != NULL ? malloc((size_t)NUM_CHANNELS * sel->nsel * 2 * sizeof (float)) : NULL;
+    if (scratch == NULL)
+    {
+        hashpipe_error(__FUNCTION__, "cannot set up the autocorrelation selection");
+        bl_select_free(sel);
+        gpu_output_databuf_detach(db);
+        return NULL;
+    }
+    shm = shm_publish_open(shm_name, MON_SHM_BYTES, offsetof(mon_shm_header_t, seq));
+    if (shm != NULL)
+    {
+        shm->magic = MON_SHM_MAGIC;
+        shm->nchan = NUM_CHANNELS;
+        shm->ninputs = MON_NINPUTS;
+        fprintf(stderr, "monitor_thread: publishing autocorrelation spectra of databuf %d in %s\n",
+                buf, shm_name);
+    }
+    memset(sum, 0, sizeof (sum));
+
+    hashpipe_status_lock_safe(&st);
+    hputs(st.buf, status_key, "running");
+    hashpipe_status_unlock_safe(&st);
+
+    while (run_threads())
+    {
+        usleep(MON_POLL_US);
+
+        idx = newest_block(db);
+        if (idx < 0)
+            continue;
+        // Nothing due yet in this scan
+        if (db->block[idx].header.scan_num == last_scan && db->block[idx].header.mcnt < next_mcnt)
+            continue;
+        if (sample_block(&db->block[idx], sel, scratch, &hdr) != 0)
+        {
+            ntorn++;
+            continue;
+        }
+
+        if (hdr.scan_num != last_scan)
+        {
+            // Start each scan's average afresh, with the settings of the time
+            hashpipe_status_lock_safe(&st);
+            hgeti4(st.buf, "MONEVERY", &every);
+            hgeti4(st.buf, "MONAVG", &avg);
+            hashpipe_status_unlock_safe(&st);
+            if (every < 1)
+                every = 1;
+            if (avg < 1)
+                avg = 1;
+            memset(sum, 0, sizeof (sum));
+            navg = 0;
+            last_scan = hdr.scan_num;
+        }
+        next_mcnt = hdr.mcnt + every * N * (hdr.acc_len > 0 ? hdr.acc_len : 1);
+
+        for (c = 0; c < NUM_CHANNELS; c++)
+            for (i = 0; i < MON_NINPUTS; i++)
+                sum[c * MON_NINPUTS + i] += scratch[((size_t)c * sel->nsel + i) * 2];
+        navg++;
+
+        if (navg >= avg)
+        {
+            if (shm != NULL)
+                publish(shm, sum, navg, &hdr);
+            memset(sum, 0, sizeof (sum));
+            navg = 0;
+            npub++;
+
+            hashpipe_status_lock_safe(&st);
+            hputi8(st.buf, "MONPUBS", npub);
+            hputi8(st.buf, "MONTORN", ntorn);
+            hashpipe_status_unlock_safe(&st);
+        }
+
+        pthread_testcancel();
+    }
+
+    if (shm != NULL)
+        munmap(shm, MON_SHM_BYTES);
+    free(scratch);
+    bl_select_free(sel);
+    gpu_output_databuf_detach(db);
+    return THREAD_OK;
+}
+
+static hashpipe_thread_desc_t monitor_thread = {
+    name: "monitor_thread",
+    skey: "MONSTAT",
+    init: init,
+    run:  run
+};
+
+static __attribute__((constructor)) void ctor()
+{
+  register_hashpipe_thread(&monitor_thread);
+}
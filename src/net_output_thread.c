@@ -0,0 +1,531 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+// Streams every block to a receiver over UDP or TCP instead of writing it
+//   to disk. Takes fits_writer_thread's place in the pipeline:
+// $ hashpipe -p fake_gpu -I 0 -c 3 fake_gpu_thread -c 4 net_output_thread
+// and sim1_net_recv reassembles the blocks at the other end.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "hashpipe.h"
+#include "gpu_output_databuf.h"
+#include "net_proto.h"
+
+// Older headers lack the zero-copy definitions; the kernel ignores (or
+//   rejects, which we handle) them where unsupported
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+#define NET_DEST_LENGTH 64
+#define NET_MAX_PKTS ((VALID_DATA_BYTES + NET_MIN_PKT_BYTES - sizeof (net_pkt_header_t) - 1) / \
+                      (NET_MIN_PKT_BYTES - sizeof (net_pkt_header_t)))
+// A block may not be freed until the kernel is done with its pages
+#define ZC_WAIT_MS 1000
+// Attempts to send a batch the kernel has no buffer space for
+#define SEND_RETRIES 10
+
+typedef struct net_config {
+    char dest[NET_DEST_LENGTH];
+    int port;
+    int tcp;
+    int pkt_bytes;
+    int zerocopy;
+} net_config_t;
+
+typedef struct net_state {
+    net_config_t cfg;
+    int sock;
+    // Whether MSG_ZEROCOPY is in use on sock
+    int zc;
+    // Zero-copy sends made and completed (the kernel numbers them from 0)
+    uint32_t zc_sent;
+    uint32_t zc_done;
+    int zc_copied;
+    // When the last connection attempt failed
+    time_t retry_at;
+
+    uint32_t pkt_seq;
+    uint32_t block_seq;
+
+    // Counters since the last report
+    uint64_t pkts_sent;
+    uint64_t pkts_dropped;
+    uint64_t bytes_sent;
+
+    net_pkt_header_t hdrs[NET_MAX_PKTS];
+    struct iovec iov[NET_MAX_PKTS][2];
+    struct mmsghdr msgs[NET_MAX_PKTS];
+} net_state_t;
+
+static int init(struct hashpipe_thread_args *args)
+{
+    hashpipe_status_t st = args->st;
+
+    hashpipe_status_lock_safe(&st);
+    hputs(st.buf, "NETDEST", "127.0.0.1");
+    hputi4(st.buf, "NETPORT", NET_DEFAULT_PORT);
+    hputs(st.buf, "NETPROTO", "udp");
+    hputi4(st.buf, "NETPKT", NET_DEFAULT_PKT_BYTES);
+    hputi4(st.buf, "NETZCOPY", 1);
+    hashpipe_status_unlock_safe(&st);
+
+    return 0;
+}
+
+static void read_config(hashpipe_status_t *st, net_config_t *cfg)
+{
+    char proto[8] = "udp";
+
+    hashpipe_status_lock_safe(st);
+    hgets(st->buf, "NETDEST", sizeof (cfg->dest), cfg->dest);
+    hgeti4(st->buf, "NETPORT", &cfg->port);
+    hgets(st->buf, "NETPROTO", sizeof (proto), proto);
+    hgeti4(st->buf, "NETPKT", &cfg->pkt_bytes);
+    hgeti4(st->buf, "NETZCOPY", &cfg->zerocopy);
+    hashpipe_status_unlock_safe(st);
+
+    cfg->tcp = strcmp(proto, "tcp") == 0;
+    if (cfg->pkt_bytes < NET_MIN_PKT_BYTES)
+        cfg->pkt_bytes = NET_MIN_PKT_BYTES;
+    if (cfg->pkt_bytes > NET_MAX_PKT_BYTES)
+        cfg->pkt_bytes = NET_MAX_PKT_BYTES;
+}
+
+static void net_close(net_state_t *ns)
+{
+    if (ns->sock >= 0)
+        close(ns->sock);
+    ns->sock = -1;
+    ns->zc = 0;
+    ns->zc_sent = 0;
+    ns->zc_done = 0;
+}
+
+// Connects to the configured receiver. Returns -1 (and does not try again
+//   for a second) on failure
+static int net_open(net_state_t *ns)
+{
+    struct addrinfo hints, *res;
+    char port[16];
+    int one = 1;
+    int sndbuf = 4 * 1024 * 1024;
+    int rv;
+
+    if (time(NULL) < ns->retry_at)
+        return -1;
+
+    memset(&hints, 0, sizeof (hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = ns->cfg.tcp ? SOCK_STREAM : SOCK_DGRAM;
+    snprintf(port, sizeof (port), "%d", ns->cfg.port);
+    if ((rv = getaddrinfo(ns->cfg.dest, port, &hints, &res)) != 0)
+    {
+        hashpipe_warn(__FUNCTION__, "cannot resolve %s: %s", ns->cfg.dest, gai_strerror(rv));
+        ns->retry_at = time(NULL) + 1;
+        return -1;
+    }
+
+    ns->sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (ns->sock < 0 || connect(ns->sock, res->ai_addr, res->ai_addrlen) != 0)
+    {
+        hashpipe_warn(__FUNCTION__, "cannot connect to %s:%d: %s",
+                      ns->cfg.dest, ns->cfg.port, strerror(errno));
+        freeaddrinfo(res);
+        net_close(ns);
+        ns->retry_at = time(NULL) + 1;
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    setsockopt(ns->sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf));
+    if (ns->cfg.zerocopy)
+    {
+        if (setsockopt(ns->sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof (one)) == 0)
+            ns->zc = 1;
+        else
+            hashpipe_warn(__FUNCTION__, "MSG_ZEROCOPY unavailable (%s); copying", strerror(errno));
+    }
+
+    fprintf(stderr, "net_output_thread: sending to %s:%d over %s%s\n", ns->cfg.dest, ns->cfg.port,
+            ns->cfg.tcp ? "TCP" : "UDP", ns->zc ? " with MSG_ZEROCOPY" : "");
+    return 0;
+}
+
+// Reads zero-copy completion notifications off the socket's error queue
+static void zc_reap(net_state_t *ns)
+{
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *ee;
+
+    while (1)
+    {
+        memset(&msg, 0, sizeof (msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof (control);
+        if (recvmsg(ns->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            // ICMP errors (no receiver yet, say) arrive here too
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // Completions cover the inclusive range [ee_info, ee_data]
+            if ((int32_t)(ee->ee_data + 1 - ns->zc_done) > 0)
+                ns->zc_done = ee->ee_data + 1;
+            if ((ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !ns->zc_copied)
+            {
+                // Always the case on loopback
+                fprintf(stderr, "net_output_thread: kernel copied zero-copy sends\n");
+                ns->zc_copied = 1;
+            }
+        }
+    }
+}
+
+// Waits until the kernel no longer references any block memory
+static void zc_wait(net_state_t *ns)
+{
+    struct pollfd pfd;
+    int waited = 0;
+
+    while (ns->zc && ns->zc_done != ns->zc_sent)
+    {
+        zc_reap(ns);
+        if (ns->zc_done == ns->zc_sent)
+            break;
+        if (waited >= ZC_WAIT_MS)
+        {
+            // Should not happen; reconnect rather than free pages in use
+            hashpipe_warn(__FUNCTION__, "zero-copy completions missing; reconnecting");
+            net_close(ns);
+            break;
+        }
+        // Notifications show up as POLLERR
+        pfd.fd = ns->sock;
+        pfd.events = 0;
+        poll(&pfd, 1, 1);
+        waited++;
+    }
+}
+
+// Splits a block into packets whose iovecs point straight into the ring.
+//   Returns the number of packets
+static int build_packets(net_state_t *ns, gpu_output_databuf_block_t *block)
+{
+    size_t block_bytes = block->header.valid_bytes;
+    size_t payload = ns->cfg.tcp ? block_bytes : ns->cfg.pkt_bytes - sizeof (net_pkt_header_t);
+    size_t chan_bytes = CHAN_DATA_OFFSET(1) * sizeof (float);
+    size_t offset;
+    int i;
+
+    if (block_bytes > VALID_DATA_BYTES)
+        block_bytes = VALID_DATA_BYTES;
+
+    for (i = 0, offset = 0; offset < block_bytes; i++, offset += payload)
+    {
+        net_pkt_header_t *hdr = &ns->hdrs[i];
+        size_t nbytes = block_bytes - offset < payload ? block_bytes - offset : payload;
+
+        hdr->magic = NET_MAGIC;
+        hdr->pkt_seq = ns->pkt_seq + i;
+        hdr->block_seq = ns->block_seq;
+        hdr->mcnt = block->header.mcnt;
+        hdr->scan_num = block->header.scan_num;
+        hdr->acc_len = block->header.acc_len;
+        hdr->dmjd = block->header.dmjd;
+        hdr->pkt_idx = i;
+        hdr->chan_start = offset / chan_bytes;
+        hdr->chan_stop = (offset + nbytes - 1) / chan_bytes + 1;
+        hdr->offset = offset;
+        hdr->nbytes = nbytes;
+        hdr->block_bytes = block_bytes;
+
+        ns->iov[i][0].iov_base = hdr;
+        ns->iov[i][0].iov_len = sizeof (*hdr);
+        ns->iov[i][1].iov_base = (char *)block->data + offset;
+        ns->iov[i][1].iov_len = nbytes;
+
+        memset(&ns->msgs[i], 0, sizeof (ns->msgs[i]));
+        ns->msgs[i].msg_hdr.msg_iov = ns->iov[i];
+        ns->msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    for (int j = 0; j < i; j++)
+        ns->hdrs[j].npkts = i;
+    return i;
+}
+
+static void send_udp(net_state_t *ns, int npkts)
+{
+    int flags = ns->zc ? MSG_ZEROCOPY : 0;
+    int sent = 0;
+    int retries = 0;
+    int rv;
+
+    while (sent < npkts)
+    {
+        rv = sendmmsg(ns->sock, ns->msgs + sent, npkts - sent, flags);
+        if (rv > 0)
+        {
+            for (int i = sent; i < sent + rv; i++)
+                ns->bytes_sent += ns->iov[i][1].iov_len;
+            ns->pkts_sent += rv;
+            if (ns->zc)
+                ns->zc_sent += rv;
+            sent += rv;
+            continue;
+        }
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv < 0 && (errno == ENOBUFS || errno == EAGAIN) && retries++ < SEND_RETRIES)
+        {
+            // Out of socket (or locked page) memory: let completions drain
+            zc_reap(ns);
+            usleep(100);
+            continue;
+        }
+        if (rv < 0 && errno == ECONNREFUSED)
+        {
+            // Reported for an earlier packet that found no receiver; this
+            //   one was not sent, but the next may well be
+            ns->pkts_dropped++;
+            sent++;
+            continue;
+        }
+        ns->pkts_dropped += npkts - sent;
+        break;
+    }
+}
+
+static void send_tcp(net_state_t *ns)
+{
+    struct msghdr msg;
+    struct iovec iov[2];
+    int flags = MSG_NOSIGNAL | (ns->zc ? MSG_ZEROCOPY : 0);
+    size_t left = ns->iov[0][0].iov_len + ns->iov[0][1].iov_len;
+    int retries = 0;
+    ssize_t rv;
+
+    memcpy(iov, ns->iov[0], sizeof (iov));
+    memset(&msg, 0, sizeof (msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    while (left > 0)
+    {
+        rv = sendmsg(ns->sock, &msg, flags);
+        if (rv < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == ENOBUFS || errno == EAGAIN) && retries++ < SEND_RETRIES)
+            {
+                // With MSG_ZEROCOPY, the socket's option memory is full of
+                //   completions that only reaping them frees
+                zc_reap(ns);
+                usleep(100);
+                continue;
+            }
+            hashpipe_warn(__FUNCTION__, "send failed: %s; reconnecting", strerror(errno));
+            ns->pkts_dropped++;
+            zc_wait(ns);
+            net_close(ns);
+            return;
+        }
+        if (ns->zc)
+            ns->zc_sent++;
+        retries = 0;
+        left -= rv;
+        // Skip whatever was sent
+        while (rv > 0 && msg.msg_iovlen > 0)
+        {
+            if ((size_t)rv >= msg.msg_iov->iov_len)
+            {
+                rv -= msg.msg_iov->iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+            else
+            {
+                msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + rv;
+                msg.msg_iov->iov_len -= rv;
+                rv = 0;
+            }
+        }
+    }
+    ns->pkts_sent++;
+    ns->bytes_sent += ns->iov[0][1].iov_len;
+}
+
+static void *run(hashpipe_thread_args_t * args)
+{
+    gpu_output_databuf_t *db = (gpu_output_databuf_t *)args->ibuf;
+    hashpipe_status_t st = args->st;
+    const char * status_key = args->thread_desc->skey;
+
+    int rv;
+    int block_idx = 0;
+    int npkts;
+    gpu_output_databuf_block_t *block;
+    net_config_t cfg;
+    struct timespec report_start, now;
+    double secs;
+
+    net_state_t *ns = calloc(1, sizeof (net_state_t));
+    if (ns == NULL)
+    {
+        hashpipe_error(__FUNCTION__, "out of memory");
+        return NULL;
+    }
+    ns->sock = -1;
+    read_config(&st, &ns->cfg);
+    clock_gettime(CLOCK_MONOTONIC, &report_start);
+
+    while (run_threads())
+    {
+        while ((rv=gpu_output_databuf_wait_filled(db, block_idx)) != HASHPIPE_OK)
+        {
+            if (rv==HASHPIPE_TIMEOUT) {
+                hashpipe_status_lock_safe(&st);
+                hputs(st.buf, status_key, "waiting");
+                hashpipe_status_unlock_safe(&st);
+                if (!run_threads())
+                    break;
+                continue;
+            }
+            else
+            {
+                hashpipe_error(__FUNCTION__, "error waiting for filled databuf");
+                pthread_exit(NULL);
+            }
+        }
+        if (rv != HASHPIPE_OK)
+            break;
+        gpu_output_databuf_claim(db, block_idx);
+        block = &db->block[block_idx];
+
+        // Pick up changes to the destination between scans
+        if (block->header.scan_block == 0)
+        {
+            cfg = ns->cfg;
+            read_config(&st, &cfg);
+            if (memcmp(&cfg, &ns->cfg, sizeof (cfg)) != 0)
+            {
+                zc_wait(ns);
+                net_close(ns);
+                ns->cfg = cfg;
+            }
+        }
+
+        hashpipe_status_lock_safe(&st);
+        hputs(st.buf, status_key, "sending");
+        hashpipe_status_unlock_safe(&st);
+
+        if (ns->sock >= 0 || net_open(ns) == 0)
+        {
+            npkts = build_packets(ns, block);
+            if (ns->cfg.tcp)
+                send_tcp(ns);
+            else
+                send_udp(ns, npkts);
+            ns->pkt_seq += npkts;
+            // The block's pages must not be reused while the kernel may
+            //   still be reading them
+            zc_wait(ns);
+        }
+        else
+        {
+            ns->pkts_dropped++;
+        }
+        ns->block_seq++;
+
+        __atomic_store_n(&block->header.chans_ready, 0, __ATOMIC_RELEASE);
+        clock_gettime(CLOCK_MONOTONIC, &block->header.freed);
+        gpu_output_databuf_set_free(db, block_idx);
+        block_idx = (block_idx + 1) % NUM_BLOCKS;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        secs = ELAPSED_NS(report_start, now) / 1e9;
+        if (secs >= 1.0)
+        {
+            hashpipe_status_lock_safe(&st);
+            hputi4(st.buf, "NETSENT", ns->pkts_sent);
+            hputi4(st.buf, "NETDROP", ns->pkts_dropped);
+            hputr4(st.buf, "NETGBPS", ns->bytes_sent * 8 / secs / 1e9);
+            hashpipe_status_unlock_safe(&st);
+            ns->pkts_sent = 0;
+            ns->pkts_dropped = 0;
+            ns->bytes_sent = 0;
+            report_start = now;
+        }
+
+        pthread_testcancel();
+    }
+
+    zc_wait(ns);
+    net_close(ns);
+    free(ns);
+    return THREAD_OK;
+}
+
+static hashpipe_thread_desc_t net_output_thread = {
+    name: "net_output_thread",
+    skey: "NETSTAT",
+    init: init,
+    run:  run,
+    ibuf_desc: {gpu_output_databuf_create},
+    obuf_desc: {NULL}
+};
+
+static __attribute__((constructor)) void ctor()
+{
+  register_hashpipe_thread(&net_output_thread);
+}
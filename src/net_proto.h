@@ -0,0 +1,67 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef NET_PROTO_H
+#define NET_PROTO_H
+
+#include <stdint.h>
+
+// Wire format of net_output_thread, read back by sim1_net_recv.
+//   Fields are in host byte order: both ends are expected to run on the
+//   same kind of machine
+
+// "SIM1"
+#define NET_MAGIC 0x53494d31
+
+#define NET_DEFAULT_PORT 60000
+// Fills a 9000 byte jumbo frame after the IP and UDP headers
+#define NET_DEFAULT_PKT_BYTES 8972
+#define NET_MIN_PKT_BYTES 256
+#define NET_MAX_PKT_BYTES 65507
+
+// Every UDP datagram starts with this header, followed by nbytes of a
+//   block's data starting at byte offset. Over TCP each block is sent as a
+//   single "packet" holding all of its data
+typedef struct net_pkt_header {
+    uint32_t magic;
+    // Counts every packet sent, so that the receiver can spot losses
+    uint32_t pkt_seq;
+    // Counts every block sent
+    uint32_t block_seq;
+    // Copied from the block header
+    int32_t mcnt;
+    int32_t scan_num;
+    int32_t acc_len;
+    double dmjd;
+    // The packet's place within its block
+    uint16_t pkt_idx;
+    uint16_t npkts;
+    // The channels (at least partly) carried by this packet
+    uint16_t chan_start;
+    uint16_t chan_stop;
+    uint32_t offset;
+    uint32_t nbytes;
+    // Bytes of data in the whole block
+    uint32_t block_bytes;
+} net_pkt_header_t;
+
+#endif
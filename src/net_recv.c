@@ -0,0 +1,380 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+// sim1_net_recv: receives the stream sent by net_output_thread,
+//   reassembles the blocks and reports throughput and losses once a second.
+//
+// usage: sim1_net_recv [-t] [-p port] [-d seconds] [-r rcvbuf_bytes] [-o capture]
+//     -t  listen for a TCP connection instead of UDP datagrams
+//     -o  write every complete block's data, one after another, to capture
+//         (replacing any earlier contents), which fake_gpu_thread can
+//         replay (SRCMODE=REPLAY)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "net_proto.h"
+
+#define BATCH 64
+#define MAX_BLOCK_BYTES (16 * 1024 * 1024)
+// One second receive timeouts to wait through in the middle of a TCP block
+#define STALL_SECS 10
+
+typedef struct stats {
+    uint64_t pkts;
+    uint64_t bytes;
+    uint64_t lost;
+    uint64_t reordered;
+    uint64_t blocks;
+    uint64_t partial;
+    int32_t last_mcnt;
+} stats_t;
+
+// The block currently being put back together
+typedef struct assembly {
+    int active;
+    uint32_t block_seq;
+    uint16_t npkts;
+    uint16_t got;
+    unsigned char seen[65536 / 8];
+    uint32_t block_bytes;
+    char *data;
+    // Where complete blocks are saved, if anywhere
+    FILE *capture;
+} assembly_t;
+
+static double now_secs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(stats_t *s, double secs)
+{
+    printf("%8.3f Gb/s %8" PRIu64 " pkts %6" PRIu64 " lost %6" PRIu64 " reordered "
+           "%6" PRIu64 " blocks %4" PRIu64 " partial  mcnt %d\n",
+           s->bytes * 8 / secs / 1e9, s->pkts, s->lost, s->reordered,
+           s->blocks, s->partial, s->last_mcnt);
+    fflush(stdout);
+    memset(s, 0, sizeof (*s) - sizeof (s->last_mcnt));
+}
+
+static void finish_block(assembly_t *a, stats_t *s)
+{
+    if (!a->active)
+        return;
+    if (a->got == a->npkts)
+    {
+        s->blocks++;
+        if (a->capture != NULL)
+            fwrite(a->data, a->block_bytes, 1, a->capture);
+    }
+    else
+    {
+        s->partial++;
+    }
+    a->active = 0;
+}
+
+static void add_packet(assembly_t *a, stats_t *s, uint32_t *next_seq,
+                       const net_pkt_header_t *hdr, const char *payload)
+{
+    if ((int32_t)(hdr->pkt_seq - *next_seq) > 0)
+        s->lost += hdr->pkt_seq - *next_seq;
+    else if (hdr->pkt_seq != *next_seq)
+        s->reordered++;
+    if ((int32_t)(hdr->pkt_seq + 1 - *next_seq) > 0)
+        *next_seq = hdr->pkt_seq + 1;
+
+    s->pkts++;
+    s->bytes += hdr->nbytes;
+    s->last_mcnt = hdr->mcnt;
+
+    if (hdr->block_bytes > MAX_BLOCK_BYTES || hdr->offset + hdr->nbytes > hdr->block_bytes)
+        return;
+
+    if (!a->active || a->block_seq != hdr->block_seq)
+    {
+        // Late packets of a finished block are only counted
+        if (a->active && (int32_t)(hdr->block_seq - a->block_seq) < 0)
+            return;
+        finish_block(a, s);
+        a->active = 1;
+        a->block_seq = hdr->block_seq;
+        a->npkts = hdr->npkts;
+        a->block_bytes = hdr->block_bytes;
+        a->got = 0;
+        memset(a->seen, 0, sizeof (a->seen));
+    }
+
+    if (!(a->seen[hdr->pkt_idx / 8] & (1 << (hdr->pkt_idx % 8))))
+    {
+        a->seen[hdr->pkt_idx / 8] |= 1 << (hdr->pkt_idx % 8);
+        a->got++;
+        memcpy(a->data + hdr->offset, payload, hdr->nbytes);
+    }
+    if (a->got == a->npkts)
+        finish_block(a, s);
+}
+
+static int recv_udp(int sock, double duration, assembly_t *a)
+{
+    static char bufs[BATCH][NET_MAX_PKT_BYTES];
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+    struct timeval tv = {1, 0};
+    stats_t s;
+    uint32_t next_seq = 0;
+    int first = 1;
+    double start = now_secs(), last = start;
+    int n, i;
+
+    memset(&s, 0, sizeof (s));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+    while (duration <= 0 || now_secs() - start < duration)
+    {
+        for (i = 0; i < BATCH; i++)
+        {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = sizeof (bufs[i]);
+            memset(&msgs[i], 0, sizeof (msgs[i]));
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        n = recvmmsg(sock, msgs, BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            perror("recvmmsg");
+            return 1;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            net_pkt_header_t *hdr = (net_pkt_header_t *)bufs[i];
+            if (msgs[i].msg_len < sizeof (*hdr) || hdr->magic != NET_MAGIC ||
+                msgs[i].msg_len - sizeof (*hdr) != hdr->nbytes)
+                continue;
+            if (first)
+            {
+                next_seq = hdr->pkt_seq;
+                first = 0;
+            }
+            add_packet(a, &s, &next_seq, hdr, bufs[i] + sizeof (*hdr));
+        }
+
+        if (now_secs() - last >= 1.0)
+        {
+            report(&s, now_secs() - last);
+            last = now_secs();
+        }
+    }
+    finish_block(a, &s);
+    if (s.pkts > 0)
+        report(&s, now_secs() - last);
+    return 0;
+}
+
+// Reads exactly len bytes. Returns 0 on success, -2 if the receive timeout
+//   expired before anything was read and -1 on error. Once the first byte
+//   of a block is in, timeouts are waited through (up to STALL_SECS of
+//   them, then the connection is given up) rather than returned, since
+//   bytes already read cannot be put back
+static int read_full(int sock, char *buf, size_t len, int in_block)
+{
+    ssize_t rv;
+    int stalls = 0;
+
+    while (len > 0)
+    {
+        rv = recv(sock, buf, len, 0);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv < 0 && errno == EAGAIN)
+        {
+            if (!in_block)
+                return -2;
+            if (++stalls > STALL_SECS)
+            {
+                fprintf(stderr, "Sender stalled in the middle of a block\n");
+                return -1;
+            }
+            continue;
+        }
+        if (rv <= 0)
+            return -1;
+        buf += rv;
+        len -= rv;
+        in_block = 1;
+    }
+    return 0;
+}
+
+static int recv_tcp(int lsock, double duration, assembly_t *a)
+{
+    net_pkt_header_t hdr;
+    struct timeval tv = {1, 0};
+    stats_t s;
+    uint32_t next_block = 0;
+    double start = now_secs(), last = start;
+    int sock = -1;
+    int rv;
+
+    memset(&s, 0, sizeof (s));
+    listen(lsock, 1);
+    // accept() honours this too, so that the duration is checked
+    setsockopt(lsock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+    while (duration <= 0 || now_secs() - start < duration)
+    {
+        if (sock < 0)
+        {
+            sock = accept(lsock, NULL, NULL);
+            if (sock < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (sock < 0)
+            {
+                perror("accept");
+                return 1;
+            }
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+            fprintf(stderr, "Connected\n");
+            next_block = 0;
+        }
+
+        // Only a timeout between blocks returns to check the duration
+        rv = read_full(sock, (char *)&hdr, sizeof (hdr), 0);
+        if (rv == 0 && (hdr.magic != NET_MAGIC || hdr.nbytes > MAX_BLOCK_BYTES))
+            rv = -1;
+        if (rv == 0)
+            rv = read_full(sock, a->data, hdr.nbytes, 1);
+        if (rv == -1)
+        {
+            report(&s, now_secs() - last);
+            last = now_secs();
+            fprintf(stderr, "Connection closed\n");
+            close(sock);
+            sock = -1;
+        }
+        else if (rv == 0)
+        {
+            // TCP does not lose data, but the sender may drop blocks
+            if (next_block != 0 && hdr.block_seq != next_block)
+                s.lost += hdr.block_seq - next_block;
+            next_block = hdr.block_seq + 1;
+            s.pkts++;
+            s.bytes += hdr.nbytes;
+            s.blocks++;
+            s.last_mcnt = hdr.mcnt;
+            if (a->capture != NULL)
+                fwrite(a->data, hdr.nbytes, 1, a->capture);
+        }
+
+        if (now_secs() - last >= 1.0)
+        {
+            report(&s, now_secs() - last);
+            last = now_secs();
+        }
+    }
+    if (sock >= 0)
+        close(sock);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int tcp = 0;
+    int port = NET_DEFAULT_PORT;
+    int rcvbuf = 32 * 1024 * 1024;
+    double duration = 0;
+    const char *capture = NULL;
+    int opt, sock, rv, one = 1;
+    struct sockaddr_in addr;
+    assembly_t a;
+
+    while ((opt = getopt(argc, argv, "tp:d:r:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't': tcp = 1; break;
+        case 'p': port = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'r': rcvbuf = atoi(optarg); break;
+        case 'o': capture = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-p port] [-d seconds] [-r rcvbuf_bytes] [-o capture]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    memset(&a, 0, sizeof (a));
+    a.data = malloc(MAX_BLOCK_BYTES);
+    if (a.data == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    if (capture != NULL && (a.capture = fopen(capture, "w")) == NULL)
+    {
+        perror(capture);
+        return 1;
+    }
+
+    sock = socket(AF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+    // Capped by net.core.rmem_max unless run as root
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+    {
+        perror("bind");
+        return 1;
+    }
+
+    fprintf(stderr, "Listening on %s port %d\n", tcp ? "TCP" : "UDP", port);
+    rv = tcp ? recv_tcp(sock, duration, &a) : recv_udp(sock, duration, &a);
+    if (a.capture != NULL)
+        fclose(a.capture);
+    return rv;
+}
@@ -0,0 +1,219 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "overrun.h"
+#include "block_kernels.h"
+#include "metrics.h"
+
+void overrun_configure(overrun_t *ov, hashpipe_status_t *st)
+{
+    char mode[16] = "BLOCK";
+
+    hashpipe_status_lock_safe(st);
+    hgets(st->buf, "OVERRUN", sizeof (mode), mode);
+    hputi4(st->buf, "DROPBLKS", 0);
+    hashpipe_status_unlock_safe(st);
+
+    if (strcasecmp(mode, "DROPNEW") == 0)
+        ov->mode = OVERRUN_DROPNEW;
+    else if (strcasecmp(mode, "DROPOLD") == 0)
+        ov->mode = OVERRUN_DROPOLD;
+    else
+    {
+        if (strcasecmp(mode, "BLOCK") != 0)
+            hashpipe_warn(__FUNCTION__, "unknown OVERRUN %s; blocking", mode);
+        ov->mode = OVERRUN_BLOCK;
+    }
+
+    ov->dropped = 0;
+    ov->nruns = 0;
+    ov->pending = 0;
+    ov->held_count = 0;
+}
+
+const char *overrun_name(const overrun_t *ov)
+{
+    switch (ov->mode)
+    {
+    case OVERRUN_DROPNEW: return "DROPNEW";
+    case OVERRUN_DROPOLD: return "DROPOLD";
+    default:              return "BLOCK";
+    }
+}
+
+static void record_drop(overrun_t *ov, hashpipe_status_t *st, int mcnt)
+{
+    ov->dropped++;
+    metrics_add(&sim1_metrics.blocks_dropped, 1);
+    if (ov->nruns > 0 && ov->runs[ov->nruns - 1].last + N == mcnt)
+        ov->runs[ov->nruns - 1].last = mcnt;
+    else if (ov->nruns < OVERRUN_MAX_RUNS)
+    {
+        ov->runs[ov->nruns].first = mcnt;
+        ov->runs[ov->nruns].last = mcnt;
+        ov->nruns++;
+    }
+
+    hashpipe_status_lock_safe(st);
+    hputi4(st->buf, "DROPBLKS", ov->dropped);
+    hputi4(st->buf, "DROPMCNT", mcnt);
+    hashpipe_status_unlock_safe(st);
+}
+
+// Blocks that consumers use to find scan boundaries
+static int is_protected(const gpu_output_databuf_block_header_t *header)
+{
+    int acc_len = header->acc_len > 0 ? header->acc_len : 1;
+    return header->scan_block == 0 || header->scan_block + acc_len >= header->scan_nblocks;
+}
+
+static void release_held(overrun_t *ov, gpu_output_databuf_t *db)
+{
+    int i;
+
+    for (i = 0; i < ov->held_count; i++)
+        __atomic_store_n(&db->block[(ov->held_first + i) % NUM_BLOCKS].header.claim, 0,
+                         __ATOMIC_RELEASE);
+    ov->held_count = 0;
+}
+
+// Claims every block from the oldest one no consumer has started on up to
+//   the newest. Consumers claim in ring order, so these are the last
+//   held_count blocks before block_idx
+static void hold_unread(overrun_t *ov, gpu_output_databuf_t *db, int block_idx)
+{
+    int k, slot, expected;
+
+    ov->held_count = 0;
+    for (k = 0; k < NUM_BLOCKS; k++)
+    {
+        slot = (block_idx + k) % NUM_BLOCKS;
+        expected = 0;
+        if (__atomic_compare_exchange_n(&db->block[slot].header.claim, &expected, -1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            if (ov->held_count == 0)
+                ov->held_first = slot;
+            ov->held_count++;
+        }
+        else if (ov->held_count > 0)
+        {
+            // The consumer got here first after all; start again after it
+            release_held(ov, db);
+        }
+    }
+}
+
+int overrun_make_room(overrun_t *ov, hashpipe_status_t *st, gpu_output_databuf_t *db,
+                      int block_idx, int mcnt)
+{
+    gpu_output_databuf_block_t *drop, *next;
+    int i, slot, carried;
+
+    if (ov->mode == OVERRUN_DROPOLD)
+    {
+        hold_unread(ov, db, block_idx);
+
+        // The oldest unread block that can go
+        for (i = 0; i < ov->held_count; i++)
+        {
+            slot = (ov->held_first + i) % NUM_BLOCKS;
+            if (!is_protected(&db->block[slot].header))
+                break;
+        }
+
+        if (i < ov->held_count)
+        {
+            drop = &db->block[slot];
+            record_drop(ov, st, drop->header.mcnt);
+            carried = drop->header.dropped + 1;
+
+            // Move the newer blocks down over it, header and all; the
+            //   block that takes its place accounts for it
+            for (i++; i < ov->held_count; i++)
+            {
+                next = &db->block[(ov->held_first + i) % NUM_BLOCKS];
+                drop->header = next->header;
+                drop->header.claim = -1;
+                drop->header.dropped += carried;
+                block_kernels->copy(block_kernels, drop->data, next->data);
+                carried = 0;
+                drop = next;
+            }
+            // The newest slot is left for the new block
+            ov->pending += carried;
+            return (block_idx + NUM_BLOCKS - 1) % NUM_BLOCKS;
+        }
+
+        // Nothing unread can be dropped; drop the new block instead
+        release_held(ov, db);
+    }
+
+    record_drop(ov, st, mcnt);
+    ov->pending++;
+    return -1;
+}
+
+void overrun_begin_fill(overrun_t *ov, gpu_output_databuf_t *db, int slot)
+{
+    gpu_output_databuf_block_header_t *header = &db->block[slot].header;
+
+    header->dropped = ov->pending;
+    ov->pending = 0;
+    header->chans_ready = 0;
+    // A slot that was free has no claim on it yet. This must be visible
+    //   before the first channel group is published
+    if (ov->held_count == 0)
+        __atomic_store_n(&header->claim, 0, __ATOMIC_RELEASE);
+}
+
+void overrun_end_fill(overrun_t *ov, gpu_output_databuf_t *db)
+{
+    if (ov->held_count > 0)
+        release_held(ov, db);
+}
+
+void overrun_report(overrun_t *ov, hashpipe_status_t *st, int nblocks)
+{
+    int i;
+
+    if (ov->dropped > 0 || ov->mode != OVERRUN_BLOCK)
+    {
+        fprintf(stderr, "Dropped %llu of %d blocks (OVERRUN=%s)\n",
+                (unsigned long long)ov->dropped, nblocks, overrun_name(ov));
+        for (i = 0; i < ov->nruns; i++)
+            fprintf(stderr, "\tmcnt %d to %d\n", ov->runs[i].first, ov->runs[i].last);
+        if (ov->nruns == OVERRUN_MAX_RUNS)
+            fprintf(stderr, "\t(any later runs are not listed)\n");
+    }
+
+    hashpipe_status_lock_safe(st);
+    hputi4(st->buf, "DROPBLKS", ov->dropped);
+    hashpipe_status_unlock_safe(st);
+
+    ov->dropped = 0;
+    ov->nruns = 0;
+}
@@ -0,0 +1,96 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+#ifndef OVERRUN_H
+#define OVERRUN_H
+
+#include <stdint.h>
+
+#include "hashpipe.h"
+#include "gpu_output_databuf.h"
+
+// What fake_gpu_thread does when its next ring block is still held by a
+//   slow consumer (OVERRUN):
+//   OVERRUN_BLOCK    wait for the block to be freed, as before; the scan
+//                    runs late instead of losing data
+//   OVERRUN_DROPNEW  drop the new block and carry on
+//   OVERRUN_DROPOLD  drop the oldest block no consumer has started on and
+//                    keep the new one in its place
+// Both dropping policies keep the producer on its deadlines, like a real
+//   correlator that cannot pause. The first and last blocks of a scan are
+//   never dropped, since consumers use them to find scan boundaries: the
+//   producer waits for those as with OVERRUN_BLOCK.
+//
+// With OVERRUN_DROPOLD the unread blocks that follow the one the consumer
+//   is on are moved down the ring by one, over the dropped block, so that
+//   they are still read in order. The producer claims them while it moves
+//   them (header.claim, see gpu_output_databuf_claim()).
+typedef enum overrun_mode {
+    OVERRUN_BLOCK,
+    OVERRUN_DROPNEW,
+    OVERRUN_DROPOLD
+} overrun_mode_t;
+
+// The number of runs of consecutive dropped mcnts kept for the scan report
+#define OVERRUN_MAX_RUNS 16
+
+typedef struct overrun {
+    overrun_mode_t mode;
+    // Blocks dropped this scan, and runs of consecutive mcnts among them
+    uint64_t dropped;
+    int nruns;
+    struct {
+        int first;
+        int last;
+    } runs[OVERRUN_MAX_RUNS];
+    // Dropped blocks not yet recorded in the header of a later block
+    int pending;
+    // Slots held while moving blocks for OVERRUN_DROPOLD
+    int held_first;
+    int held_count;
+} overrun_t;
+
+// Reads OVERRUN and clears the counts
+void overrun_configure(overrun_t *ov, hashpipe_status_t *st);
+
+const char *overrun_name(const overrun_t *ov);
+
+// Finds the slot for the next producer block when block_idx, the next
+//   one in ring order, is not free. Returns the slot to fill (always
+//   before block_idx in the ring), or -1 if the new block, with the given
+//   mcnt, is dropped
+int overrun_make_room(overrun_t *ov, hashpipe_status_t *st, gpu_output_databuf_t *db,
+                      int block_idx, int mcnt);
+
+// Sets the header fields that belong to the overrun bookkeeping on a
+//   block about to be filled
+void overrun_begin_fill(overrun_t *ov, gpu_output_databuf_t *db, int slot);
+
+// Hands back the blocks held by overrun_make_room() once the new block
+//   has been filled
+void overrun_end_fill(overrun_t *ov, gpu_output_databuf_t *db);
+
+// Prints the dropped mcnts, publishes the count and clears it
+void overrun_report(overrun_t *ov, hashpipe_status_t *st, int nblocks);
+
+#endif
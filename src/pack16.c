@@ -0,0 +1,195 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define PACK16_X86 1
+#endif
+
+#include "pack16.h"
+
+static int have_f16c = 0;
+static int have_avx2 = 0;
+
+#ifdef PACK16_X86
+static __attribute__((constructor)) void pack16_detect()
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    __builtin_cpu_init();
+    // __builtin_cpu_supports("avx") also checks that the OS saves the
+    //   YMM registers, which the bare F16C bit does not
+    if (__builtin_cpu_supports("avx") && __get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        have_f16c = (ecx & bit_F16C) != 0;
+    have_avx2 = __builtin_cpu_supports("avx2");
+}
+#endif
+
+static uint16_t float_2_half(float f)
+{
+    uint32_t x;
+    uint32_t h, rem, half;
+    int shift;
+
+    memcpy(&x, &f, sizeof (x));
+    uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t absx = x & 0x7fffffff;
+
+    // Infinity or NaN (kept quiet)
+    if (absx >= 0x7f800000)
+        return sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 : 0);
+    // 65520 and up round to infinity
+    if (absx >= 0x477ff000)
+        return sign | 0x7c00;
+    // Below 2^-14 the result is subnormal
+    if (absx < 0x38800000)
+    {
+        if (absx < 0x33000000)
+            return sign;
+        shift = 126 - (int)(absx >> 23);
+        uint32_t mant = (absx & 0x7fffff) | 0x800000;
+        h = mant >> shift;
+        rem = mant & ((1u << shift) - 1);
+        half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1)))
+            h++;
+        return sign | h;
+    }
+
+    // Rebias the exponent from 127 to 15; a carry out of the mantissa
+    //   correctly bumps the exponent
+    h = (absx - 0x38000000) >> 13;
+    rem = absx & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        h++;
+    return sign | h;
+}
+
+#ifdef PACK16_X86
+__attribute__((target("avx,f16c")))
+static size_t pack_float16_f16c(const float *src, uint16_t *dst, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        __m256 v = _mm256_loadu_ps(src + i);
+        __m128i h = _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm_storeu_si128((__m128i *)(dst + i), h);
+    }
+    return i;
+}
+
+__attribute__((target("avx")))
+static size_t max_abs_avx(const float *src, size_t n, float *max)
+{
+    size_t i;
+    __m256 sign_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 m = _mm256_setzero_ps();
+    float lanes[8];
+
+    for (i = 0; i + 8 <= n; i += 8)
+        m = _mm256_max_ps(m, _mm256_and_ps(_mm256_loadu_ps(src + i), sign_mask));
+
+    _mm256_storeu_ps(lanes, m);
+    for (int j = 0; j < 8; j++)
+        if (lanes[j] > *max)
+            *max = lanes[j];
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t pack_int16_avx2(const float *src, int16_t *dst, size_t n, float inv_scale)
+{
+    size_t i;
+    __m256 inv = _mm256_set1_ps(inv_scale);
+
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        // Round to nearest even, as lrintf() does in the default mode
+        __m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + i), inv));
+        __m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + i + 8), inv));
+        // packs works within 128 bit lanes, giving a0-3 b0-3 a4-7 b4-7
+        __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)(dst + i), p);
+    }
+    return i;
+}
+#endif
+
+void pack_float16(const float *src, uint16_t *dst, size_t n)
+{
+    size_t i = 0;
+
+#ifdef PACK16_X86
+    if (have_f16c)
+        i = pack_float16_f16c(src, dst, n);
+#endif
+    for (; i < n; i++)
+        dst[i] = float_2_half(src[i]);
+}
+
+float pack_int16_scale(const float *src, size_t n)
+{
+    size_t i = 0;
+    float max = 0.0;
+
+#ifdef PACK16_X86
+    if (have_f16c)
+        i = max_abs_avx(src, n, &max);
+#endif
+    for (; i < n; i++)
+        if (fabsf(src[i]) > max)
+            max = fabsf(src[i]);
+
+    return max > 0.0 ? max / 32767.0f : 1.0f;
+}
+
+void pack_int16(const float *src, int16_t *dst, size_t n, float scale)
+{
+    size_t i = 0;
+    float inv_scale = 1.0f / scale;
+    long v;
+
+#ifdef PACK16_X86
+    if (have_avx2)
+        i = pack_int16_avx2(src, dst, n, inv_scale);
+#endif
+    for (; i < n; i++)
+    {
+        v = lrintf(src[i] * inv_scale);
+        dst[i] = v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+    }
+}
+
+const char *pack16_isa(void)
+{
+    if (have_avx2 && have_f16c)
+        return "F16C/AVX2";
+    if (have_f16c)
+        return "F16C/AVX";
+    return "scalar";
+}
@@ -0,0 +1,47 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef PACK16_H
+#define PACK16_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Conversions used to write the DATA column at 16 bits per value. Each
+//   uses F16C/AVX2 when the CPU has them (checked once at load time) and
+//   falls back to scalar code otherwise; the results are identical.
+
+// Converts n floats to IEEE half-precision bit patterns, rounding to
+//   nearest even. Values too large for a half become infinities
+void pack_float16(const float *src, uint16_t *dst, size_t n);
+
+// Returns the scale for pack_int16() that maps the largest magnitude in
+//   src to 32767 (1.0 if src is all zeros)
+float pack_int16_scale(const float *src, size_t n);
+
+// Stores round(src[i] / scale) in dst, saturating to the int16_t range
+void pack_int16(const float *src, int16_t *dst, size_t n, float scale);
+
+// Names of the code paths in use, for logging
+const char *pack16_isa(void);
+
+#endif
@@ -0,0 +1,192 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+// sim1_read_bench: reads the same slice of every row of a scan through
+//   CFITSIO and through sim1_reader, checks that they agree and times both.
+//
+// usage: sim1_read_bench [-c chan] [-e elem] [-n nelems] [-r repeats] file.fits
+//   The slice is nelems complex elements from element elem of channel
+//   chan (default: every channel of the row). Run it twice, or cat the file
+//   to /dev/null first, to compare with the file in the page cache.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fitsio.h"
+#include "sim1_reader.h"
+
+static double elapsed_secs(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Reads the slice of every row with CFITSIO. Returns -1 on errors
+static int read_cfitsio(fitsfile *fptr, const sim1_reader_t *r, long first, long n, float *buf)
+{
+    int status = 0, anynul = 0;
+    long row;
+
+    for (row = 0; row < r->nvalid && status == 0; row++)
+    {
+        fits_read_col_cmp(fptr, 2, row + 1, first + 1, n, 0, buf, &anynul, &status);
+        __asm__ volatile("" : : "r"(buf) : "memory");
+    }
+    if (status)
+    {
+        fits_report_error(stderr, status);
+        return -1;
+    }
+    return 0;
+}
+
+static int read_mapped(const sim1_reader_t *r, int chan, long elem, long n, float *buf)
+{
+    long row;
+
+    for (row = 0; row < r->nvalid; row++)
+    {
+        if (sim1_reader_copy(r, row, chan, elem, n, buf) != 0)
+            return -1;
+        __asm__ volatile("" : : "r"(buf) : "memory");
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int chan = 0, repeats = 3;
+    long elem = 0, n = -1, first, row, nrows;
+    int opt, i, status = 0, anynul = 0, ok = 1;
+    struct timespec start;
+    double t_open, t_fits = 1e9, t_map = 1e9, t, mb;
+    fitsfile *fptr = NULL;
+    sim1_reader_t *r;
+    float *a, *b;
+
+    while ((opt = getopt(argc, argv, "c:e:n:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c': chan = atoi(optarg); break;
+        case 'e': elem = atol(optarg); break;
+        case 'n': n = atol(optarg); break;
+        case 'r': repeats = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: sim1_read_bench [-c chan] [-e elem] [-n nelems] [-r repeats] file.fits\n");
+            return 2;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "usage: sim1_read_bench [-c chan] [-e elem] [-n nelems] [-r repeats] file.fits\n");
+        return 2;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    r = sim1_reader_open(argv[optind]);
+    t_open = elapsed_secs(&start);
+    if (r == NULL)
+        return 1;
+    if (r->format != SIM1_DATA_COMPLEX)
+    {
+        fprintf(stderr, "sim1_read_bench: only OUTFMT=COMPLEX files can be compared with CFITSIO\n");
+        return 1;
+    }
+    if (n < 0)
+        n = r->nchan * r->chan_elems - chan * r->chan_elems - elem;
+    first = chan * r->chan_elems + elem;
+    if (n <= 0 || first + n > r->row_elems)
+    {
+        fprintf(stderr, "sim1_read_bench: slice is outside the rows\n");
+        return 2;
+    }
+
+    fits_open_file(&fptr, argv[optind], READONLY, &status);
+    fits_movnam_hdu(fptr, BINARY_TBL, "DATA", 0, &status);
+    if (status)
+    {
+        fits_report_error(stderr, status);
+        return 1;
+    }
+
+    a = malloc(n * 2 * sizeof (float));
+    b = malloc(n * 2 * sizeof (float));
+
+    // Both must give the same values for every row
+    for (row = 0; row < r->nvalid && status == 0; row++)
+    {
+        fits_read_col_cmp(fptr, 2, row + 1, first + 1, n, 0, a, &anynul, &status);
+        sim1_reader_copy(r, row, chan, elem, n, b);
+        if (memcmp(a, b, n * 2 * sizeof (float)) != 0)
+            ok = 0;
+    }
+    if (status)
+    {
+        fits_report_error(stderr, status);
+        return 1;
+    }
+
+    for (i = 0; i < repeats; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (read_cfitsio(fptr, r, first, n, a) != 0)
+            return 1;
+        t = elapsed_secs(&start);
+        if (t < t_fits)
+            t_fits = t;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        read_mapped(r, chan, elem, n, b);
+        t = elapsed_secs(&start);
+        if (t < t_map)
+            t_map = t;
+    }
+
+    mb = (double)r->nvalid * n * 8 / 1e6;
+    printf("scan %ld: %ld rows of %d channels, %s\n", r->scan_num, r->nvalid, r->nchan, ok ? "ok" : "FAIL");
+    printf("    open and index %.2f ms\n", t_open * 1e3);
+    printf("    slice of %ld elements from channel %d element %ld, %.1f MB in all\n", n, chan, elem, mb);
+    printf("    CFITSIO     %8.2f ms, %8.1f MB/s\n", t_fits * 1e3, mb / t_fits);
+    printf("    sim1_reader %8.2f ms, %8.1f MB/s (%.1fx)\n", t_map * 1e3, mb / t_map, t_fits / t_map);
+
+    // A time slice: the middle third of the scan, found through the index
+    if (r->nvalid > 0)
+    {
+        int32_t m0 = r->mcnt[r->nvalid / 3], m1 = r->mcnt[2 * r->nvalid / 3];
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        nrows = sim1_reader_range(r, m0, m1, &first);
+        t = elapsed_secs(&start);
+        printf("    mcnt [%d, %d) is rows %ld-%ld, found in %.2f us\n", m0, m1, first, first + nrows - 1, t * 1e6);
+    }
+
+    fits_close_file(fptr, &status);
+    sim1_reader_close(r);
+    free(a);
+    free(b);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,269 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define REPLAY_X86 1
+#endif
+
+#include "fitsio.h"
+#include "replay.h"
+
+static int have_avx2 = 0;
+
+#ifdef REPLAY_X86
+static __attribute__((constructor)) void replay_detect()
+{
+    __builtin_cpu_init();
+    have_avx2 = __builtin_cpu_supports("avx2");
+}
+#endif
+
+// Finds the DATA table of a FITS file written by fits_writer_thread and
+//   sets the row layout. Returns 0 on success
+static int locate_fits_rows(replay_t *rp)
+{
+    fitsfile *fptr;
+    int status = 0;
+    long naxis1 = 0, naxis2 = 0, tfields = 0;
+    long row_bytes = 4 + GPU_BIN_SIZE * NUM_CHANNELS * 2 * sizeof (float) + 8;
+    LONGLONG head_start, data_start, data_end;
+    char tform[FLEN_VALUE] = "";
+    char expected[FLEN_VALUE];
+
+    if (fits_open_file(&fptr, rp->filename, READONLY, &status))
+    {
+        fits_report_error(stderr, status);
+        return -1;
+    }
+
+    fits_movnam_hdu(fptr, BINARY_TBL, "DATA", 0, &status);
+    fits_read_key_lng(fptr, "NAXIS1", &naxis1, NULL, &status);
+    fits_read_key_lng(fptr, "NAXIS2", &naxis2, NULL, &status);
+    fits_read_key_lng(fptr, "TFIELDS", &tfields, NULL, &status);
+    fits_read_key(fptr, TSTRING, "TFORM2", tform, NULL, &status);
+    fits_get_hduaddrll(fptr, &head_start, &data_start, &data_end, &status);
+    if (status)
+    {
+        fits_report_error(stderr, status);
+        status = 0;
+        fits_close_file(fptr, &status);
+        return -1;
+    }
+    status = 0;
+    fits_close_file(fptr, &status);
+
+    // MCNT (1J), DATA (nC) and DMJD (1D) are all the layout we know
+    snprintf(expected, sizeof (expected), "%dC", GPU_BIN_SIZE * NUM_CHANNELS);
+    if (tfields != 3 || naxis1 != row_bytes || strcmp(tform, expected) != 0)
+    {
+        fprintf(stderr, "replay_open: %s: DATA is %s in %ld byte rows, not %s in %ld byte rows "
+                "(only uncompressed OUTFMT=COMPLEX files with NUM_CHANNELS=%d can be replayed)\n",
+                rp->filename, tform, naxis1, expected, row_bytes, NUM_CHANNELS);
+        return -1;
+    }
+
+    rp->data_offset = data_start + 4;
+    rp->row_stride = naxis1;
+    rp->nrows = naxis2;
+    rp->big_endian = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+    return 0;
+}
+
+replay_t *replay_open(const char *filename)
+{
+    replay_t *rp = calloc(1, sizeof (replay_t));
+    struct stat sb;
+    char magic[9] = "";
+
+    snprintf(rp->filename, sizeof (rp->filename), "%s", filename);
+    rp->fd = open(filename, O_RDONLY);
+    if (rp->fd < 0 || fstat(rp->fd, &sb) != 0)
+    {
+        fprintf(stderr, "replay_open: %s: %s\n", filename, strerror(errno));
+        goto fail;
+    }
+
+    if (pread(rp->fd, magic, 9, 0) == 9 && memcmp(magic, "SIMPLE  =", 9) == 0)
+    {
+        if (locate_fits_rows(rp) != 0)
+            goto fail;
+    }
+    else
+    {
+        if (sb.st_size < VALID_DATA_BYTES || sb.st_size % VALID_DATA_BYTES != 0)
+        {
+            fprintf(stderr, "replay_open: %s is neither a FITS file nor a whole number of "
+                    "%lu byte blocks\n", filename, (unsigned long)VALID_DATA_BYTES);
+            goto fail;
+        }
+        rp->data_offset = 0;
+        rp->row_stride = VALID_DATA_BYTES;
+        rp->nrows = sb.st_size / VALID_DATA_BYTES;
+        rp->big_endian = 0;
+    }
+
+    if (rp->nrows <= 0 || rp->data_offset + (rp->nrows - 1) * rp->row_stride + VALID_DATA_BYTES > (size_t)sb.st_size)
+    {
+        fprintf(stderr, "replay_open: %s holds no complete rows\n", filename);
+        goto fail;
+    }
+
+    rp->map_len = sb.st_size;
+    rp->map = mmap(NULL, rp->map_len, PROT_READ, MAP_SHARED, rp->fd, 0);
+    if (rp->map == MAP_FAILED)
+    {
+        fprintf(stderr, "replay_open: mmap(%s): %s\n", filename, strerror(errno));
+        rp->map = NULL;
+        goto fail;
+    }
+    // Aggressive readahead; replay_prefetch() also asks for the rows we
+    //   are about to need explicitly
+    madvise((void *)rp->map, rp->map_len, MADV_SEQUENTIAL);
+    replay_prefetch(rp, 0);
+    return rp;
+
+fail:
+    replay_close(rp);
+    return NULL;
+}
+
+void replay_close(replay_t *rp)
+{
+    if (rp == NULL)
+        return;
+    if (rp->map != NULL)
+        munmap((void *)rp->map, rp->map_len);
+    if (rp->fd >= 0)
+        close(rp->fd);
+    free(rp);
+}
+
+// Applies advice to the pages covering rows [first, first + n)
+static void advise_rows(const replay_t *rp, long first, long n, int advice)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = rp->data_offset + first * rp->row_stride;
+    size_t stop = rp->data_offset + (first + n - 1) * rp->row_stride + VALID_DATA_BYTES;
+
+    if (advice == MADV_DONTNEED)
+    {
+        // Only whole pages that hold nothing else we still need
+        start = (start + page - 1) / page * page;
+        stop = stop / page * page;
+    }
+    else
+    {
+        start = start / page * page;
+    }
+    if (stop > start)
+        madvise((void *)(rp->map + start), stop - start, advice);
+}
+
+void replay_prefetch(replay_t *rp, long row)
+{
+    long ahead;
+
+    row %= rp->nrows;
+    // Wrapped around to the start of the recording
+    if (row < rp->released)
+    {
+        rp->released = 0;
+        rp->advised = row;
+    }
+    if (rp->advised < row)
+        rp->advised = row;
+
+    ahead = row + REPLAY_AHEAD < rp->nrows ? row + REPLAY_AHEAD : rp->nrows;
+    if (ahead > rp->advised)
+    {
+        advise_rows(rp, rp->advised, ahead - rp->advised, MADV_WILLNEED);
+        rp->advised = ahead;
+    }
+
+    // The rows already played stay in the page cache for the next pass
+    //   (or the next replay) but needn't stay in our page tables
+    if (row > rp->released)
+    {
+        advise_rows(rp, rp->released, row - rp->released, MADV_DONTNEED);
+        rp->released = row;
+    }
+}
+
+#ifdef REPLAY_X86
+__attribute__((target("avx2")))
+static size_t bswap_avx2(const char *src, float *dst, size_t n)
+{
+    const __m256i shuf = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + 4 * i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, shuf));
+    }
+    return i;
+}
+#endif
+
+void replay_fill(const replay_t *rp, long row, float *data, int chan_start, int chan_stop)
+{
+    const char *src = rp->map + rp->data_offset + (row % rp->nrows) * rp->row_stride
+                      + CHAN_DATA_OFFSET(chan_start) * sizeof (float);
+    float *dst = data + CHAN_DATA_OFFSET(chan_start);
+    size_t n = CHAN_DATA_OFFSET(chan_stop) - CHAN_DATA_OFFSET(chan_start);
+    size_t i = 0;
+    uint32_t x;
+
+    if (!rp->big_endian)
+    {
+        memcpy(dst, src, n * sizeof (float));
+        return;
+    }
+
+#ifdef REPLAY_X86
+    if (have_avx2)
+        i = bswap_avx2(src, dst, n);
+#endif
+    for (; i < n; i++)
+    {
+        memcpy(&x, src + 4 * i, sizeof (x));
+        x = __builtin_bswap32(x);
+        memcpy(dst + i, &x, sizeof (x));
+    }
+}
+
+const char *replay_isa(void)
+{
+    return have_avx2 ? "AVX2" : "scalar";
+}
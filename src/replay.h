@@ -0,0 +1,81 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+
+#include "gpu_output_databuf.h"
+
+// A recorded scan mapped into memory for fake_gpu_thread to play back
+//   into the ring (SRCMODE=REPLAY).
+//
+// Two kinds of recording are understood:
+//   - a FITS file written by fits_writer_thread with OUTFMT=COMPLEX and no
+//     compression. Rows are read straight out of the DATA table, whose
+//     column holds the block's floats big-endian
+//   - a raw capture: back-to-back blocks of VALID_DATA_BYTES of native
+//     floats, as written by sim1_net_recv -o
+// Either way the recording must have been made with the same NUM_CHANNELS.
+//
+// The file is mapped read-only and read sequentially; replay_prefetch()
+//   keeps the kernel reading REPLAY_AHEAD rows ahead of the row being
+//   copied and drops the pages already played from the mapping.
+
+// Rows requested from the kernel ahead of the one being played
+#define REPLAY_AHEAD (2 * NUM_BLOCKS)
+
+typedef struct replay {
+    char filename[256];
+    int fd;
+    const char *map;
+    size_t map_len;
+    // Byte offset of the first row's data and the distance between rows
+    size_t data_offset;
+    size_t row_stride;
+    long nrows;
+    // Whether the floats are big-endian (FITS) rather than native
+    int big_endian;
+    // The first row not yet advised to the kernel, and the first not yet
+    //   released
+    long advised;
+    long released;
+} replay_t;
+
+// Maps a recording. Returns NULL (after reporting why) if it cannot be
+//   opened or is not in a format described above
+replay_t *replay_open(const char *filename);
+void replay_close(replay_t *rp);
+
+// Asks the kernel for the rows following row and releases those before it
+void replay_prefetch(replay_t *rp, long row);
+
+// Copies channels [chan_start, chan_stop) of row (modulo the number of
+//   rows, so that a short recording can fill a long scan) into a block's
+//   data
+void replay_fill(const replay_t *rp, long row, float *data, int chan_start, int chan_stop);
+
+// Name of the byte swap code path in use, for logging
+const char *replay_isa(void);
+
+#endif
@@ -0,0 +1,216 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "hashpipe.h"
+#include "gpu_output_databuf.h"
+#include "scan_sched.h"
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static scan_entry_t sched[SCHED_MAX_SCANS];
+static int sched_count = 0;
+// The last entry the producer will run once it has ended the schedule
+//   (-2 while it has not), and the last entry the writer has finished
+static int sched_last = -2;
+static int sched_retired = -1;
+
+// Parses the <start> field of a schedule line
+static int parse_start(const char *field, const mjd_time_t *now,
+                       const scan_entry_t *prev, mjd_time_t *start)
+{
+    char *end;
+
+    if (strcmp(field, "-") == 0)
+    {
+        if (prev == NULL)
+            return -1;
+        *start = prev->start;
+        mjd_time_add_ns(start, (int64_t)prev->length * NS_PER_SEC);
+        return 0;
+    }
+
+    if (field[0] == '+')
+    {
+        double secs = strtod(field + 1, &end);
+        if (end == field + 1 || *end != '\0' || secs < 0)
+            return -1;
+        *start = *now;
+        mjd_time_add_ns(start, (int64_t)(secs * NS_PER_SEC));
+        return 0;
+    }
+
+    const char *colon = strchr(field, ':');
+    if (colon != NULL)
+    {
+        long imjd = strtol(field, &end, 10);
+        if (end != colon || imjd < 0)
+            return -1;
+        return mjd_frac_2_mjd_time(imjd, colon + 1, start);
+    }
+
+    double dmjd = strtod(field, &end);
+    if (end == field || *end != '\0' || dmjd < 0)
+        return -1;
+    dmjd_2_mjd_time(dmjd, start);
+    return 0;
+}
+
+int scan_sched_load(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL)
+    {
+        hashpipe_error(__FUNCTION__, "could not open schedule file %s", filename);
+        return -1;
+    }
+
+    // Parse into a scratch copy so a bad file leaves the old schedule alone
+    scan_entry_t *entries = malloc(sizeof (scan_entry_t) * SCHED_MAX_SCANS);
+    int count = 0;
+    int line_num = 0;
+    char line[256];
+    char start_field[64];
+    mjd_time_t now;
+
+    get_curr_time_mjd(&now);
+
+    while (fgets(line, sizeof (line), f) != NULL)
+    {
+        line_num++;
+
+        char *p = line;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        if (count >= SCHED_MAX_SCANS)
+        {
+            hashpipe_error(__FUNCTION__, "%s: more than %d scans", filename, SCHED_MAX_SCANS);
+            count = -1;
+            break;
+        }
+
+        scan_entry_t *e = &entries[count];
+        memset(e, 0, sizeof (scan_entry_t));
+        if (sscanf(p, "%63s %d %63s", start_field, &e->length, e->name) != 3
+            || e->length <= 0
+            || parse_start(start_field, &now, count ? &entries[count - 1] : NULL, &e->start) != 0)
+        {
+            hashpipe_error(__FUNCTION__, "%s:%d: invalid schedule line", filename, line_num);
+            count = -1;
+            break;
+        }
+
+        // Entries must not overlap; the producer cannot go back in time
+        if (count > 0)
+        {
+            mjd_time_t prev_end = entries[count - 1].start;
+            mjd_time_add_ns(&prev_end, (int64_t)entries[count - 1].length * NS_PER_SEC);
+            if (mjd_time_diff_ns(&e->start, &prev_end) < 0)
+            {
+                hashpipe_error(__FUNCTION__, "%s:%d: scan starts before the previous one ends",
+                               filename, line_num);
+                count = -1;
+                break;
+            }
+        }
+
+        count++;
+    }
+    fclose(f);
+
+    if (count > 0)
+    {
+        pthread_mutex_lock(&sched_lock);
+        memcpy(sched, entries, sizeof (scan_entry_t) * count);
+        sched_count = count;
+        sched_last = -2;
+        sched_retired = -1;
+        pthread_mutex_unlock(&sched_lock);
+    }
+    free(entries);
+
+    return count > 0 ? count : -1;
+}
+
+void scan_sched_clear(void)
+{
+    pthread_mutex_lock(&sched_lock);
+    sched_count = 0;
+    pthread_mutex_unlock(&sched_lock);
+}
+
+void scan_sched_end(int last_idx)
+{
+    pthread_mutex_lock(&sched_lock);
+    sched_last = last_idx;
+    if (sched_retired >= sched_last)
+        sched_count = 0;
+    pthread_mutex_unlock(&sched_lock);
+}
+
+void scan_sched_retire(int idx)
+{
+    pthread_mutex_lock(&sched_lock);
+    if (idx > sched_retired)
+        sched_retired = idx;
+    if (sched_last != -2 && sched_retired >= sched_last)
+        sched_count = 0;
+    pthread_mutex_unlock(&sched_lock);
+}
+
+int scan_sched_count(void)
+{
+    int count;
+
+    pthread_mutex_lock(&sched_lock);
+    count = sched_count;
+    pthread_mutex_unlock(&sched_lock);
+
+    return count;
+}
+
+int scan_sched_get(int idx, scan_entry_t *entry)
+{
+    int rv = -1;
+
+    pthread_mutex_lock(&sched_lock);
+    if (idx >= 0 && idx < sched_count)
+    {
+        *entry = sched[idx];
+        rv = 0;
+    }
+    pthread_mutex_unlock(&sched_lock);
+
+    return rv;
+}
+
+int scan_sched_num_blocks(int length)
+{
+    return (PACKET_RATE * length) / N;
+}
@@ -0,0 +1,71 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef SCAN_SCHED_H
+#define SCAN_SCHED_H
+
+#include "sim_time.h"
+
+#define SCHED_MAX_SCANS 1024
+#define SCHED_NAME_LEN 64
+
+// One entry of a scan schedule
+typedef struct scan_entry {
+    mjd_time_t start;
+    // Scan length in seconds
+    int length;
+    char name[SCHED_NAME_LEN];
+} scan_entry_t;
+
+// The schedule is shared by every thread in the hashpipe process: the
+//   producer paces scans from it and the writer names and sizes files
+//   from it, both indexing it with the header's sched_idx.
+//
+// Schedule files have one scan per line:
+//     <start> <length in seconds> <name>
+//   where <start> is one of
+//     <DMJD>          e.g. 57155.588552
+//     <IMJD>:<frac>   e.g. 57155:0.588552083333333
+//     +<seconds>      relative to the time the schedule is loaded
+//     -               back to back with the end of the previous scan
+//   Blank lines and lines starting with '#' are ignored.
+// Returns the number of scans loaded, or -1 on error (the previous
+//   schedule is then left in place)
+int scan_sched_load(const char *filename);
+void scan_sched_clear(void);
+// Entries stay readable until the writer is done with them, since blocks
+//   of the last scans may still be in the ring when the producer finishes.
+//   The producer calls scan_sched_end() when it will fill no scan after
+//   last_idx (-1 if it filled none); the writer calls scan_sched_retire()
+//   once every block of entry idx is written, or, if the scan was stopped,
+//   when the next scan's first block arrives. The schedule is cleared when
+//   both have happened for the last entry
+void scan_sched_end(int last_idx);
+void scan_sched_retire(int idx);
+int scan_sched_count(void);
+// Copies entry idx into *entry. Returns 0 on success, -1 if there is no
+//   such entry
+int scan_sched_get(int idx, scan_entry_t *entry);
+// The number of blocks the producer writes for a scan of this length
+int scan_sched_num_blocks(int length);
+
+#endif
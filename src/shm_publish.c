@@ -0,0 +1,56 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hashpipe.h"
+#include "shm_publish.h"
+
+void *shm_publish_open(const char *name, size_t bytes, size_t seq_offset)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    void *p;
+
+    if (fd < 0 || ftruncate(fd, bytes) != 0)
+    {
+        hashpipe_warn(__FUNCTION__, "cannot create shared memory %s", name);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        hashpipe_warn(__FUNCTION__, "cannot map shared memory %s", name);
+        return NULL;
+    }
+
+    uint64_t *seq = (uint64_t *)((char *)p + seq_offset);
+    if (*seq & 1)
+        (*seq)++;
+    return p;
+}
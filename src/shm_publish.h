@@ -0,0 +1,39 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef SHM_PUBLISH_H
+#define SHM_PUBLISH_H
+
+#include <stddef.h>
+
+// Shared memory that a thread publishes results in for outside readers
+//   (see cov_shm_header_t and mon_shm_header_t). Readers follow a 64-bit
+//   sequence count in the header that is odd while an update is under way.
+
+// Creates (or reuses) the POSIX shared memory object name, sizes it to
+//   bytes and maps it. If a previous writer died part way through an
+//   update, the sequence count at seq_offset is moved on to the next even
+//   value so that readers' view of it keeps moving forwards. Returns NULL
+//   (after a warning) on failure
+void *shm_publish_open(const char *name, size_t bytes, size_t seq_offset);
+
+#endif
@@ -0,0 +1,541 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gpu_output_databuf.h"
+#include "sim1_reader.h"
+
+#define FITS_BLOCK 2880
+#define FITS_CARD 80
+#define MAX_COLUMNS 16
+
+// The keywords of one HDU that we use
+typedef struct hdu {
+    char xtension[72];
+    char extname[72];
+    char zdatafmt[72];
+    int naxis;
+    long naxisn[4];
+    int bitpix;
+    long pcount;
+    long gcount;
+    long theap;
+    long znfloat;
+    long scannum;
+    char scanname[72];
+    int tfields;
+    char ttype[MAX_COLUMNS][72];
+    char tform[MAX_COLUMNS][72];
+    // Bytes from the start of the HDU to its data
+    size_t header_len;
+} hdu_t;
+
+static uint32_t be32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint16_t be16(const unsigned char *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static float be_float(const unsigned char *p)
+{
+    uint32_t u = be32(p);
+    float f;
+
+    memcpy(&f, &u, sizeof (f));
+    return f;
+}
+
+static float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t man = h & 0x3ff;
+    uint32_t u;
+    float f;
+
+    if (exp == 0x1f)
+        u = sign | 0x7f800000 | (man << 13);
+    else if (exp != 0)
+        u = sign | ((exp + 112) << 23) | (man << 13);
+    else if (man == 0)
+        u = sign;
+    else
+    {
+        // Subnormal: normalize it
+        exp = 113;
+        while (!(man & 0x400))
+        {
+            man <<= 1;
+            exp--;
+        }
+        u = sign | (exp << 23) | ((man & 0x3ff) << 13);
+    }
+    memcpy(&f, &u, sizeof (f));
+    return f;
+}
+
+// Copies a card's value, without quotes or trailing blanks, into val
+static void card_value(const char *card, char *val, size_t size)
+{
+    const char *p = card + 10;
+    const char *end = card + FITS_CARD;
+    size_t n = 0;
+
+    while (p < end && *p == ' ')
+        p++;
+    if (p < end && *p == '\'')
+    {
+        for (p++; p < end && *p != '\'' && n + 1 < size; p++)
+            val[n++] = *p;
+    }
+    else
+    {
+        for (; p < end && *p != '/' && n + 1 < size; p++)
+            val[n++] = *p;
+    }
+    while (n > 0 && val[n - 1] == ' ')
+        n--;
+    val[n] = '\0';
+}
+
+// Reads the header of the HDU at map + off. Returns -1 if it has no END
+static int read_hdu(const unsigned char *map, size_t len, size_t off, hdu_t *h)
+{
+    const char *card;
+    char key[9], val[72];
+    size_t pos;
+    int i, n;
+
+    memset(h, 0, sizeof (*h));
+    h->gcount = 1;
+    h->theap = -1;
+
+    for (pos = off; pos + FITS_CARD <= len; pos += FITS_CARD)
+    {
+        card = (const char *)map + pos;
+        memcpy(key, card, 8);
+        key[8] = '\0';
+        for (i = 7; i >= 0 && key[i] == ' '; i--)
+            key[i] = '\0';
+
+        if (strcmp(key, "END") == 0)
+        {
+            pos += FITS_CARD;
+            h->header_len = ((pos - off + FITS_BLOCK - 1) / FITS_BLOCK) * FITS_BLOCK;
+            return 0;
+        }
+        if (card[8] != '=')
+            continue;
+        card_value(card, val, sizeof (val));
+
+        if (strcmp(key, "XTENSION") == 0)
+            strcpy(h->xtension, val);
+        else if (strcmp(key, "EXTNAME") == 0)
+            strcpy(h->extname, val);
+        else if (strcmp(key, "ZDATAFMT") == 0)
+            strcpy(h->zdatafmt, val);
+        else if (strcmp(key, "SCANNAME") == 0)
+            strcpy(h->scanname, val);
+        else if (strcmp(key, "SCANNUM") == 0)
+            h->scannum = atol(val);
+        else if (strcmp(key, "BITPIX") == 0)
+            h->bitpix = atoi(val);
+        else if (strcmp(key, "NAXIS") == 0)
+            h->naxis = atoi(val);
+        else if (strcmp(key, "PCOUNT") == 0)
+            h->pcount = atol(val);
+        else if (strcmp(key, "GCOUNT") == 0)
+            h->gcount = atol(val);
+        else if (strcmp(key, "THEAP") == 0)
+            h->theap = atol(val);
+        else if (strcmp(key, "ZNFLOAT") == 0)
+            h->znfloat = atol(val);
+        else if (strcmp(key, "TFIELDS") == 0)
+            h->tfields = atoi(val);
+        else if (sscanf(key, "NAXIS%d", &n) == 1 && n >= 1 && n <= 4)
+            h->naxisn[n - 1] = atol(val);
+        else if (sscanf(key, "TTYPE%d", &n) == 1 && n >= 1 && n <= MAX_COLUMNS)
+            strcpy(h->ttype[n - 1], val);
+        else if (sscanf(key, "TFORM%d", &n) == 1 && n >= 1 && n <= MAX_COLUMNS)
+            strcpy(h->tform[n - 1], val);
+    }
+    return -1;
+}
+
+// Bytes in the data unit of an HDU, rounded up to whole FITS blocks
+static size_t data_len(const hdu_t *h)
+{
+    size_t n = 0;
+    int i;
+
+    if (h->naxis > 0)
+    {
+        n = h->bitpix < 0 ? -h->bitpix / 8 : h->bitpix / 8;
+        for (i = 0; i < h->naxis && i < 4; i++)
+            n *= h->naxisn[i];
+        n = (n + h->pcount) * h->gcount;
+    }
+    return ((n + FITS_BLOCK - 1) / FITS_BLOCK) * FITS_BLOCK;
+}
+
+// Bytes a binary table column of the given TFORM takes in a row, and its
+//   repeat count and type
+static long column_bytes(const char *tform, long *repeat, char *type)
+{
+    char *end;
+    long r = strtol(tform, &end, 10);
+
+    if (end == tform)
+        r = 1;
+    *repeat = r;
+    *type = *end;
+    switch (*end)
+    {
+    case 'L': case 'B': case 'A': return r;
+    case 'X': return (r + 7) / 8;
+    case 'I': return 2 * r;
+    case 'J': case 'E': return 4 * r;
+    case 'K': case 'D': case 'C': case 'P': return 8 * r;
+    case 'M': case 'Q': return 16 * r;
+    default: return -1;
+    }
+}
+
+static int fail(sim1_reader_t *r, const char *filename, const char *why)
+{
+    fprintf(stderr, "sim1_reader_open: %s: %s\n", filename, why);
+    sim1_reader_close(r);
+    return 0;
+}
+
+// Indexes the rows by mcnt. Rows are written in order of mcnt, so the
+//   first row after the first whose mcnt does not increase was never
+//   written (the table is sized for the whole scan up front)
+static int build_index(sim1_reader_t *r)
+{
+    long i;
+    int32_t m;
+
+    r->mcnt = malloc((r->nrows > 0 ? r->nrows : 1) * sizeof (int32_t));
+    if (r->mcnt == NULL)
+        return -1;
+    for (i = 0; i < r->nrows; i++)
+    {
+        m = (int32_t)be32(r->rows + i * r->row_bytes + r->mcnt_off);
+        if (i > 0 && m <= r->mcnt[i - 1])
+            break;
+        r->mcnt[i] = m;
+    }
+    r->nvalid = i;
+    return 0;
+}
+
+sim1_reader_t *sim1_reader_open(const char *filename)
+{
+    sim1_reader_t *r = calloc(1, sizeof (sim1_reader_t));
+    struct stat sb;
+    hdu_t h;
+    size_t off = 0, data_start;
+    long col_off, bytes, repeat, data_repeat = 0;
+    char type, data_type = 0;
+    int fd, i;
+
+    if (r == NULL)
+        return NULL;
+    r->scale_off = -1;
+    r->mcnt_off = r->data_off = r->dmjd_off = -1;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &sb) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        fail(r, filename, strerror(errno));
+        return NULL;
+    }
+    r->map_len = sb.st_size;
+    r->map = r->map_len > 0 ? mmap(NULL, r->map_len, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (r->map == MAP_FAILED)
+    {
+        r->map = NULL;
+        fail(r, filename, "cannot map the file");
+        return NULL;
+    }
+
+    // The primary header has the scan; the table follows
+    if (read_hdu(r->map, r->map_len, 0, &h) != 0)
+    {
+        fail(r, filename, "not a FITS file");
+        return NULL;
+    }
+    r->scan_num = h.scannum;
+    strcpy(r->scan_name, h.scanname);
+    off = h.header_len + data_len(&h);
+
+    while (1)
+    {
+        if (off >= r->map_len || read_hdu(r->map, r->map_len, off, &h) != 0)
+        {
+            fail(r, filename, "no DATA table");
+            return NULL;
+        }
+        if (strcmp(h.xtension, "BINTABLE") == 0 && strcmp(h.extname, "DATA") == 0)
+            break;
+        off += h.header_len + data_len(&h);
+    }
+
+    data_start = off + h.header_len;
+    r->row_bytes = h.naxisn[0];
+    r->nrows = h.naxisn[1];
+    r->rows = r->map + data_start;
+    r->heap = r->rows + (h.theap >= 0 ? (size_t)h.theap : r->row_bytes * r->nrows);
+    r->heap_len = h.pcount - (h.theap >= 0 ? h.theap - (long)(r->row_bytes * r->nrows) : 0);
+    if (data_start + r->row_bytes * r->nrows + (r->heap_len > 0 ? r->heap_len : 0) > r->map_len)
+    {
+        fail(r, filename, "file is shorter than its DATA table");
+        return NULL;
+    }
+
+    // Find the columns
+    col_off = 0;
+    for (i = 0; i < h.tfields && i < MAX_COLUMNS; i++)
+    {
+        bytes = column_bytes(h.tform[i], &repeat, &type);
+        if (bytes < 0)
+        {
+            fail(r, filename, "unknown TFORM");
+            return NULL;
+        }
+        if (strcmp(h.ttype[i], "MCNT") == 0 && type == 'J')
+            r->mcnt_off = col_off;
+        else if (strcmp(h.ttype[i], "DMJD") == 0 && type == 'D')
+            r->dmjd_off = col_off;
+        else if (strcmp(h.ttype[i], "SCALE") == 0 && type == 'E')
+            r->scale_off = col_off;
+        else if (strcmp(h.ttype[i], "DATA") == 0)
+        {
+            r->data_off = col_off;
+            data_repeat = repeat;
+            data_type = type;
+        }
+        col_off += bytes;
+    }
+    if (r->mcnt_off < 0 || r->data_off < 0 || r->dmjd_off < 0 || (size_t)col_off != r->row_bytes)
+    {
+        fail(r, filename, "DATA table does not have fits_writer_thread's columns");
+        return NULL;
+    }
+
+    // A row holds GPU_BIN_SIZE elements per channel, but the channels are
+    //   packed NONZERO_BIN_SIZE apart with the padding after the last one
+    r->chan_elems = NONZERO_BIN_SIZE;
+    if (data_type == 'C')
+    {
+        r->format = SIM1_DATA_COMPLEX;
+        r->row_elems = data_repeat;
+    }
+    else if (data_type == 'I' && strcmp(h.zdatafmt, "FLOAT16") == 0)
+    {
+        r->format = SIM1_DATA_FLOAT16;
+        r->row_elems = data_repeat / 2;
+    }
+    else if (data_type == 'I' && strcmp(h.zdatafmt, "SCALED_INT16") == 0 && r->scale_off >= 0)
+    {
+        r->format = SIM1_DATA_SCALED_INT16;
+        r->row_elems = data_repeat / 2;
+    }
+    else if (data_type == 'P' && strcmp(h.zdatafmt, "SHUFFLE4_ZLIB") == 0)
+    {
+        r->format = SIM1_DATA_SHUFFLE_ZLIB;
+        r->row_elems = h.znfloat / 2;
+    }
+    else
+    {
+        fail(r, filename, "unknown DATA format");
+        return NULL;
+    }
+    if (r->format != SIM1_DATA_SCALED_INT16)
+        r->scale_off = -1;
+    r->nchan = r->row_elems / GPU_BIN_SIZE;
+    if (r->nchan < 1 || r->row_elems % GPU_BIN_SIZE != 0)
+    {
+        fail(r, filename, "DATA is not a whole number of channels");
+        return NULL;
+    }
+
+    if (build_index(r) != 0)
+    {
+        fail(r, filename, "out of memory");
+        return NULL;
+    }
+    return r;
+}
+
+void sim1_reader_close(sim1_reader_t *r)
+{
+    if (r == NULL)
+        return;
+    if (r->map != NULL)
+        munmap((void *)r->map, r->map_len);
+    free(r->mcnt);
+    free(r);
+}
+
+long sim1_reader_find(const sim1_reader_t *r, int32_t mcnt)
+{
+    long lo = 0, hi = r->nvalid, mid;
+
+    // The first row after mcnt; the one before it holds mcnt
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (r->mcnt[mid] <= mcnt)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+long sim1_reader_range(const sim1_reader_t *r, int32_t mcnt_start, int32_t mcnt_stop, long *first)
+{
+    long a = sim1_reader_find(r, mcnt_start - 1) + 1;
+    long b = sim1_reader_find(r, mcnt_stop - 1) + 1;
+
+    *first = a;
+    return b > a ? b - a : 0;
+}
+
+double sim1_reader_dmjd(const sim1_reader_t *r, long row)
+{
+    const unsigned char *p;
+    uint64_t u;
+    double d;
+
+    if (row < 0 || row >= r->nvalid)
+        return NAN;
+    p = r->rows + row * r->row_bytes + r->dmjd_off;
+    u = ((uint64_t)be32(p) << 32) | be32(p + 4);
+    memcpy(&d, &u, sizeof (d));
+    return d;
+}
+
+float sim1_reader_scale(const sim1_reader_t *r, long row, int chan)
+{
+    if (row < 0 || row >= r->nvalid || chan < 0 || chan >= r->nchan)
+        return NAN;
+    if (r->scale_off < 0)
+        return 1.0f;
+    return be_float(r->rows + row * r->row_bytes + r->scale_off + chan * 4);
+}
+
+const void *sim1_reader_elems(const sim1_reader_t *r, long row, int chan, long elem)
+{
+    long e = chan * r->chan_elems + elem;
+
+    if (r->format == SIM1_DATA_SHUFFLE_ZLIB || row < 0 || row >= r->nvalid ||
+        chan < 0 || chan >= r->nchan || elem < 0 || e >= r->row_elems)
+        return NULL;
+    return r->rows + row * r->row_bytes + r->data_off +
+        e * (r->format == SIM1_DATA_COMPLEX ? 8 : 4);
+}
+
+const void *sim1_reader_compressed(const sim1_reader_t *r, long row, size_t *len)
+{
+    const unsigned char *desc;
+    uint32_t n, heap_off;
+
+    if (r->format != SIM1_DATA_SHUFFLE_ZLIB || row < 0 || row >= r->nvalid)
+        return NULL;
+    // A P descriptor is the byte count and heap offset, both int32
+    desc = r->rows + row * r->row_bytes + r->data_off;
+    n = be32(desc);
+    heap_off = be32(desc + 4);
+    if ((size_t)heap_off + n > r->heap_len)
+        return NULL;
+    *len = n;
+    return r->heap + heap_off;
+}
+
+int sim1_reader_copy(const sim1_reader_t *r, long row, int chan, long elem, long nelems, float *dst)
+{
+    const unsigned char *p = sim1_reader_elems(r, row, chan, elem);
+    long first = chan * r->chan_elems + elem;
+    long i;
+    int c;
+    float scale;
+
+    if (p == NULL || nelems < 0 || first + nelems > r->row_elems)
+        return -1;
+
+    if (r->format == SIM1_DATA_COMPLEX)
+    {
+        for (i = 0; i < nelems * 2; i++)
+            dst[i] = be_float(p + i * 4);
+    }
+    else if (r->format == SIM1_DATA_FLOAT16)
+    {
+        for (i = 0; i < nelems * 2; i++)
+            dst[i] = half_to_float(be16(p + i * 2));
+    }
+    else
+    {
+        // Each channel has its own scale
+        for (i = 0; i < nelems; i++)
+        {
+            c = (first + i) / r->chan_elems;
+            scale = sim1_reader_scale(r, row, c < r->nchan ? c : r->nchan - 1);
+            dst[2 * i] = (int16_t)be16(p + i * 4) * scale;
+            dst[2 * i + 1] = (int16_t)be16(p + i * 4 + 2) * scale;
+        }
+    }
+    return 0;
+}
+
+void sim1_reader_prefetch(const sim1_reader_t *r, long first, long nrows)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t start, end;
+
+    if (first < 0 || nrows <= 0 || first >= r->nrows)
+        return;
+    if (first + nrows > r->nrows)
+        nrows = r->nrows - first;
+    start = (uintptr_t)(r->rows + first * r->row_bytes) & ~(uintptr_t)(page - 1);
+    end = (uintptr_t)(r->rows + (first + nrows) * r->row_bytes);
+    madvise((void *)start, end - start, MADV_WILLNEED);
+}
@@ -0,0 +1,126 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+
+#ifndef SIM1_READER_H
+#define SIM1_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Random access to the scans written by fits_writer_thread without going
+//   through CFITSIO.
+//
+// sim1_reader_open() maps the whole file, finds the DATA table, its heap
+//   and the byte offset of each column once, and indexes the rows by
+//   mcnt. Rows, channels and ranges of baselines are then returned as
+//   pointers into the mapping, so reading a slice costs what the page
+//   cache costs. Values are in the file's order, big-endian; use
+//   sim1_reader_copy() to get host floats.
+//
+// Each channel holds chan_elems complex elements, xGPU's packed lower
+//   triangle (see baseline_select.h for the order), and channel c starts at
+//   element c * chan_elems of the row.
+
+typedef enum sim1_data_format {
+    // nchan * chan_elems complex floats (OUTFMT=COMPLEX)
+    SIM1_DATA_COMPLEX,
+    // The same as IEEE half-precision bit patterns, two per element
+    SIM1_DATA_FLOAT16,
+    // The same as int16, scaled by the row's SCALE of the channel
+    SIM1_DATA_SCALED_INT16,
+    // Compressed rows in the heap (COMPRESS); see ZDATAFMT
+    SIM1_DATA_SHUFFLE_ZLIB
+} sim1_data_format_t;
+
+typedef struct sim1_reader {
+    const unsigned char *map;
+    size_t map_len;
+
+    // From the primary header
+    long scan_num;
+    char scan_name[72];
+
+    sim1_data_format_t format;
+    int nchan;
+    long chan_elems;
+    // Complex elements in each row's DATA, padding included
+    long row_elems;
+    // Rows in the table, and how many of them were written and indexed.
+    //   Rows from nvalid on were reserved but never written; the accessors
+    //   below treat them as out of range
+    long nrows;
+    long nvalid;
+    // The table's first row, the length of a row, and the heap
+    const unsigned char *rows;
+    size_t row_bytes;
+    const unsigned char *heap;
+    size_t heap_len;
+    // Byte offsets of the columns within a row; scale_off is -1 unless the
+    //   format is SIM1_DATA_SCALED_INT16
+    long mcnt_off;
+    long data_off;
+    long dmjd_off;
+    long scale_off;
+
+    // The mcnt of each indexed row, ascending
+    int32_t *mcnt;
+} sim1_reader_t;
+
+// Returns NULL, after reporting why on stderr, if the file cannot be
+//   mapped or is not a scan written by fits_writer_thread
+sim1_reader_t *sim1_reader_open(const char *filename);
+void sim1_reader_close(sim1_reader_t *r);
+
+// The row holding mcnt: the last whose mcnt is at most the given one.
+//   Returns -1 if mcnt is before the first row
+long sim1_reader_find(const sim1_reader_t *r, int32_t mcnt);
+// The rows whose mcnt is in [mcnt_start, mcnt_stop). Returns the number
+//   of rows and sets *first to the first of them
+long sim1_reader_range(const sim1_reader_t *r, int32_t mcnt_start, int32_t mcnt_stop, long *first);
+
+// The DMJD of a row. Returns NAN if the row is not one of the nvalid
+//   written
+double sim1_reader_dmjd(const sim1_reader_t *r, long row);
+// The scale of a channel in SIM1_DATA_SCALED_INT16 rows; 1 otherwise.
+//   Returns NAN if the row (of the nvalid written) or channel is out of
+//   range
+float sim1_reader_scale(const sim1_reader_t *r, long row, int chan);
+
+// Element elem of channel chan of a row, where the element is 8 bytes
+//   (SIM1_DATA_COMPLEX) or 4 (the 16-bit formats). Returns NULL if the row
+//   (of the nvalid written), channel or element is out of range or the rows
+//   are compressed
+const void *sim1_reader_elems(const sim1_reader_t *r, long row, int chan, long elem);
+// The compressed bytes of a SIM1_DATA_SHUFFLE_ZLIB row, or NULL if the
+//   row is not one of the nvalid written
+const void *sim1_reader_compressed(const sim1_reader_t *r, long row, size_t *len);
+
+// Copies nelems complex elements, starting at element elem of channel chan
+//   and running on into the following channels if need be, into dst as
+//   host floats. Returns 0, or -1 if out of range or compressed
+int sim1_reader_copy(const sim1_reader_t *r, long row, int chan, long elem, long nelems, float *dst);
+
+// Asks the kernel to read the given rows ahead (MADV_WILLNEED)
+void sim1_reader_prefetch(const sim1_reader_t *r, long first, long nrows);
+
+#endif
@@ -0,0 +1,296 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "sim_time.h"
+
+// The virtual clock. Virtual scan clock time is virt_anchor_ns plus the
+//   real time since real_anchor_ns times the speed; the virtual wall clock
+//   is wall_offset_ns ahead of it. Speed 0 advances at real time between
+//   sleeps and re-anchors at the end of each one
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sim_virtual = 0;
+static double sim_speed = 1.0;
+static int64_t real_anchor_ns;
+static int64_t virt_anchor_ns;
+static int64_t wall_offset_ns;
+
+static int64_t timespec_ns(const struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+}
+
+static void ns_timespec(int64_t ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / NS_PER_SEC;
+    ts->tv_nsec = ns % NS_PER_SEC;
+}
+
+static int64_t real_now_ns(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return timespec_ns(&now);
+}
+
+// Must be called with sim_lock held
+static int64_t virt_now_ns(int64_t real_ns)
+{
+    double speed = sim_speed > 0 ? sim_speed : 1.0;
+    return virt_anchor_ns + (int64_t)((real_ns - real_anchor_ns) * speed);
+}
+
+static void mjd_time_normalize(mjd_time_t *t)
+{
+    int64_t days = t->ns / NS_PER_DAY;
+    t->ns -= days * NS_PER_DAY;
+    if (t->ns < 0)
+    {
+        t->ns += NS_PER_DAY;
+        days--;
+    }
+    t->mjd += days;
+}
+
+void timespec_2_mjd_time(const struct timespec *ts, mjd_time_t *t)
+{
+    t->mjd = ts->tv_sec / 86400 + MJD_1970_EPOCH;
+    t->ns = (int64_t)(ts->tv_sec % 86400) * NS_PER_SEC + ts->tv_nsec;
+    mjd_time_normalize(t);
+}
+
+void mjd_time_2_timespec(const mjd_time_t *t, struct timespec *ts)
+{
+    ts->tv_sec = (time_t)(t->mjd - MJD_1970_EPOCH) * 86400 + t->ns / NS_PER_SEC;
+    ts->tv_nsec = t->ns % NS_PER_SEC;
+}
+
+void dmjd_2_mjd_time(double dmjd, mjd_time_t *t)
+{
+    double mjd;
+    double frac = modf(dmjd, &mjd);
+
+    t->mjd = (int32_t)mjd;
+    t->ns = llround(frac * NS_PER_DAY);
+    mjd_time_normalize(t);
+}
+
+double mjd_time_2_dmjd(const mjd_time_t *t)
+{
+    return t->mjd + (double)t->ns / NS_PER_DAY;
+}
+
+int mjd_frac_2_mjd_time(int mjd, const char *frac, mjd_time_t *t)
+{
+    char *end;
+    double f;
+
+    errno = 0;
+    f = strtod(frac, &end);
+    if (errno || end == frac || f < 0.0 || f >= 1.0)
+        return -1;
+
+    t->mjd = mjd;
+    t->ns = llround(f * NS_PER_DAY);
+    mjd_time_normalize(t);
+    return 0;
+}
+
+void mjd_time_frac_str(const mjd_time_t *t, char *buf, size_t len)
+{
+    snprintf(buf, len, "%.15f", (double)t->ns / NS_PER_DAY);
+}
+
+void mjd_time_add_ns(mjd_time_t *t, int64_t ns)
+{
+    t->ns += ns;
+    mjd_time_normalize(t);
+}
+
+int64_t mjd_time_diff_ns(const mjd_time_t *a, const mjd_time_t *b)
+{
+    return (int64_t)(a->mjd - b->mjd) * NS_PER_DAY + (a->ns - b->ns);
+}
+
+void sim_clock_set_speed(double speed)
+{
+    int64_t real_ns;
+
+    if (speed < 0)
+        speed = 0;
+
+    pthread_mutex_lock(&sim_lock);
+    if (!sim_virtual && speed == 1.0)
+    {
+        pthread_mutex_unlock(&sim_lock);
+        return;
+    }
+
+    // Carry on from the current time, real or virtual
+    real_ns = real_now_ns(CLOCK_MONOTONIC);
+    if (sim_virtual)
+        virt_anchor_ns = virt_now_ns(real_ns);
+    else
+    {
+        virt_anchor_ns = real_ns;
+        wall_offset_ns = real_now_ns(SIM_WALL_CLOCK) - real_ns;
+        sim_virtual = 1;
+    }
+    real_anchor_ns = real_ns;
+    sim_speed = speed;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+double sim_clock_speed(void)
+{
+    return sim_speed;
+}
+
+void sim_clock_now(struct timespec *ts)
+{
+    if (!sim_virtual)
+    {
+        clock_gettime(CLOCK_MONOTONIC, ts);
+        return;
+    }
+
+    pthread_mutex_lock(&sim_lock);
+    ns_timespec(virt_now_ns(real_now_ns(CLOCK_MONOTONIC)), ts);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+int sim_clock_sleep_until(const struct timespec *ts)
+{
+    struct timespec until;
+    int64_t real_ns, target_ns;
+    int rv;
+
+    if (!sim_virtual)
+    {
+        until = *ts;
+    }
+    else
+    {
+        target_ns = timespec_ns(ts);
+        pthread_mutex_lock(&sim_lock);
+        real_ns = real_now_ns(CLOCK_MONOTONIC);
+        if (target_ns <= virt_now_ns(real_ns))
+        {
+            pthread_mutex_unlock(&sim_lock);
+            return 0;
+        }
+        if (sim_speed <= 0)
+        {
+            // Unpaced: skip straight to the deadline
+            virt_anchor_ns = target_ns;
+            real_anchor_ns = real_ns;
+            pthread_mutex_unlock(&sim_lock);
+            return 0;
+        }
+        ns_timespec(real_anchor_ns + (int64_t)((target_ns - virt_anchor_ns) / sim_speed), &until);
+        pthread_mutex_unlock(&sim_lock);
+    }
+
+    // Restart after signals; the deadline is absolute so nothing drifts
+    while ((rv = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL)) == EINTR)
+        ;
+
+    return rv;
+}
+
+int64_t sim_clock_real_ns(int64_t virtual_ns)
+{
+    if (!sim_virtual)
+        return virtual_ns;
+    if (sim_speed <= 0)
+        return 0;
+    return (int64_t)(virtual_ns / sim_speed);
+}
+
+void get_curr_time_mjd(mjd_time_t *t)
+{
+    struct timespec now;
+
+    if (sim_virtual)
+    {
+        sim_clock_now(&now);
+        ns_timespec(timespec_ns(&now) + wall_offset_ns, &now);
+    }
+    else
+    {
+        clock_gettime(SIM_WALL_CLOCK, &now);
+    }
+    timespec_2_mjd_time(&now, t);
+}
+
+int sleep_until_mjd(const mjd_time_t *t)
+{
+    struct timespec until;
+    int rv;
+
+    mjd_time_2_timespec(t, &until);
+    if (sim_virtual)
+    {
+        ns_timespec(timespec_ns(&until) - wall_offset_ns, &until);
+        return sim_clock_sleep_until(&until);
+    }
+
+    // Restart after signals; the deadline is absolute so nothing drifts
+    while ((rv = clock_nanosleep(SIM_WALL_CLOCK, TIMER_ABSTIME, &until, NULL)) == EINTR)
+        ;
+
+    return rv;
+}
+
+double timeval_2_mjd(struct timeval *tv)
+{
+    double dmjd = tv->tv_sec / 86400 + MJD_1970_EPOCH;
+
+    dmjd += (tv->tv_sec % 86400) / 86400.0;
+    dmjd += tv->tv_usec / (86400.0 * 1000000.0);
+
+    return dmjd;
+}
+
+// Converts a DMJD to a time_t (seconds since epoch)
+time_t dmjd_2_secs(double dmjd)
+{
+    double d;
+    double mjd;
+
+    d = modf(dmjd, &mjd);
+
+    return (86400 * (mjd - MJD_1970_EPOCH)) + (86400 * d);
+}
+
+// Gets the current time as a DMJD
+double get_curr_time_dmjd()
+{
+    mjd_time_t now;
+    get_curr_time_mjd(&now);
+    return mjd_time_2_dmjd(&now);
+}
@@ -0,0 +1,92 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef SIM_TIME_H
+#define SIM_TIME_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define MJD_1970_EPOCH (40587)
+#define NS_PER_SEC (1000000000LL)
+#define NS_PER_DAY (86400LL * NS_PER_SEC)
+
+// The clock that all wall-clock (MJD) times are read from and slept on.
+//   CLOCK_TAI may be used instead when every host has its TAI offset set
+//   (e.g. by ptp4l); scan start times are then interpreted as TAI
+#ifndef SIM_WALL_CLOCK
+#define SIM_WALL_CLOCK CLOCK_REALTIME
+#endif
+
+// A point in time as an integer MJD plus nanoseconds into that day.
+//   A double DMJD only resolves ~0.5 us at current dates (and the status
+//   buffer stores it with %f, i.e. ~86 ms), so this is what start times
+//   are actually compared and slept against
+typedef struct mjd_time {
+    int32_t mjd;
+    // Nanoseconds since the start of the day, always in [0, NS_PER_DAY)
+    int64_t ns;
+} mjd_time_t;
+
+void timespec_2_mjd_time(const struct timespec *ts, mjd_time_t *t);
+void mjd_time_2_timespec(const mjd_time_t *t, struct timespec *ts);
+void dmjd_2_mjd_time(double dmjd, mjd_time_t *t);
+double mjd_time_2_dmjd(const mjd_time_t *t);
+// Builds a time from an integer MJD and a decimal day fraction string
+//   such as "0.629861111111111". Returns 0 on success
+int mjd_frac_2_mjd_time(int mjd, const char *frac, mjd_time_t *t);
+// Formats the day fraction of t with 15 decimal places (sub-ns)
+void mjd_time_frac_str(const mjd_time_t *t, char *buf, size_t len);
+
+void mjd_time_add_ns(mjd_time_t *t, int64_t ns);
+// Returns a - b in nanoseconds
+int64_t mjd_time_diff_ns(const mjd_time_t *a, const mjd_time_t *b);
+
+void get_curr_time_mjd(mjd_time_t *t);
+// Sleeps on SIM_WALL_CLOCK until the given absolute time. Returns 0 once
+//   the time has been reached, or the clock_nanosleep error otherwise
+int sleep_until_mjd(const mjd_time_t *t);
+
+// Simulated time (SIMSPEED). Until sim_clock_set_speed() is first called
+//   with a speed other than 1, every time is real. From then on the wall
+//   clock (get_curr_time_mjd(), sleep_until_mjd()) and the scan clock
+//   (sim_clock_now(), sim_clock_sleep_until()) are virtual: they carry on
+//   from where the real clocks were but run speed times faster, or with
+//   speed 0 jump straight to the end of every sleep. The clock is shared
+//   by every thread in the process. Latencies between threads are still
+//   measured on CLOCK_MONOTONIC
+void sim_clock_set_speed(double speed);
+double sim_clock_speed(void);
+// The scan clock: CLOCK_MONOTONIC, or its virtual counterpart
+void sim_clock_now(struct timespec *ts);
+// Sleeps until an absolute time on the scan clock. Returns 0 once the
+//   time has been reached, or the clock_nanosleep error otherwise
+int sim_clock_sleep_until(const struct timespec *ts);
+// Returns the real time, in ns, that a span of virtual time takes to pass
+int64_t sim_clock_real_ns(int64_t virtual_ns);
+
+double timeval_2_mjd(struct timeval *tv);
+time_t dmjd_2_secs(double dmjd);
+double get_curr_time_dmjd();
+
+#endif
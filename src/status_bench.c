@@ -0,0 +1,145 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+// sim1_status_bench: compares the time spent holding the status lock for
+//   the status accesses fake_gpu_thread makes on every block, done with
+//   hget/hput and with status_cache.
+//
+// usage: sim1_status_bench [-k keys] [-n iterations]
+//     -k  number of other keys in the buffer ahead of ours (default 200;
+//         hashpipe itself and the other threads set well over 100)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "hashpipe.h"
+#include "status_cache.h"
+
+static double elapsed_secs(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// An empty status buffer holding nkeys unrelated keys and then ours
+static char *make_buffer(int nkeys)
+{
+    char *buf = malloc(HASHPIPE_STATUS_TOTAL_SIZE + 1);
+    char key[16];
+    int i;
+
+    memset(buf, ' ', HASHPIPE_STATUS_TOTAL_SIZE);
+    memcpy(buf, "END", 3);
+    buf[HASHPIPE_STATUS_TOTAL_SIZE] = '\0';
+    for (i = 0; i < nkeys; i++)
+    {
+        snprintf(key, sizeof (key), "KEY%04d", i);
+        hputi4(buf, key, i);
+    }
+    hputs(buf, "SCANSTAT", "scanning");
+    hputi4(buf, "SCANLEN", 60);
+    hputr8(buf, "STRTDMJD", 57000.5);
+    hputs(buf, "FGPUSTAT", "waiting");
+    return buf;
+}
+
+int main(int argc, char *argv[])
+{
+    int nkeys = 200, iters = 200000;
+    int opt, i, ok = 1;
+    struct timespec start;
+    double t_hget, t_cache;
+    hashpipe_status_t st;
+    char scan_status[16];
+    int scan_len = 0;
+    double dmjd = 0;
+    status_key_t k_status, k_scanstat, k_scanlen, k_strtdmjd;
+
+    while ((opt = getopt(argc, argv, "k:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'k': nkeys = atoi(optarg); break;
+        case 'n': iters = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-k keys] [-n iterations]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (nkeys > HASHPIPE_STATUS_TOTAL_SIZE / HASHPIPE_STATUS_RECORD_SIZE - 8)
+        nkeys = HASHPIPE_STATUS_TOTAL_SIZE / HASHPIPE_STATUS_RECORD_SIZE - 8;
+
+    // One pass of fake_gpu_thread's loop while scanning: each line is a
+    //   separate trip through the lock there, timed together here
+    memset(&st, 0, sizeof (st));
+    st.buf = make_buffer(nkeys);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iters; i++)
+    {
+        hputs(st.buf, "FGPUSTAT", "waiting");
+        hgets(st.buf, "SCANSTAT", sizeof (scan_status), scan_status);
+        hgeti4(st.buf, "SCANLEN", &scan_len);
+        hgetr8(st.buf, "STRTDMJD", &dmjd);
+        hputs(st.buf, "FGPUSTAT", "writing");
+    }
+    t_hget = elapsed_secs(&start) / iters;
+    free(st.buf);
+
+    st.buf = make_buffer(nkeys);
+    status_key_init(&k_status, "FGPUSTAT");
+    status_key_init(&k_scanstat, "SCANSTAT");
+    status_key_init(&k_scanlen, "SCANLEN");
+    status_key_init(&k_strtdmjd, "STRTDMJD");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < iters; i++)
+    {
+        status_key_puts(&st, &k_status, "waiting");
+        status_key_gets(&st, &k_scanstat, sizeof (scan_status), scan_status);
+        status_key_geti4(&st, &k_scanlen, &scan_len);
+        status_key_getr8(&st, &k_strtdmjd, &dmjd);
+        status_key_puts(&st, &k_status, "writing");
+    }
+    t_cache = elapsed_secs(&start) / iters;
+
+    // What was read in place must match, and what was written in place
+    //   must read back through hget
+    if (strcmp(scan_status, "scanning") != 0 || scan_len != 60 || dmjd != 57000.5)
+        ok = 0;
+    hgets(st.buf, "FGPUSTAT", sizeof (scan_status), scan_status);
+    if (strcmp(scan_status, "writing") != 0)
+        ok = 0;
+    status_key_puti4(&st, &k_scanlen, -12345);
+    scan_len = 0;
+    hgeti4(st.buf, "SCANLEN", &scan_len);
+    if (scan_len != -12345)
+        ok = 0;
+    free(st.buf);
+
+    printf("%d other keys: %s\n", nkeys, ok ? "ok" : "FAIL");
+    printf("    hget/hput     %8.1f ns per block\n", t_hget * 1e9);
+    printf("    status_cache  %8.1f ns per block\n", t_cache * 1e9);
+    return ok ? 0 : 1;
+}
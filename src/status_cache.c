@@ -0,0 +1,168 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "status_cache.h"
+
+#define CARD_LEN HASHPIPE_STATUS_RECORD_SIZE
+// Values start after "KEYWORD = "
+#define VALUE_COL 10
+
+void status_key_init(status_key_t *k, const char *name)
+{
+    char padded[9];
+
+    snprintf(k->key, sizeof (k->key), "%s", name);
+    snprintf(padded, sizeof (padded), "%-8s", k->key);
+    memcpy(k->padded, padded, sizeof (k->padded));
+    k->card = NULL;
+}
+
+// Returns the key's card, searching the buffer only if the cached
+//   position no longer holds it
+static char *find_card(hashpipe_status_t *st, status_key_t *k)
+{
+    if (k->card != NULL && k->card >= st->buf && k->card < st->buf + HASHPIPE_STATUS_TOTAL_SIZE &&
+        memcmp(k->card, k->padded, sizeof (k->padded)) == 0 && k->card[8] == '=')
+        return k->card;
+
+    k->card = ksearch(st->buf, k->key);
+    return k->card;
+}
+
+// Copies the value field of a card, without the quotes of a string,
+//   trimmed of trailing blanks
+static void card_value(const char *card, char *value, int len)
+{
+    const char *v = card + VALUE_COL;
+    const char *end = card + CARD_LEN;
+    int n = 0;
+
+    while (v < end && *v == ' ')
+        v++;
+    if (v < end && *v == '\'')
+    {
+        v++;
+        while (v < end && *v != '\'' && n < len - 1)
+            value[n++] = *v++;
+    }
+    else
+    {
+        while (v < end && *v != ' ' && *v != '/' && n < len - 1)
+            value[n++] = *v++;
+    }
+    while (n > 0 && value[n - 1] == ' ')
+        n--;
+    value[n] = '\0';
+}
+
+int status_key_gets(hashpipe_status_t *st, status_key_t *k, int len, char *value)
+{
+    char *card = find_card(st, k);
+
+    if (card == NULL)
+        return 0;
+    card_value(card, value, len);
+    return 1;
+}
+
+int status_key_geti4(hashpipe_status_t *st, status_key_t *k, int *value)
+{
+    char buf[CARD_LEN];
+    char *card = find_card(st, k);
+    double d;
+
+    if (card == NULL)
+        return 0;
+    card_value(card, buf, sizeof (buf));
+    // hgeti4() accepts values written as floating point too
+    d = strtod(buf, NULL);
+    *value = (int)(d < 0 ? d - 0.001 : d + 0.001);
+    return 1;
+}
+
+int status_key_getr8(hashpipe_status_t *st, status_key_t *k, double *value)
+{
+    char buf[CARD_LEN];
+    char *card = find_card(st, k);
+    char *p;
+
+    if (card == NULL)
+        return 0;
+    card_value(card, buf, sizeof (buf));
+    // FITS allows D exponents
+    if ((p = strpbrk(buf, "Dd")) != NULL)
+        *p = 'E';
+    *value = strtod(buf, NULL);
+    return 1;
+}
+
+// Replaces the value field of a card, blanking any comment
+static void set_value(char *card, const char *formatted)
+{
+    int n = strlen(formatted);
+
+    memcpy(card + VALUE_COL, formatted, n);
+    memset(card + VALUE_COL + n, ' ', CARD_LEN - VALUE_COL - n);
+}
+
+int status_key_puts(hashpipe_status_t *st, status_key_t *k, const char *value)
+{
+    char *card = find_card(st, k);
+    int n = strlen(value);
+    int field = n < 8 ? 8 : n;
+
+    // Quotes within the value would need escaping; leave that to hputs()
+    if (card == NULL || field + 2 > CARD_LEN - VALUE_COL || strchr(value, '\'') != NULL)
+    {
+        k->card = NULL;
+        return hputs(st->buf, k->key, value);
+    }
+
+    // Strings are left justified within quotes, padded to 8 characters
+    card[VALUE_COL] = '\'';
+    memcpy(card + VALUE_COL + 1, value, n);
+    memset(card + VALUE_COL + 1 + n, ' ', field - n);
+    card[VALUE_COL + 1 + field] = '\'';
+    memset(card + VALUE_COL + 2 + field, ' ', CARD_LEN - VALUE_COL - 2 - field);
+    return 0;
+}
+
+int status_key_puti4(hashpipe_status_t *st, status_key_t *k, int value)
+{
+    char formatted[CARD_LEN + 1];
+    char *card = find_card(st, k);
+
+    if (card == NULL)
+    {
+        k->card = NULL;
+        return hputi4(st->buf, k->key, value);
+    }
+
+    // Numbers are right justified to column 30
+    snprintf(formatted, sizeof (formatted), "%20d", value);
+    set_value(card, formatted);
+    return 0;
+}
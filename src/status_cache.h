@@ -0,0 +1,60 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef STATUS_CACHE_H
+#define STATUS_CACHE_H
+
+#include "hashpipe.h"
+
+// Cached positions of frequently used status keys.
+//
+// Every hget/hput call finds its key by scanning the status buffer card by
+//   card, while holding the status lock that every other thread and
+//   external tool also needs. A status_key_t remembers where its card was
+//   found; each access checks that the card there still carries the key
+//   (cards only move if keys are deleted) and otherwise searches again.
+//   Values are then read and written in place, in the same fixed format
+//   as hputs() and hputi4(). Keys that are missing, or string values
+//   too long for a card, fall back to the hput routines.
+//
+// As with hget/hput, the caller must hold the status lock.
+
+typedef struct status_key {
+    char key[9];
+    // The keyword padded with spaces to 8 characters, as it starts the card
+    char padded[8];
+    char *card;
+} status_key_t;
+
+void status_key_init(status_key_t *k, const char *name);
+
+// As hgets(), hgeti4() and hgetr8(): return 1 if the key was found and 0
+//   (leaving *value alone) if not
+int status_key_gets(hashpipe_status_t *st, status_key_t *k, int len, char *value);
+int status_key_geti4(hashpipe_status_t *st, status_key_t *k, int *value);
+int status_key_getr8(hashpipe_status_t *st, status_key_t *k, double *value);
+
+// As hputs() and hputi4()
+int status_key_puts(hashpipe_status_t *st, status_key_t *k, const char *value);
+int status_key_puti4(hashpipe_status_t *st, status_key_t *k, int value);
+
+#endif
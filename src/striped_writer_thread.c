@@ -0,0 +1,621 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+// Writes each scan as several FITS files on different disks, one writer
+//   thread per disk. Takes fits_writer_thread's place in the pipeline:
+// $ hashpipe -p fake_gpu -I 0 -c 3 fake_gpu_thread -c 4 striped_writer_thread
+//
+// DATADIRS lists the directories, one per stripe. The rows of a scan are
+//   dealt out round-robin: row r goes to row r / K of the part in
+//   directory r % K, where K is the number of directories. Each part is an
+//   ordinary scan file holding a subset of the rows, and a manifest in
+//   the first directory lists the parts so that they can be read back as
+//   one scan (see write_manifest()).
+//
+// Scans are followed through the block headers (scan_num, scan_block and
+//   scan_nblocks) rather than the control FIFO, and written as COMPLEX
+//   data. Each block is copied out of the ring and freed at once, so that
+//   every stripe can have a row in flight however few blocks the ring
+//   has. Since the parts are written concurrently, CFITSIO must have been
+//   built with --enable-reentrant; if it was not, only the first directory
+//   is used.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "hashpipe.h"
+#include "fitsio.h"
+#include "gpu_output_databuf.h"
+#include "fits_pool.h"
+#include "fits_writer.h"
+#include "scan_sched.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "block_kernels.h"
+
+#define STRIPE_MAX 16
+#define DATADIRS_LENGTH 1024
+
+typedef struct stripe {
+    struct striper *owner;
+    int idx;
+    pthread_t thread;
+    char dir[256];
+
+    // The open part, if any, and its rows
+    char filename[512];
+    fitsfile *fptr;
+    long nrows;
+    int rows_written;
+    // Rows that could not be written this scan
+    int rows_failed;
+    // Time spent writing rows this scan
+    uint64_t busy_ns;
+
+    // Requests from the main thread, handled in this order
+    int open_pending;
+    int close_pending;
+} stripe_t;
+
+typedef struct stripe_job {
+    // The job's own copy of the block, allocated on first use
+    gpu_output_databuf_block_t *block;
+    int stripe;
+    // Row within the stripe's part
+    int row;
+    int claimed;
+    int done;
+} stripe_job_t;
+
+typedef struct striper {
+    int nstripes;
+    stripe_t stripes[STRIPE_MAX];
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    int stop;
+
+    // Rows handed to the stripes, at most one per stripe; submitted and
+    //   retired in ring order
+    stripe_job_t jobs[STRIPE_MAX];
+    uint64_t next_submit;
+    uint64_t next_retire;
+
+    // The scan being written
+    int scan_open;
+    int scan_num;
+    int sched_idx;
+    int scan_duration;
+    char scan_name[SCHED_NAME_LEN];
+    int acc_len;
+    int rows_total;
+    struct timespec scan_start;
+} striper_t;
+
+static int stripe_has_job(striper_t *sp, int idx, stripe_job_t **job)
+{
+    uint64_t i;
+
+    for (i = sp->next_retire; i < sp->next_submit; i++)
+    {
+        stripe_job_t *j = &sp->jobs[i % STRIPE_MAX];
+        if (j->stripe == idx && !j->claimed)
+        {
+            *job = j;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void stripe_open(stripe_t *s)
+{
+    striper_t *sp = s->owner;
+    int status = 0;
+
+    s->fptr = create_fits_file(s->filename, sp->scan_duration, sp->scan_num,
+                               sp->scan_name[0] != '\0' ? sp->scan_name : NULL,
+                               FITS_DATA_COMPLEX, s->nrows, &status);
+    if (status || s->fptr == NULL)
+    {
+        hashpipe_error(__FUNCTION__, "cannot create %s; its rows will be lost", s->filename);
+        s->fptr = NULL;
+    }
+    s->rows_written = 0;
+    s->rows_failed = 0;
+    s->busy_ns = 0;
+}
+
+static void stripe_close(stripe_t *s)
+{
+    int status = 0;
+    long num_rows = 0;
+
+    if (s->fptr == NULL)
+        return;
+
+    if (s->rows_failed > 0)
+        hashpipe_warn(__FUNCTION__, "%d rows of %s could not be written", s->rows_failed, s->filename);
+
+    // Drop the rows that were reserved but never written
+    fits_get_num_rows(s->fptr, &num_rows, &status);
+    if (status == 0 && num_rows > s->rows_written)
+        fits_delete_rows(s->fptr, s->rows_written + 1, num_rows - s->rows_written, &status);
+    if (status)
+      fits_report_error(stderr, status);
+    status = 0;
+
+    fits_close_file(s->fptr, &status);
+    if (status)
+      fits_report_error(stderr, status);
+    s->fptr = NULL;
+}
+
+static void *stripe_main(void *arg)
+{
+    stripe_t *s = (stripe_t *)arg;
+    striper_t *sp = s->owner;
+    stripe_job_t *job;
+    struct timespec start, stop;
+    int written;
+
+    pthread_mutex_lock(&sp->lock);
+    while (!sp->stop)
+    {
+        if (s->open_pending)
+        {
+            pthread_mutex_unlock(&sp->lock);
+            stripe_open(s);
+            pthread_mutex_lock(&sp->lock);
+            s->open_pending = 0;
+        }
+        else if (stripe_has_job(sp, s->idx, &job))
+        {
+            job->claimed = 1;
+            pthread_mutex_unlock(&sp->lock);
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            written = 0;
+            if (s->fptr != NULL)
+            {
+                if (fits_write_row(s->fptr, job->block, job->row, FITS_DATA_COMPLEX) == 0)
+                    written = 1;
+                else
+                    s->rows_failed++;
+                // A failed row inside the part is kept (empty) so the
+                //   rows after it stay in place
+                if (job->row + 1 > s->rows_written)
+                    s->rows_written = job->row + 1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &stop);
+            s->busy_ns += ELAPSED_NS(start, stop);
+            if (written)
+            {
+                metrics_observe(&sim1_metrics.row_write, ELAPSED_NS(start, stop));
+                metrics_add(&sim1_metrics.rows_written, 1);
+                metrics_add(&sim1_metrics.bytes_written, job->block->header.valid_bytes);
+            }
+
+            pthread_mutex_lock(&sp->lock);
+            job->done = 1;
+            pthread_cond_broadcast(&sp->done_cond);
+        }
+        else if (s->close_pending)
+        {
+            pthread_mutex_unlock(&sp->lock);
+            stripe_close(s);
+            pthread_mutex_lock(&sp->lock);
+            s->close_pending = 0;
+            pthread_cond_broadcast(&sp->done_cond);
+        }
+        else
+        {
+            pthread_cond_wait(&sp->work_cond, &sp->lock);
+        }
+    }
+    pthread_mutex_unlock(&sp->lock);
+
+    stripe_close(s);
+    return NULL;
+}
+
+static void striper_stop(striper_t *sp)
+{
+    int i;
+
+    pthread_mutex_lock(&sp->lock);
+    sp->stop = 1;
+    pthread_cond_broadcast(&sp->work_cond);
+    pthread_mutex_unlock(&sp->lock);
+    for (i = 0; i < sp->nstripes; i++)
+        pthread_join(sp->stripes[i].thread, NULL);
+    sp->nstripes = 0;
+    sp->stop = 0;
+}
+
+// Starts one thread per directory in the comma separated list dirs, up to
+//   max_stripes. Returns the number of stripes
+static int striper_start(striper_t *sp, const char *dirs, int max_stripes)
+{
+    char list[DATADIRS_LENGTH];
+    char *dir, *save = NULL;
+
+    snprintf(list, sizeof (list), "%s", dirs);
+    for (dir = strtok_r(list, ", ", &save); dir != NULL; dir = strtok_r(NULL, ", ", &save))
+    {
+        if (sp->nstripes >= max_stripes)
+        {
+            hashpipe_warn(__FUNCTION__, "only %d of the DATADIRS can be used; ignoring %s",
+                          max_stripes, dir);
+            continue;
+        }
+        stripe_t *s = &sp->stripes[sp->nstripes];
+        memset(s, 0, sizeof (*s));
+        s->owner = sp;
+        s->idx = sp->nstripes;
+        snprintf(s->dir, sizeof (s->dir), "%s", dir);
+        if (pthread_create(&s->thread, NULL, stripe_main, s) != 0)
+        {
+            hashpipe_error(__FUNCTION__, "cannot start a writer for %s", dir);
+            break;
+        }
+        sp->nstripes++;
+    }
+    return sp->nstripes;
+}
+
+static void record_latency(histogram_t *latency, const gpu_output_databuf_block_header_t *header)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    histogram_add(latency, ELAPSED_NS(header->fill_stop, now));
+    metrics_observe(&sim1_metrics.latency, ELAPSED_NS(header->fill_stop, now));
+}
+
+// Frees a block. chans_ready must be cleared first so that a stale count
+//   is never mistaken for the next fill
+static void release_block(gpu_output_databuf_t *db, int block_idx)
+{
+    gpu_output_databuf_block_t *block = &db->block[block_idx];
+
+    __atomic_store_n(&block->header.chans_ready, 0, __ATOMIC_RELEASE);
+    clock_gettime(CLOCK_MONOTONIC, &block->header.freed);
+    gpu_output_databuf_set_free(db, block_idx);
+}
+
+// Waits for the oldest job's row to be written
+static void retire_oldest(striper_t *sp, histogram_t *latency)
+{
+    stripe_job_t *job;
+
+    pthread_mutex_lock(&sp->lock);
+    job = &sp->jobs[sp->next_retire % STRIPE_MAX];
+    while (!job->done)
+        pthread_cond_wait(&sp->done_cond, &sp->lock);
+    pthread_mutex_unlock(&sp->lock);
+
+    record_latency(latency, &job->block->header);
+
+    pthread_mutex_lock(&sp->lock);
+    sp->next_retire++;
+    pthread_mutex_unlock(&sp->lock);
+}
+
+// Copies a block into the next job and hands it to its stripe. Returns
+//   -1 if the copy could not be allocated
+static int submit(striper_t *sp, const gpu_output_databuf_block_t *block, int scan_row)
+{
+    stripe_job_t *job;
+
+    // The job is retired, so its stripe no longer reads the copy
+    job = &sp->jobs[sp->next_submit % STRIPE_MAX];
+    if (job->block == NULL)
+    {
+        // Zeroed, since only the valid data is copied
+        job->block = calloc(1, sizeof (gpu_output_databuf_block_t));
+        if (job->block == NULL)
+            return -1;
+    }
+    job->block->header = block->header;
+    block_kernels->copy(block_kernels, job->block->data, block->data);
+
+    pthread_mutex_lock(&sp->lock);
+    job->stripe = scan_row % sp->nstripes;
+    job->row = scan_row / sp->nstripes;
+    job->claimed = 0;
+    job->done = 0;
+    sp->next_submit++;
+    pthread_cond_broadcast(&sp->work_cond);
+    pthread_mutex_unlock(&sp->lock);
+    return 0;
+}
+
+// Names the parts of a scan and has every stripe create its part
+static void open_scan(striper_t *sp, const gpu_output_databuf_block_header_t *header)
+{
+    scan_entry_t entry;
+    char base[256];
+    int i;
+
+    sp->scan_num = header->scan_num;
+    sp->sched_idx = header->sched_idx;
+    sp->acc_len = header->acc_len > 0 ? header->acc_len : 1;
+    sp->rows_total = (header->scan_nblocks + sp->acc_len - 1) / sp->acc_len;
+    sp->scan_duration = (int)(header->scan_nblocks * INT_TIME + 0.5);
+    sp->scan_name[0] = '\0';
+
+    if (header->sched_idx >= 0 && scan_sched_get(header->sched_idx, &entry) == 0)
+    {
+        snprintf(sp->scan_name, sizeof (sp->scan_name), "%s", entry.name);
+        snprintf(base, sizeof (base), "scan%d_%s", sp->scan_num, entry.name);
+    }
+    else
+    {
+        snprintf(base, sizeof (base), "scan%d", sp->scan_num);
+    }
+
+    pthread_mutex_lock(&sp->lock);
+    for (i = 0; i < sp->nstripes; i++)
+    {
+        stripe_t *s = &sp->stripes[i];
+        // Each part gets every nstripes'th row, starting from row i
+        s->nrows = (sp->rows_total - i + sp->nstripes - 1) / sp->nstripes;
+        if (s->nrows < 1)
+            s->nrows = 1;
+        snprintf(s->filename, sizeof (s->filename), "%s/%s_p%d.fits", s->dir, base, i);
+        s->open_pending = 1;
+    }
+    pthread_cond_broadcast(&sp->work_cond);
+    pthread_mutex_unlock(&sp->lock);
+
+    sim_clock_now(&sp->scan_start);
+    sp->scan_open = 1;
+    fprintf(stderr, "Writing scan %d in %d stripes\n", sp->scan_num, sp->nstripes);
+}
+
+// The manifest lists the parts of a scan in stripe order with the number
+//   of rows written to each:
+//     SIM1STRIPES 1
+//     SCANNUM <scan number>
+//     SCANNAME <name>            (scheduled scans only)
+//     NPARTS <K>
+//     NROWS <rows in the whole scan>
+//     PART <stripe> <rows> <file>
+//   Row r of the scan (from 0) is row r / K of part r % K.
+static void write_manifest(striper_t *sp, int rows)
+{
+    char filename[512];
+    FILE *f;
+    int i;
+
+    snprintf(filename, sizeof (filename), "%s", sp->stripes[0].filename);
+    // "<dir>/<base>_p0.fits" becomes "<dir>/<base>.manifest"
+    filename[strlen(filename) - strlen("_p0.fits")] = '\0';
+    strncat(filename, ".manifest", sizeof (filename) - strlen(filename) - 1);
+
+    f = fopen(filename, "w");
+    if (f == NULL)
+    {
+        hashpipe_error(__FUNCTION__, "cannot write %s", filename);
+        return;
+    }
+    fprintf(f, "SIM1STRIPES 1\n");
+    fprintf(f, "SCANNUM %d\n", sp->scan_num);
+    if (sp->scan_name[0] != '\0')
+        fprintf(f, "SCANNAME %s\n", sp->scan_name);
+    fprintf(f, "NPARTS %d\n", sp->nstripes);
+    fprintf(f, "NROWS %d\n", rows);
+    for (i = 0; i < sp->nstripes; i++)
+        fprintf(f, "PART %d %d %s\n", i, sp->stripes[i].rows_written, sp->stripes[i].filename);
+    fclose(f);
+}
+
+// Waits for every row to be written, closes the parts and reports
+static void close_scan(striper_t *sp, histogram_t *latency, hashpipe_status_t *st)
+{
+    struct timespec stop;
+    double secs, mbps;
+    uint64_t busy_max = 0;
+    int rows = 0;
+    int i;
+
+    while (sp->next_retire < sp->next_submit)
+        retire_oldest(sp, latency);
+
+    pthread_mutex_lock(&sp->lock);
+    for (i = 0; i < sp->nstripes; i++)
+        sp->stripes[i].close_pending = 1;
+    pthread_cond_broadcast(&sp->work_cond);
+    for (i = 0; i < sp->nstripes; i++)
+        while (sp->stripes[i].close_pending)
+            pthread_cond_wait(&sp->done_cond, &sp->lock);
+    pthread_mutex_unlock(&sp->lock);
+
+    sim_clock_now(&stop);
+    for (i = 0; i < sp->nstripes; i++)
+    {
+        rows += sp->stripes[i].rows_written;
+        if (sp->stripes[i].busy_ns > busy_max)
+            busy_max = sp->stripes[i].busy_ns;
+    }
+    write_manifest(sp, rows);
+    sp->scan_open = 0;
+    if (sp->sched_idx >= 0)
+        scan_sched_retire(sp->sched_idx);
+
+    // The busiest stripe sets the rate the parts could sustain together
+    secs = ELAPSED_NS(sp->scan_start, stop) / 1e9;
+    mbps = busy_max > 0 ? rows * (double)VALID_DATA_BYTES / (busy_max / 1e9) / 1e6 : 0;
+    fprintf(stderr, "Scan %d: %d rows in %d stripes over %.1f s; stripes could sustain %.1f MB/s\n",
+            sp->scan_num, rows, sp->nstripes, secs, mbps);
+    histogram_print(stderr, "Producer to writer latency", latency);
+
+    hashpipe_status_lock_safe(st);
+    hputr4(st->buf, "STRMBPS", mbps);
+    hputi4(st->buf, "WLATP99", histogram_percentile(latency, 99.0) / 1000);
+    hashpipe_status_unlock_safe(st);
+    histogram_reset(latency);
+}
+
+static void *run(hashpipe_thread_args_t * args)
+{
+    gpu_output_databuf_t *db = (gpu_output_databuf_t *)args->ibuf;
+    hashpipe_status_t st = args->st;
+    const char * status_key = args->thread_desc->skey;
+
+    int rv;
+    int block_idx = 0;
+    int scan_row;
+    int last;
+    int max_stripes = STRIPE_MAX;
+    gpu_output_databuf_block_t *block;
+    char dirs[DATADIRS_LENGTH] = "";
+    char new_dirs[DATADIRS_LENGTH];
+    histogram_t latency;
+
+    striper_t *sp = calloc(1, sizeof (striper_t));
+    if (sp == NULL)
+    {
+        hashpipe_error(__FUNCTION__, "out of memory");
+        return NULL;
+    }
+    pthread_mutex_init(&sp->lock, NULL);
+    pthread_cond_init(&sp->work_cond, NULL);
+    pthread_cond_init(&sp->done_cond, NULL);
+    histogram_reset(&latency);
+
+    // Each stripe's thread makes its own CFITSIO calls
+    if (!fits_is_reentrant())
+    {
+        hashpipe_warn(__FUNCTION__, "CFITSIO was not built with --enable-reentrant; "
+                      "writing to the first of DATADIRS only");
+        max_stripes = 1;
+    }
+
+    while (run_threads())
+    {
+        while ((rv=gpu_output_databuf_wait_filled(db, block_idx)) != HASHPIPE_OK)
+        {
+            if (rv==HASHPIPE_TIMEOUT) {
+                hashpipe_status_lock_safe(&st);
+                hputs(st.buf, status_key, "waiting");
+                hashpipe_status_unlock_safe(&st);
+                if (!run_threads())
+                    break;
+                continue;
+            }
+            else
+            {
+                hashpipe_error(__FUNCTION__, "error waiting for filled databuf");
+                pthread_exit(NULL);
+            }
+        }
+        if (rv != HASHPIPE_OK)
+            break;
+        gpu_output_databuf_claim(db, block_idx);
+        block = &db->block[block_idx];
+
+        // A new scan, possibly cutting the previous one short
+        if (block->header.scan_block == 0 || (sp->scan_open && block->header.scan_num != sp->scan_num))
+        {
+            if (sp->scan_open)
+                close_scan(sp, &latency, &st);
+
+            // The stripes can only change between scans
+            strcpy(new_dirs, "");
+            hashpipe_status_lock_safe(&st);
+            hgets(st.buf, "DATADIRS", sizeof (new_dirs), new_dirs);
+            hashpipe_status_unlock_safe(&st);
+            if (strcmp(new_dirs, dirs) != 0 || sp->nstripes == 0)
+            {
+                striper_stop(sp);
+                strcpy(dirs, new_dirs);
+                if (striper_start(sp, dirs, max_stripes) == 0)
+                    hashpipe_error(__FUNCTION__, "DATADIRS (%s) names no directories", dirs);
+            }
+            if (sp->nstripes > 0)
+                open_scan(sp, &block->header);
+        }
+
+        hashpipe_status_lock_safe(&st);
+        hputs(st.buf, status_key, "writing");
+        hashpipe_status_unlock_safe(&st);
+
+        if (!sp->scan_open)
+        {
+            record_latency(&latency, &block->header);
+            release_block(db, block_idx);
+            block_idx = (block_idx + 1) % NUM_BLOCKS;
+            continue;
+        }
+
+        // Rows go to the stripes in turn, so with one row in flight per
+        //   stripe the oldest is the one the next row's stripe is writing
+        while (sp->next_submit - sp->next_retire >= (uint64_t)sp->nstripes)
+            retire_oldest(sp, &latency);
+
+        scan_row = block->header.scan_block / sp->acc_len;
+        last = block->header.scan_block + sp->acc_len >= block->header.scan_nblocks;
+        if (submit(sp, block, scan_row) != 0)
+        {
+            hashpipe_error(__FUNCTION__, "out of memory; row %d is lost", scan_row);
+            record_latency(&latency, &block->header);
+        }
+        // The row is written from the copy
+        release_block(db, block_idx);
+
+        if (last)
+            close_scan(sp, &latency, &st);
+
+        block_idx = (block_idx + 1) % NUM_BLOCKS;
+    }
+
+    if (sp->scan_open)
+        close_scan(sp, &latency, &st);
+    striper_stop(sp);
+    for (block_idx = 0; block_idx < STRIPE_MAX; block_idx++)
+        free(sp->jobs[block_idx].block);
+    free(sp);
+    return THREAD_OK;
+}
+
+static hashpipe_thread_desc_t striped_writer_thread = {
+    name: "striped_writer_thread",
+    skey: "STRPSTAT",
+    init: NULL,
+    run:  run,
+    ibuf_desc: {gpu_output_databuf_create},
+    obuf_desc: {NULL}
+};
+
+static __attribute__((constructor)) void ctor()
+{
+  register_hashpipe_thread(&striped_writer_thread);
+}
@@ -0,0 +1,164 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "wait_policy.h"
+#include "metrics.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+void wait_policy_configure(wait_policy_t *wp, hashpipe_status_t *st)
+{
+    char mode[16] = "block";
+
+    wp->spin_us = WAIT_SPIN_DEFAULT_US;
+    hashpipe_status_lock_safe(st);
+    hgets(st->buf, "WAITPOL", sizeof (mode), mode);
+    hgeti4(st->buf, "WAITSPIN", &wp->spin_us);
+    hashpipe_status_unlock_safe(st);
+
+    if (strcmp(mode, "spin") == 0)
+        wp->mode = WAIT_SPIN;
+    else if (strcmp(mode, "adaptive") == 0)
+        wp->mode = WAIT_ADAPTIVE;
+    else
+    {
+        if (strcmp(mode, "block") != 0)
+            hashpipe_warn(__FUNCTION__, "unknown WAITPOL %s; blocking", mode);
+        wp->mode = WAIT_BLOCK;
+    }
+    if (wp->spin_us < 0)
+        wp->spin_us = 0;
+
+    histogram_reset(&wp->wakeup);
+    wp->spun = 0;
+    wp->slept = 0;
+}
+
+const char *wait_policy_name(const wait_policy_t *wp)
+{
+    switch (wp->mode)
+    {
+    case WAIT_SPIN:     return "spin";
+    case WAIT_ADAPTIVE: return "adaptive";
+    default:            return "block";
+    }
+}
+
+// Semaphore values are 0 for free blocks and non-zero for filled ones
+static int block_ready(gpu_output_databuf_t *db, int block_idx, int filled)
+{
+    int status = gpu_output_databuf_block_status(db, block_idx);
+    return filled ? status != 0 : status == 0;
+}
+
+static int wait_block(wait_policy_t *wp, gpu_output_databuf_t *db, int block_idx, int filled)
+{
+    gpu_output_databuf_block_header_t *header = &db->block[block_idx].header;
+    metrics_histogram_t *waited = filled ? &sim1_metrics.wait_filled : &sim1_metrics.wait_free;
+    struct timespec start, now;
+    int64_t budget;
+    int spun = 0;
+    int rv;
+
+    // Nothing to measure if the block was already there
+    if (block_ready(db, block_idx, filled))
+    {
+        metrics_observe(waited, 0);
+        return filled ? gpu_output_databuf_wait_filled(db, block_idx)
+                      : gpu_output_databuf_wait_free(db, block_idx);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (wp->mode != WAIT_BLOCK)
+    {
+        budget = wp->mode == WAIT_SPIN ? WAIT_SPIN_TIMEOUT_NS : wp->spin_us * 1000LL;
+        do
+        {
+            cpu_relax();
+            if (block_ready(db, block_idx, filled))
+            {
+                spun = 1;
+                break;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        } while (ELAPSED_NS(start, now) < budget);
+
+        if (!spun && wp->mode == WAIT_SPIN)
+        {
+            metrics_observe(waited, ELAPSED_NS(start, now));
+            return HASHPIPE_TIMEOUT;
+        }
+    }
+
+    // Returns at once if we saw the block arrive while spinning
+    rv = filled ? gpu_output_databuf_wait_filled(db, block_idx)
+                : gpu_output_databuf_wait_free(db, block_idx);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // Timeouts count too, so that the sum is the whole time spent waiting
+    metrics_observe(waited, ELAPSED_NS(start, now));
+    if (rv == HASHPIPE_OK)
+    {
+        histogram_add(&wp->wakeup, ELAPSED_NS((filled ? header->fill_stop : header->freed), now));
+        if (spun)
+            wp->spun++;
+        else
+            wp->slept++;
+    }
+    return rv;
+}
+
+int wait_policy_filled(wait_policy_t *wp, gpu_output_databuf_t *db, int block_idx)
+{
+    return wait_block(wp, db, block_idx, 1);
+}
+
+int wait_policy_free(wait_policy_t *wp, gpu_output_databuf_t *db, int block_idx)
+{
+    return wait_block(wp, db, block_idx, 0);
+}
+
+void wait_policy_report(wait_policy_t *wp, hashpipe_status_t *st, const char *name,
+                        const char *p50_key, const char *p99_key)
+{
+    char title[128];
+
+    snprintf(title, sizeof (title), "%s wakeup (%s, %llu spun, %llu slept)", name,
+             wait_policy_name(wp), (unsigned long long)wp->spun, (unsigned long long)wp->slept);
+    histogram_print(stderr, title, &wp->wakeup);
+
+    hashpipe_status_lock_safe(st);
+    hputi4(st->buf, p50_key, histogram_percentile(&wp->wakeup, 50.0));
+    hputi4(st->buf, p99_key, histogram_percentile(&wp->wakeup, 99.0));
+    hashpipe_status_unlock_safe(st);
+
+    histogram_reset(&wp->wakeup);
+    wp->spun = 0;
+    wp->slept = 0;
+}
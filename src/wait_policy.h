@@ -0,0 +1,77 @@
+//# Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+//#
+//# This program is free software; you can redistribute it and/or modify
+//# it under the terms of the GNU General Public License as published by
+//# the Free Software Foundation; either version 2 of the License, or
+//# (at your option) any later version.
+//#
+//# This program is distributed in the hope that it will be useful, but
+//# WITHOUT ANY WARRANTY; without even the implied warranty of
+//# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+//# General Public License for more details.
+//#
+//# You should have received a copy of the GNU General Public License
+//# along with this program; if not, write to the Free Software
+//# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+//#
+//# Correspondence concerning GBT software should be addressed as follows:
+//# GBT Operations
+//# National Radio Astronomy Observatory
+//# P. O. Box 2
+//# Green Bank, WV 24944-0002 USA
+
+#ifndef WAIT_POLICY_H
+#define WAIT_POLICY_H
+
+#include <stdint.h>
+
+#include "hashpipe.h"
+#include "gpu_output_databuf.h"
+#include "histogram.h"
+
+// How a thread waits for a ring block to change hands (WAITPOL):
+//   WAIT_BLOCK     sleep on the databuf semaphore (hashpipe's wait_filled
+//                  and wait_free), as before
+//   WAIT_SPIN      poll the block's state without sleeping, keeping a core
+//                  busy for the lowest handoff latency
+//   WAIT_ADAPTIVE  poll for up to WAITSPIN us, then sleep
+// Spinning polls the semaphore value rather than calling the databuf
+//   busywait routines, which never return if the block doesn't arrive;
+//   like the sleeping waits, a spin gives up with HASHPIPE_TIMEOUT after
+//   WAIT_SPIN_TIMEOUT_NS so that the caller can update its status.
+typedef enum wait_mode {
+    WAIT_BLOCK,
+    WAIT_SPIN,
+    WAIT_ADAPTIVE
+} wait_mode_t;
+
+#define WAIT_SPIN_DEFAULT_US 50
+#define WAIT_SPIN_TIMEOUT_NS (250000000LL)
+
+typedef struct wait_policy {
+    wait_mode_t mode;
+    int spin_us;
+    // Time from the block changing hands (its fill_stop or freed stamp) to
+    //   the waiter returning, for waits that were not satisfied at once
+    histogram_t wakeup;
+    // How many of those waits ended while spinning and while asleep
+    uint64_t spun;
+    uint64_t slept;
+} wait_policy_t;
+
+// Reads WAITPOL and WAITSPIN and clears the statistics
+void wait_policy_configure(wait_policy_t *wp, hashpipe_status_t *st);
+
+// Drop-in replacements for gpu_output_databuf_wait_filled() and
+//   gpu_output_databuf_wait_free()
+int wait_policy_filled(wait_policy_t *wp, gpu_output_databuf_t *db, int block_idx);
+int wait_policy_free(wait_policy_t *wp, gpu_output_databuf_t *db, int block_idx);
+
+const char *wait_policy_name(const wait_policy_t *wp);
+
+// Prints the wakeup latencies, publishes their median and 99th
+//   percentile in ns under the given status keys, and clears them
+void wait_policy_report(wait_policy_t *wp, hashpipe_status_t *st, const char *name,
+                        const char *p50_key, const char *p99_key);
+
+#endif